@@ -10,6 +10,9 @@
 /* Define to 1 if you have the 'usb' library (-lusb). */
 /* #undef HAVE_LIBUSB */
 
+/* Define to 1 if you have liblzma, for xz compressed images (-llzma). */
+/* #undef HAVE_LZMA */
+
 /* Define to 1 if you have the 'nanosleep' function. */
 #define HAVE_NANOSLEEP 1
 
@@ -43,6 +46,12 @@
 /* Define to 1 if you have the <windows.h> header file. */
 /* #undef HAVE_WINDOWS_H */
 
+/* Define to 1 if you have zlib, for gzip compressed images (-lz). */
+/* #undef HAVE_ZLIB */
+
+/* Define to 1 if you have libzstd, for zstd compressed images (-lzstd). */
+/* #undef HAVE_ZSTD */
+
 /* Name of package */
 #define PACKAGE "dfu-util"
 
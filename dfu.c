@@ -35,6 +35,53 @@
 
 static int dfu_timeout = 5000; /* 5 seconds - default */
 
+/* Retries of a failed block transfer, and how many of them succeeded */
+int dfu_retry_limit = 3;
+unsigned int dfu_retry_count = 0;
+
+/* Compare with the device first and skip the download if it matches */
+int dfu_skip_if_same = 0;
+
+/* Errors that long cables and busy hubs cause now and then */
+int dfu_transient_error(int error) {
+  return error == LIBUSB_ERROR_TIMEOUT || error == LIBUSB_ERROR_PIPE ||
+         error == LIBUSB_ERROR_IO || error == LIBUSB_ERROR_OVERFLOW ||
+         error == LIBUSB_ERROR_INTERRUPTED;
+}
+
+/* Fits a transfer size to what the host and the device can handle */
+unsigned int dfu_limit_transfer_size(const struct dfu_if *dif,
+                                     const char *what, unsigned int size) {
+#ifdef __linux__
+  /* limited to 4k in libusb Linux backend */
+  if (size > 4096) {
+    size = 4096;
+    printf("Limited %stransfer size to %i\n", what, size);
+  }
+#endif /* __linux__ */
+
+  if (size < dif->bMaxPacketSize0) {
+    size = dif->bMaxPacketSize0;
+    printf("Adjusted %stransfer size to %i\n", what, size);
+  }
+  return size;
+}
+
+/* Any class request to the DFU interface, returns the number of bytes
+ * transferred or < 0 on error */
+int dfu_request(struct dfu_if *dif, uint8_t direction, uint8_t request,
+                uint16_t value, unsigned char *data, uint16_t length) {
+  return libusb_control_transfer(dif->dev_handle,
+                                 /* bmRequestType */ direction |
+                                     LIBUSB_REQUEST_TYPE_CLASS |
+                                     LIBUSB_RECIPIENT_INTERFACE,
+                                 /* bRequest      */ request,
+                                 /* wValue        */ value,
+                                 /* wIndex        */ dif->interface,
+                                 /* Data          */ data,
+                                 /* wLength       */ length, dfu_timeout);
+}
+
 /*
  *  DFU_DETACH Request (DFU Spec 1.0, Section 5.1)
  *
@@ -143,20 +190,25 @@ int dfu_get_status(struct dfu_if *dif, struct dfu_status *status) {
                                    /* Data          */ buffer,
                                    /* wLength       */ 6, dfu_timeout);
 
-  if (6 == result) {
-    status->bStatus = buffer[0];
-    if (dif->quirks & QUIRK_POLLTIMEOUT)
-      status->bwPollTimeout = DEFAULT_POLLTIMEOUT;
-    else
-      status->bwPollTimeout = ((0xff & buffer[3]) << 16) |
-                              ((0xff & buffer[2]) << 8) | (0xff & buffer[1]);
-    status->bState = buffer[4];
-    status->iString = buffer[5];
-  }
+  if (6 == result)
+    dfu_decode_status(dif, buffer, status);
 
   return result;
 }
 
+/* Fill in the status from a 6 byte DFU_GETSTATUS response */
+void dfu_decode_status(struct dfu_if *dif, const unsigned char *buffer,
+                       struct dfu_status *status) {
+  status->bStatus = buffer[0];
+  if (dif->quirks & QUIRK_POLLTIMEOUT)
+    status->bwPollTimeout = DEFAULT_POLLTIMEOUT;
+  else
+    status->bwPollTimeout = ((0xff & buffer[3]) << 16) |
+                            ((0xff & buffer[2]) << 8) | (0xff & buffer[1]);
+  status->bState = buffer[4];
+  status->iString = buffer[5];
+}
+
 /*
  *  DFU_CLRSTATUS Request (DFU Spec 1.0, Section 6.1.3)
  *
@@ -66,6 +66,12 @@
 #define DFU_GETSTATE    5
 #define DFU_ABORT       6
 
+/* Delay before the first retry of a failed transfer, doubled on each */
+#define DFU_RETRY_DELAY 10
+
+/* Returned by a download that found the image already on the device */
+#define DFU_IMAGE_ON_DEVICE 1
+
 /* DFU interface */
 #define DFU_IFF_DFU             0x0001  /* DFU Mode, (not Runtime) */
 #define DFU_IFF_ALT             0x0002  /* Multiple alternate settings */
@@ -104,8 +110,15 @@ struct dfu_if {
     libusb_device_handle *dev_handle;
     struct dfu_if *next;
     struct memsegment *mem_layout; /* for DfuSe */
+    uint32_t desc_digest; /* for the descriptor cache */
 };
 
+int dfu_request( struct dfu_if *dif,
+                 uint8_t direction,
+                 uint8_t request,
+                 uint16_t value,
+                 unsigned char *data,
+                 uint16_t length );
 int dfu_detach( libusb_device_handle *device,
                 const unsigned short interface,
                 const unsigned short timeout );
@@ -121,6 +134,9 @@ int dfu_upload( libusb_device_handle *device,
                 unsigned char* data );
 int dfu_get_status( struct dfu_if *dif,
                     struct dfu_status *status );
+void dfu_decode_status( struct dfu_if *dif,
+                        const unsigned char *buffer,
+                        struct dfu_status *status );
 int dfu_clear_status( libusb_device_handle *device,
                       const unsigned short interface );
 int dfu_get_state( libusb_device_handle *device,
@@ -133,4 +149,13 @@ const char *dfu_state_to_string( int state );
 
 const char *dfu_status_to_string( int status );
 
+extern int dfu_retry_limit;
+extern unsigned int dfu_retry_count;
+extern int dfu_skip_if_same;
+
+int dfu_transient_error( int error );
+unsigned int dfu_limit_transfer_size( const struct dfu_if *dif,
+                                      const char *what,
+                                      unsigned int size );
+
 #endif /* DFU_H */
@@ -0,0 +1,407 @@
+/*
+ * On-disk cache of device descriptor strings, DfuSe memory layouts
+ * and learned erase timings, so that repeated runs on the same
+ * product need not read and parse them again.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <libusb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include "dfu.h"
+#include "dfu_cache.h"
+#include "dfu_file.h"
+#include "dfuse_mem.h"
+#include "portable.h"
+
+#define CACHE_MAGIC "dfu-util cache 1"
+#define MAX_CACHE_LINE 512
+
+int dfu_cache_enabled = 0;
+
+/* Digest of the configuration descriptors, which change with the firmware
+ * even if nobody remembered to bump bcdDevice */
+uint32_t dfu_cache_digest(libusb_device *dev,
+                          const struct libusb_device_descriptor *desc) {
+  struct libusb_config_descriptor *cfg;
+  uint32_t crc = 0xffffffff;
+  uint8_t buf[8];
+  int cfg_idx, intf_idx, alt_idx;
+
+  buf[0] = desc->bNumConfigurations;
+  buf[1] = desc->iSerialNumber;
+  crc = dfu_file_crc(crc, buf, 2);
+
+  for (cfg_idx = 0; cfg_idx != desc->bNumConfigurations; cfg_idx++) {
+    if (libusb_get_config_descriptor(dev, cfg_idx, &cfg) != 0 || !cfg)
+      break;
+    buf[0] = cfg->bConfigurationValue;
+    buf[1] = cfg->bNumInterfaces;
+    crc = dfu_file_crc(crc, buf, 2);
+    crc = dfu_file_crc(crc, cfg->extra, cfg->extra_length);
+    for (intf_idx = 0; intf_idx < cfg->bNumInterfaces; intf_idx++) {
+      const struct libusb_interface *uif = &cfg->interface[intf_idx];
+
+      for (alt_idx = 0; alt_idx < uif->num_altsetting; alt_idx++) {
+        const struct libusb_interface_descriptor *intf =
+            &uif->altsetting[alt_idx];
+
+        buf[0] = intf->bInterfaceNumber;
+        buf[1] = intf->bAlternateSetting;
+        buf[2] = intf->bInterfaceClass;
+        buf[3] = intf->bInterfaceSubClass;
+        buf[4] = intf->bInterfaceProtocol;
+        buf[5] = intf->iInterface;
+        crc = dfu_file_crc(crc, buf, 6);
+        crc = dfu_file_crc(crc, intf->extra, intf->extra_length);
+      }
+    }
+    libusb_free_config_descriptor(cfg);
+  }
+  return crc;
+}
+
+static int cache_mkdir(const char *path) {
+#ifdef HAVE_WINDOWS_H
+  if (mkdir(path) == 0 || errno == EEXIST)
+#else
+  if (mkdir(path, 0755) == 0 || errno == EEXIST)
+#endif
+    return 0;
+  return -1;
+}
+
+/* Path of the cache file, directories are created if create is set */
+static char *cache_path(uint16_t vendor, uint16_t product, uint16_t bcdDevice,
+                        const char *serial_name, int create) {
+  const char *base;
+  const char *sub = "";
+  char *path;
+  char *p;
+  size_t len;
+
+  base = getenv("XDG_CACHE_HOME");
+  if (!base || !*base) {
+    base = getenv("HOME");
+    sub = "/.cache";
+  }
+  if (!base || !*base) {
+    base = getenv("LOCALAPPDATA");
+    sub = "";
+  }
+  if (!base || !*base)
+    return NULL;
+
+  len = strlen(base) + strlen(sub) + strlen(serial_name) + 40;
+  path = dfu_malloc(len);
+  snprintf(path, len, "%s%s", base, sub);
+  if (create && cache_mkdir(path) < 0) {
+    free(path);
+    return NULL;
+  }
+  strcat(path, "/dfu-util");
+  if (create && cache_mkdir(path) < 0) {
+    free(path);
+    return NULL;
+  }
+  p = path + strlen(path);
+  snprintf(p, len - (p - path), "/%04x-%04x-%04x-%s", vendor, product,
+           bcdDevice, serial_name);
+  /* keep the serial number from escaping the directory */
+  for (p += 16; *p; p++) {
+    if (!((*p >= '0' && *p <= '9') || (*p >= 'a' && *p <= 'z') ||
+          (*p >= 'A' && *p <= 'Z') || *p == '-' || *p == '_'))
+      *p = '_';
+  }
+  return path;
+}
+
+static struct dfu_cache_alt *cache_find_alt(const struct dfu_cache *cache,
+                                            int interface, int altsetting) {
+  struct dfu_cache_alt *alt;
+
+  for (alt = cache->alts; alt; alt = alt->next) {
+    if (alt->interface == interface && alt->altsetting == altsetting)
+      return alt;
+  }
+  return NULL;
+}
+
+static struct dfu_cache_alt *cache_add_alt(struct dfu_cache *cache,
+                                           int interface, int altsetting) {
+  struct dfu_cache_alt *alt;
+  struct dfu_cache_alt **last;
+
+  alt = cache_find_alt(cache, interface, altsetting);
+  if (alt)
+    return alt;
+
+  alt = dfu_malloc(sizeof(*alt));
+  memset(alt, 0, sizeof(*alt));
+  alt->interface = interface;
+  alt->altsetting = altsetting;
+  for (last = &cache->alts; *last; last = &(*last)->next)
+    ;
+  *last = alt;
+  return alt;
+}
+
+static struct memsegment *cache_copy_layout(const struct memsegment *list) {
+  struct memsegment *copy = NULL;
+
+  for (; list; list = list->next)
+    add_segment(&copy, *list);
+  return copy;
+}
+
+void dfu_cache_free(struct dfu_cache *cache) {
+  struct dfu_cache_alt *alt;
+
+  if (!cache)
+    return;
+  while (cache->alts) {
+    alt = cache->alts;
+    cache->alts = alt->next;
+    free(alt->name);
+    free_segment_list(alt->mem_layout);
+    free(alt);
+  }
+  free(cache->serial_name);
+  free(cache);
+}
+
+static struct dfu_cache *cache_new(uint16_t vendor, uint16_t product,
+                                   uint16_t bcdDevice, const char *serial_name,
+                                   uint32_t digest) {
+  struct dfu_cache *cache;
+
+  cache = dfu_malloc(sizeof(*cache));
+  memset(cache, 0, sizeof(*cache));
+  cache->vendor = vendor;
+  cache->product = product;
+  cache->bcdDevice = bcdDevice;
+  cache->digest = digest;
+  cache->serial_name = strdup(serial_name);
+  if (!cache->serial_name)
+    errx(EX_SOFTWARE, "Out of memory");
+  return cache;
+}
+
+/* Returns the cache entry of the device, or NULL if there is none that
+ * matches the device identity and descriptor digest */
+struct dfu_cache *dfu_cache_load(uint16_t vendor, uint16_t product,
+                                 uint16_t bcdDevice, const char *serial_name,
+                                 uint32_t digest) {
+  struct dfu_cache *cache;
+  struct dfu_cache_alt *alt;
+  struct memsegment seg;
+  char line[MAX_CACHE_LINE];
+  unsigned int intf, altsetting, v, p, b, d;
+  char *path;
+  FILE *f;
+  int n;
+
+  if (!dfu_cache_enabled || !serial_name)
+    return NULL;
+  path = cache_path(vendor, product, bcdDevice, serial_name, 0);
+  if (!path)
+    return NULL;
+  f = fopen(path, "r");
+  free(path);
+  if (!f)
+    return NULL;
+
+  if (!fgets(line, sizeof(line), f) || strncmp(line, CACHE_MAGIC "\n",
+                                               sizeof(CACHE_MAGIC))) {
+    fclose(f);
+    return NULL;
+  }
+  if (!fgets(line, sizeof(line), f) ||
+      sscanf(line, "device %x %x %x %x%n", &v, &p, &b, &d, &n) != 4 ||
+      line[n] != ' ' || v != vendor || p != product || b != bcdDevice || d != digest) {
+    fclose(f);
+    return NULL;
+  }
+  line[strcspn(line, "\n")] = '\0';
+  if (strcmp(line + n + 1, serial_name)) {
+    fclose(f);
+    return NULL;
+  }
+
+  cache = cache_new(vendor, product, bcdDevice, serial_name, digest);
+  while (fgets(line, sizeof(line), f)) {
+    line[strcspn(line, "\n")] = '\0';
+    if (sscanf(line, "erase %u %u", &cache->erase_ms_per_kb,
+               &cache->mass_erase_ms) == 2)
+      continue;
+    if (sscanf(line, "alt %u %u%n", &intf, &altsetting, &n) == 2 &&
+        line[n] == ' ') {
+      alt = cache_add_alt(cache, intf, altsetting);
+      free(alt->name);
+      alt->name = strdup(line + n + 1);
+      if (!alt->name)
+        errx(EX_SOFTWARE, "Out of memory");
+      continue;
+    }
+    memset(&seg, 0, sizeof(seg));
+    if (sscanf(line, "segment %u %u %x %x %d %d", &intf, &altsetting,
+               &seg.start, &seg.end, &seg.pagesize, &seg.memtype) == 6) {
+      alt = cache_add_alt(cache, intf, altsetting);
+      add_segment(&alt->mem_layout, seg);
+      continue;
+    }
+    /* anything unexpected invalidates the whole entry */
+    dfu_cache_free(cache);
+    cache = NULL;
+    break;
+  }
+  fclose(f);
+  return cache;
+}
+
+struct dfu_cache *dfu_cache_load_dfu_if(const struct dfu_if *dif) {
+  return dfu_cache_load(dif->vendor, dif->product, dif->bcdDevice,
+                        dif->serial_name, dif->desc_digest);
+}
+
+const char *dfu_cache_alt_name(const struct dfu_cache *cache, int interface,
+                               int altsetting) {
+  struct dfu_cache_alt *alt;
+
+  if (!cache)
+    return NULL;
+  alt = cache_find_alt(cache, interface, altsetting);
+  return alt ? alt->name : NULL;
+}
+
+/* Returns a copy of the cached memory layout, or NULL */
+struct memsegment *dfu_cache_layout(const struct dfu_cache *cache,
+                                    int interface, int altsetting) {
+  struct dfu_cache_alt *alt;
+
+  if (!cache)
+    return NULL;
+  alt = cache_find_alt(cache, interface, altsetting);
+  return alt ? cache_copy_layout(alt->mem_layout) : NULL;
+}
+
+/*
+ * Merge what is known about the alternate settings of the device of dif
+ * into its cache entry. Timings of 0 keep the cached values. The file
+ * is replaced atomically so a concurrent or interrupted run never sees
+ * a partial entry.
+ */
+void dfu_cache_store(struct dfu_if *dif, unsigned int erase_ms_per_kb,
+                     unsigned int mass_erase_ms) {
+  struct dfu_cache *cache;
+  struct dfu_cache_alt *alt;
+  struct dfu_if *adif;
+  struct memsegment *seg;
+  char *path;
+  char *tmp;
+  FILE *f;
+  int fd;
+  int ret;
+
+  if (!dfu_cache_enabled || !dif->serial_name)
+    return;
+
+  cache = dfu_cache_load_dfu_if(dif);
+  if (!cache)
+    cache = cache_new(dif->vendor, dif->product, dif->bcdDevice,
+                      dif->serial_name, dif->desc_digest);
+  if (erase_ms_per_kb)
+    cache->erase_ms_per_kb = erase_ms_per_kb;
+  if (mass_erase_ms)
+    cache->mass_erase_ms = mass_erase_ms;
+
+  for (adif = dif; adif; adif = adif->next) {
+    if (adif->dev != dif->dev || !adif->alt_name ||
+        strchr(adif->alt_name, '\n'))
+      continue;
+    alt = cache_add_alt(cache, adif->interface, adif->altsetting);
+    if (!alt->name || strcmp(alt->name, adif->alt_name)) {
+      free(alt->name);
+      alt->name = strdup(adif->alt_name);
+      if (!alt->name)
+        errx(EX_SOFTWARE, "Out of memory");
+      /* a layout parsed from another name is no longer valid */
+      free_segment_list(alt->mem_layout);
+      alt->mem_layout = NULL;
+    }
+    if (adif->mem_layout) {
+      free_segment_list(alt->mem_layout);
+      alt->mem_layout = cache_copy_layout(adif->mem_layout);
+    }
+  }
+
+  path = cache_path(dif->vendor, dif->product, dif->bcdDevice,
+                    dif->serial_name, 1);
+  if (!path) {
+    dfu_cache_free(cache);
+    return;
+  }
+  /* a unique name, so that concurrent runs do not write the same file */
+  fd = dfu_file_open_temp(path, &tmp);
+  f = fd < 0 ? NULL : fdopen(fd, "w");
+  if (!f) {
+    if (fd >= 0) {
+      close(fd);
+      remove(tmp);
+    }
+    free(tmp);
+    free(path);
+    dfu_cache_free(cache);
+    return;
+  }
+  fprintf(f, CACHE_MAGIC "\n");
+  fprintf(f, "device %04x %04x %04x %08x %s\n", cache->vendor, cache->product,
+          cache->bcdDevice, cache->digest, cache->serial_name);
+  fprintf(f, "erase %u %u\n", cache->erase_ms_per_kb, cache->mass_erase_ms);
+  for (alt = cache->alts; alt; alt = alt->next) {
+    if (alt->name)
+      fprintf(f, "alt %u %u %s\n", alt->interface, alt->altsetting,
+              alt->name);
+    for (seg = alt->mem_layout; seg; seg = seg->next)
+      fprintf(f, "segment %u %u %08x %08x %d %d\n", alt->interface,
+              alt->altsetting, seg->start, seg->end, seg->pagesize,
+              seg->memtype);
+  }
+  ret = ferror(f);
+  if (fclose(f) || ret) {
+    remove(tmp);
+  } else {
+#ifdef HAVE_WINDOWS_H
+    /* rename() does not replace existing files here */
+    remove(path);
+#endif
+    if (rename(tmp, path))
+      remove(tmp);
+  }
+  free(tmp);
+  free(path);
+  dfu_cache_free(cache);
+}
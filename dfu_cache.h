@@ -0,0 +1,64 @@
+/* On-disk cache of device descriptor strings and memory layouts
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef DFU_CACHE_H
+#define DFU_CACHE_H
+
+#include <stdint.h>
+
+struct dfu_if;
+struct memsegment;
+
+/* What is known about one alternate setting */
+struct dfu_cache_alt {
+	uint8_t interface;
+	uint8_t altsetting;
+	char *name;
+	struct memsegment *mem_layout;
+	struct dfu_cache_alt *next;
+};
+
+/* Cache entry of a device, identified by its descriptors */
+struct dfu_cache {
+	uint16_t vendor;
+	uint16_t product;
+	uint16_t bcdDevice;
+	uint32_t digest;
+	char *serial_name;
+	/* learned DfuSe erase timings, 0 if unknown */
+	unsigned int erase_ms_per_kb;
+	unsigned int mass_erase_ms;
+	struct dfu_cache_alt *alts;
+};
+
+extern int dfu_cache_enabled;
+
+uint32_t dfu_cache_digest(libusb_device *dev,
+			  const struct libusb_device_descriptor *desc);
+struct dfu_cache *dfu_cache_load(uint16_t vendor, uint16_t product,
+				 uint16_t bcdDevice, const char *serial_name,
+				 uint32_t digest);
+struct dfu_cache *dfu_cache_load_dfu_if(const struct dfu_if *dif);
+const char *dfu_cache_alt_name(const struct dfu_cache *cache,
+			       int interface, int altsetting);
+struct memsegment *dfu_cache_layout(const struct dfu_cache *cache,
+				    int interface, int altsetting);
+void dfu_cache_store(struct dfu_if *dif, unsigned int erase_ms_per_kb,
+		     unsigned int mass_erase_ms);
+void dfu_cache_free(struct dfu_cache *cache);
+
+#endif /* DFU_CACHE_H */
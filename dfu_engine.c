@@ -0,0 +1,280 @@
+/*
+ * Event driven download to several DFU devices at once
+ *
+ * Every device runs its own instance of the download state machine in
+ * dfu_load.c, the one dfuload_do_dnload() steps with synchronous requests,
+ * advanced here by asynchronous control transfers on a single libusb event
+ * loop. Poll timeouts are timers, so one thread can keep dozens of devices
+ * busy. DfuSe devices and resumed downloads still need the single device
+ * path.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libusb.h>
+
+#include "dfu.h"
+#include "dfu_engine.h"
+#include "dfu_file.h"
+#include "dfu_load.h"
+#include "portable.h"
+#include "usb_dfu.h"
+
+#define ENGINE_TIMEOUT 5000 /* ms, same as the synchronous requests */
+#define ENGINE_MAX_WAIT 100 /* ms, longest time between timer checks */
+
+struct engine_dev {
+  struct dfuload_machine m;
+  char prefix[24];
+  struct libusb_transfer *transfer;
+  unsigned char *buf;
+  unsigned char *response; /* where the machine wants IN data */
+  int busy;                   /* a transfer is in flight */
+  unsigned long long wake_ms; /* time of the next request */
+  unsigned long long start_ms;
+  unsigned long long end_ms;
+};
+
+static void engine_fail(struct engine_dev *ed, const char *what,
+                        const char *why) {
+  warnx("%s%s (%s)", ed->prefix, what, why);
+  ed->m.state = DFULOAD_FAILED;
+  ed->end_ms = dfu_get_time_ms();
+}
+
+static void LIBUSB_CALL engine_cb(struct libusb_transfer *transfer);
+
+/* Submit the request of the current state */
+static void engine_issue(struct engine_dev *ed) {
+  struct dfuload_request req;
+  int ret;
+
+  dfuload_machine_request(&ed->m, &req);
+  libusb_fill_control_setup(ed->buf,
+                            req.direction | LIBUSB_REQUEST_TYPE_CLASS |
+                                LIBUSB_RECIPIENT_INTERFACE,
+                            req.request, req.value, ed->m.dif->interface,
+                            req.length);
+  if (req.direction == LIBUSB_ENDPOINT_OUT && req.length)
+    memcpy(ed->buf + LIBUSB_CONTROL_SETUP_SIZE, req.data, req.length);
+  ed->response = req.direction == LIBUSB_ENDPOINT_IN ? req.data : NULL;
+  libusb_fill_control_transfer(ed->transfer, ed->m.dif->dev_handle, ed->buf,
+                               engine_cb, ed, ENGINE_TIMEOUT);
+  ret = libusb_submit_transfer(ed->transfer);
+  if (ret < 0) {
+    engine_fail(ed, "Cannot submit request", libusb_error_name(ret));
+    return;
+  }
+  ed->busy = 1;
+}
+
+/* Advance the state machine with the result of the transfer */
+static void LIBUSB_CALL engine_cb(struct libusb_transfer *transfer) {
+  struct engine_dev *ed = transfer->user_data;
+  unsigned long long now = dfu_get_time_ms();
+  int ret;
+
+  ed->busy = 0;
+  switch (transfer->status) {
+  case LIBUSB_TRANSFER_COMPLETED:
+    ret = transfer->actual_length;
+    if (ed->response)
+      memcpy(ed->response, libusb_control_transfer_get_data(transfer), ret);
+    break;
+  case LIBUSB_TRANSFER_STALL:
+    ret = LIBUSB_ERROR_PIPE;
+    break;
+  case LIBUSB_TRANSFER_TIMED_OUT:
+    ret = LIBUSB_ERROR_TIMEOUT;
+    break;
+  case LIBUSB_TRANSFER_NO_DEVICE:
+    ret = LIBUSB_ERROR_NO_DEVICE;
+    break;
+  default:
+    ret = LIBUSB_ERROR_IO;
+    break;
+  }
+  dfuload_machine_complete(&ed->m, ret);
+  ed->wake_ms = now + ed->m.delay;
+
+  if (ed->m.state == DFULOAD_FAILED) {
+    engine_fail(ed, ed->m.error, ed->m.reason);
+  } else if (ed->m.state == DFULOAD_DONE) {
+    if (ed->m.needs_reset) {
+      ret = libusb_reset_device(ed->m.dif->dev_handle);
+      if (ret < 0 && ret != LIBUSB_ERROR_NOT_FOUND)
+        warnx("%serror resetting after download (%s)", ed->prefix,
+              libusb_error_name(ret));
+    }
+    ed->end_ms = now;
+  }
+}
+
+/* Open and claim the interface, returns 0 when ready */
+static int engine_setup(struct engine_dev *ed, struct dfu_if *dif,
+                        struct dfu_file *file, int xfer_size) {
+  int ret;
+
+  snprintf(ed->prefix, sizeof(ed->prefix), "Device %03i:%03i: ", dif->busnum,
+           dif->devnum);
+  dfuload_machine_init(&ed->m, dif, file, xfer_size, ed->prefix);
+  /* unlike the synchronous path, nothing has prepared the device yet */
+  ed->m.state = DFULOAD_STATUS;
+
+  if (!(dif->flags & DFU_IFF_DFU)) {
+    engine_fail(ed, "Not supported", "device is not in DFU mode");
+    return -1;
+  }
+  if (dif->func_dfu.bcdDFUVersion == libusb_cpu_to_le16(0x11a)) {
+    engine_fail(ed, "Not supported", "DfuSe device");
+    return -1;
+  }
+  if (!xfer_size)
+    xfer_size = libusb_le16_to_cpu(dif->func_dfu.wTransferSize);
+  if (!xfer_size) {
+    engine_fail(ed, "Transfer size must be specified", "-t");
+    return -1;
+  }
+  xfer_size = dfu_limit_transfer_size(dif, "", xfer_size);
+  ed->m.xfer_size = xfer_size;
+
+  ret = libusb_open(dif->dev, &dif->dev_handle);
+  if (ret || !dif->dev_handle) {
+    dif->dev_handle = NULL;
+    engine_fail(ed, "Cannot open device", libusb_error_name(ret));
+    return -1;
+  }
+  ret = libusb_claim_interface(dif->dev_handle, dif->interface);
+  if (ret < 0) {
+    engine_fail(ed, "Cannot claim interface", libusb_error_name(ret));
+    return -1;
+  }
+  if (dif->flags & DFU_IFF_ALT) {
+    ret = libusb_set_interface_alt_setting(dif->dev_handle, dif->interface,
+                                           dif->altsetting);
+    if (ret < 0) {
+      engine_fail(ed, "Cannot set alternate interface",
+                  libusb_error_name(ret));
+      return -1;
+    }
+  }
+
+  ed->transfer = libusb_alloc_transfer(0);
+  ed->buf = dfu_malloc(LIBUSB_CONTROL_SETUP_SIZE + xfer_size);
+  if (!ed->transfer)
+    errx(EX_SOFTWARE, "Out of memory");
+  ed->start_ms = dfu_get_time_ms();
+  return 0;
+}
+
+/*
+ * Download the file to every device in the list. Only plain DFU devices
+ * already in DFU mode are supported, and there is no resume, skip or
+ * verify as with a single device. Returns 0 if all devices succeeded.
+ */
+int dfu_engine_dnload(libusb_context *ctx, struct dfu_if *dif, int xfer_size,
+                      struct dfu_file *file) {
+  struct engine_dev *devs;
+  struct dfu_if *pdfu;
+  off_t size = file->size.total - file->size.suffix;
+  int num = 0;
+  int failed = 0;
+  int active;
+  int i;
+
+  for (pdfu = dif; pdfu; pdfu = pdfu->next) {
+    struct dfu_if *prev;
+
+    for (prev = dif; prev != pdfu; prev = prev->next) {
+      if (prev->dev == pdfu->dev)
+        errx(EX_USAGE, "Several alternate settings on device %03i:%03i, "
+                       "select one with --alt",
+             pdfu->busnum, pdfu->devnum);
+    }
+    num++;
+  }
+
+  devs = dfu_malloc(num * sizeof(*devs));
+  memset(devs, 0, num * sizeof(*devs));
+  for (i = 0, pdfu = dif; pdfu; pdfu = pdfu->next, i++)
+    engine_setup(&devs[i], pdfu, file, xfer_size);
+
+  printf("Copying data from PC to %i DFU devices\n", num);
+  do {
+    unsigned long long now = dfu_get_time_ms();
+    unsigned long long next = now + ENGINE_MAX_WAIT;
+    unsigned long long sent = 0;
+    struct timeval tv;
+
+    active = 0;
+    for (i = 0; i < num; i++) {
+      struct engine_dev *ed = &devs[i];
+
+      sent += ed->m.bytes_sent;
+      if (ed->m.state == DFULOAD_DONE || ed->m.state == DFULOAD_FAILED)
+        continue;
+      if (!ed->busy && ed->wake_ms <= now)
+        engine_issue(ed);
+      else if (!ed->busy && ed->wake_ms < next)
+        next = ed->wake_ms;
+      if (ed->m.state != DFULOAD_FAILED)
+        active++;
+    }
+    if (!active) {
+      if (sent < (unsigned long long)size * num)
+        printf("\n");
+      break;
+    }
+    dfu_progress_bar("Download", sent, (unsigned long long)size * num);
+
+    tv.tv_sec = (next - now) / 1000;
+    tv.tv_usec = ((next - now) % 1000) * 1000;
+    if (libusb_handle_events_timeout_completed(ctx, &tv, NULL) < 0)
+      errx(EX_IOERR, "Failed to handle USB events");
+  } while (1);
+
+  for (i = 0; i < num; i++) {
+    struct engine_dev *ed = &devs[i];
+    struct dfu_if *edif = ed->m.dif;
+
+    if (ed->m.state == DFULOAD_DONE) {
+      printf("%ssent %lli bytes in %llu ms\n", ed->prefix,
+             (long long)ed->m.bytes_sent, ed->end_ms - ed->start_ms);
+    } else {
+      printf("%sfailed\n", ed->prefix);
+      failed++;
+    }
+    if (edif->dev_handle) {
+      libusb_release_interface(edif->dev_handle, edif->interface);
+      libusb_close(edif->dev_handle);
+      edif->dev_handle = NULL;
+    }
+    libusb_free_transfer(ed->transfer);
+    free(ed->buf);
+  }
+  free(devs);
+
+  printf("%i of %i devices done\n", num - failed, num);
+  return failed ? -1 : 0;
+}
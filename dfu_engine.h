@@ -0,0 +1,10 @@
+#ifndef DFU_ENGINE_H
+#define DFU_ENGINE_H
+
+struct dfu_if;
+struct dfu_file;
+
+int dfu_engine_dnload(libusb_context *ctx, struct dfu_if *dif, int xfer_size,
+		      struct dfu_file *file);
+
+#endif /* DFU_ENGINE_H */
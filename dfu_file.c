@@ -24,6 +24,8 @@
 #endif
 
 #define __USE_MINGW_ANSI_STDIO 1
+#define _GNU_SOURCE /* for SEEK_HOLE and SEEK_DATA */
+#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
@@ -32,15 +34,75 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#ifdef HAVE_SYS_STAT_H
+#include <sys/stat.h>
+#endif
+#include <dirent.h>
+#ifndef WIN32
+#include <sys/wait.h>
+#endif
 
 #include "dfu_file.h"
 #include "portable.h"
 
+#ifdef HAVE_WINDOWS_H
+#include <windows.h>
+#endif
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LZMA
+#include <lzma.h>
+#endif
+
+#ifdef WIN32
+#include <io.h>
+#define ftruncate(f, size) _chsize(f, size)
+#define fsync(f) _commit(f)
+#endif
+
 #define DFU_SUFFIX_LENGTH 16
 #define LMDFU_PREFIX_LENGTH 8
 #define LPCDFU_PREFIX_LENGTH 16
 #define PROGRESS_BAR_WIDTH 25
 #define STDIN_CHUNK_SIZE 65536
+#define SPARSE_ERASED_VALUE 0xff
+
+/* Leave erased blocks as holes when writing uploaded data */
+int dfu_file_sparse = 0;
+
+/* Erased bytes written so far but not yet stored in the file */
+static off_t sparse_pending = 0;
+
+/* Holes left in the upload file, recorded in <file>.holes since they
+ * read back as zeros instead of the erased value */
+static struct {
+  off_t offset;
+  off_t size;
+} *sparse_holes = NULL;
+static int sparse_num_holes = 0;
+
+/* Keep a journal of download progress so that it can be resumed */
+int dfu_file_resume = 0;
+
+/* Which files are decompressed as gzip, zstd or xz while loading them */
+enum file_detect dfu_file_uncompress = DETECT_NEVER;
+
+/* Which files are parsed as ELF, Intel HEX or S-record images */
+enum file_detect dfu_file_parse_images = DETECT_NEVER;
+
+/* Open journal file and the image identity it belongs to */
+static struct {
+  int fd;
+  char *name;
+  long long size;
+  uint32_t crc;
+  int xfer_size;
+} journal = {-1, NULL, 0, 0, 0};
 
 static const unsigned long crc32_table[] = {
     0x00000000, 0x77073096, 0xee0e612c, 0x990951ba, 0x076dc419, 0x706af48f,
@@ -91,6 +153,46 @@ static uint32_t crc32_byte(uint32_t accum, uint8_t delta) {
   return crc32_table[(accum ^ delta) & 0xff] ^ (accum >> 8);
 }
 
+/* Tables for slice-by-8, crc32_slice[k] advances a byte over k more */
+static uint32_t crc32_slice[8][256];
+static int crc32_slice_ready = 0;
+
+static void crc32_init_slices(void) {
+  int i;
+  int k;
+
+  for (i = 0; i < 256; i++) {
+    crc32_slice[0][i] = crc32_table[i];
+    for (k = 1; k < 8; k++)
+      crc32_slice[k][i] = crc32_byte(crc32_slice[k - 1][i], 0);
+  }
+  crc32_slice_ready = 1;
+}
+
+/* CRC32 as used in the DFU suffix (no final inversion) */
+uint32_t dfu_file_crc(uint32_t crc, const void *buf, size_t size) {
+  const uint8_t *p = buf;
+
+  if (!crc32_slice_ready)
+    crc32_init_slices();
+
+  /* eight bytes per round, assembled bytewise to be endian neutral */
+  for (; size >= 8; p += 8, size -= 8) {
+    uint32_t lo = crc ^ (p[0] | (p[1] << 8) | (p[2] << 16) |
+                         ((uint32_t)p[3] << 24));
+    uint32_t hi = p[4] | (p[5] << 8) | (p[6] << 16) | ((uint32_t)p[7] << 24);
+
+    crc = crc32_slice[7][lo & 0xff] ^ crc32_slice[6][(lo >> 8) & 0xff] ^
+          crc32_slice[5][(lo >> 16) & 0xff] ^ crc32_slice[4][lo >> 24] ^
+          crc32_slice[3][hi & 0xff] ^ crc32_slice[2][(hi >> 8) & 0xff] ^
+          crc32_slice[1][(hi >> 16) & 0xff] ^ crc32_slice[0][hi >> 24];
+  }
+  while (size--)
+    crc = crc32_byte(crc, *p++);
+
+  return crc;
+}
+
 static int probe_prefix(struct dfu_file *file) {
   uint8_t *prefix = file->firmware;
 
@@ -116,6 +218,19 @@ static int probe_prefix(struct dfu_file *file) {
   return 0;
 }
 
+/* Console output is line buffered, so that a slow reader of a pipe or
+ * log file gets whole lines instead of a write per character. Nothing
+ * is left pending when a line ends, which keeps warnings on stderr in
+ * order with it. */
+void dfu_setup_output(void) {
+#ifdef WIN32
+  /* _IOLBF means full buffering in the Windows C library */
+  setvbuf(stdout, NULL, _IONBF, 0);
+#else
+  setvbuf(stdout, NULL, _IOLBF, BUFSIZ);
+#endif
+}
+
 void dfu_progress_bar(const char *desc, unsigned long long curr,
                       unsigned long long max) {
   static char buf[PROGRESS_BAR_WIDTH + 1];
@@ -154,21 +269,126 @@ void dfu_progress_bar(const char *desc, unsigned long long curr,
 
   if (progress == PROGRESS_BAR_WIDTH)
     printf("\n%s done.\n", desc);
+  else
+    /* the bar has no newline to flush it */
+    fflush(stdout);
+}
+
+/* Monotonic time in milliseconds, for measuring device operations */
+unsigned long long dfu_get_time_ms(void) {
+#ifdef HAVE_WINDOWS_H
+  return GetTickCount64();
+#else
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
 }
 
 void *dfu_malloc(size_t size) {
   void *ptr = malloc(size);
   if (ptr == NULL)
-    errx(EX_SOFTWARE, "Cannot allocate memory of size %d bytes", (int)size);
+    errx(EX_SOFTWARE, "Cannot allocate memory of size %llu bytes",
+         (unsigned long long)size);
   return (ptr);
 }
 
-uint32_t dfu_file_write_crc(int f, uint32_t crc, const void *buf, int size) {
-  int x;
+/* Tells whether all bytes of buf have the given value */
+static int dfu_file_is_filled(const uint8_t *buf, off_t size, uint8_t value) {
+  /* memcmp against itself shifted by one lets libc compare wide words */
+  return size > 0 && buf[0] == value && !memcmp(buf, buf + 1, size - 1);
+}
+
+static void dfu_file_write_erased(int f, off_t size) {
+  uint8_t erased[4096];
+
+  memset(erased, SPARSE_ERASED_VALUE, sizeof(erased));
+  while (size > 0) {
+    int chunk = size < (off_t)sizeof(erased) ? (int)size : (int)sizeof(erased);
+
+    if (write(f, erased, chunk) != chunk)
+      err(EX_IOERR, "Could not write %d bytes to file %d", chunk, f);
+    size -= chunk;
+  }
+}
+
+static void dfu_file_add_hole(off_t offset, off_t size) {
+  if (sparse_num_holes &&
+      sparse_holes[sparse_num_holes - 1].offset +
+              sparse_holes[sparse_num_holes - 1].size ==
+          offset) {
+    sparse_holes[sparse_num_holes - 1].size += size;
+    return;
+  }
+  sparse_holes = realloc(sparse_holes,
+                         (sparse_num_holes + 1) * sizeof(*sparse_holes));
+  if (!sparse_holes)
+    err(EX_SOFTWARE, "Could not allocate hole list");
+  sparse_holes[sparse_num_holes].offset = offset;
+  sparse_holes[sparse_num_holes].size = size;
+  sparse_num_holes++;
+}
 
+/* Store pending erased bytes, skipping whole file system blocks so
+ * that they become holes. Partial blocks are written out, since the
+ * file system would otherwise fill them with zeros. */
+void dfu_file_sparse_flush(int f) {
+  off_t start;
+  off_t end;
+  off_t block = 4096;
+  off_t first;
+  off_t last;
+
+  if (!sparse_pending)
+    return;
+
+  start = lseek(f, 0, SEEK_CUR);
+  if (start < 0)
+    err(EX_IOERR, "Could not seek in file %d", f);
+  end = start + sparse_pending;
+  sparse_pending = 0;
+
+#ifndef WIN32
+  {
+    struct stat st;
+
+    if (!fstat(f, &st) && st.st_blksize > 0)
+      block = st.st_blksize;
+  }
+#endif
+  first = (start + block - 1) / block * block;
+  last = end / block * block;
+  if (first >= last) {
+    dfu_file_write_erased(f, end - start);
+    return;
+  }
+  dfu_file_write_erased(f, first - start);
+  if (lseek(f, last, SEEK_SET) < 0)
+    err(EX_IOERR, "Could not seek in file %d", f);
+  dfu_file_add_hole(first, last - first);
+  dfu_file_write_erased(f, end - last);
+
+#ifndef WIN32
+  {
+    struct stat st;
+
+    /* a hole at the end of the file must still count towards its size */
+    if (!fstat(f, &st) && st.st_size < end && ftruncate(f, end))
+      err(EX_IOERR, "Could not extend file %d", f);
+  }
+#endif
+}
+
+uint32_t dfu_file_write_crc(int f, uint32_t crc, const void *buf, int size) {
   /* compute CRC */
-  for (x = 0; x != size; x++)
-    crc = crc32_byte(crc, ((uint8_t *)buf)[x]);
+  crc = dfu_file_crc(crc, buf, size);
+
+  if (dfu_file_sparse && dfu_file_is_filled(buf, size, SPARSE_ERASED_VALUE)) {
+    sparse_pending += size;
+    return (crc);
+  }
+  dfu_file_sparse_flush(f);
 
   /* write data */
   if (write(f, buf, size) != size)
@@ -177,13 +397,279 @@ uint32_t dfu_file_write_crc(int f, uint32_t crc, const void *buf, int size) {
   return (crc);
 }
 
-void dfu_load_file(struct dfu_file *file, enum suffix_req check_suffix,
-                   enum prefix_req check_prefix) {
-  off_t offset;
-  int f;
+/* Opens the download journal "<image>.resume" and returns 1 if it holds
+ * progress for the same image and transfer size, otherwise 0 with pos
+ * cleared. The journal stays open for dfu_journal_save() */
+int dfu_journal_open(struct dfu_file *file, int xfer_size,
+                     struct dfu_journal *pos) {
+  char line[128];
+  long long size;
+  unsigned long crc;
+  int saved_xfer_size;
+  long long offset;
+  int ret;
+
+  memset(pos, 0, sizeof(*pos));
+  if (!file->name || !strcmp(file->name, "-"))
+    errx(EX_USAGE, "Resume requires a named download file");
+
+  journal.name = dfu_malloc(strlen(file->name) + sizeof(".resume"));
+  strcpy(journal.name, file->name);
+  strcat(journal.name, ".resume");
+
+  journal.size = file->size.total;
+  journal.crc = dfu_file_crc(0xffffffff, file->firmware, file->size.total);
+  journal.xfer_size = xfer_size;
+
+  journal.fd = open(journal.name, O_RDWR | O_BINARY | O_CREAT, 0666);
+  if (journal.fd < 0)
+    err(EX_CANTCREAT, "Could not open journal %s", journal.name);
+
+  ret = read(journal.fd, line, sizeof(line) - 1);
+  if (ret <= 0)
+    return 0;
+  line[ret] = 0;
+  if (sscanf(line, "dfu-util-resume %lld %lx %d %d %lld %d", &size, &crc,
+             &saved_xfer_size, &pos->element, &offset,
+             &pos->transaction) != 6 ||
+      size != journal.size || crc != journal.crc ||
+      saved_xfer_size != xfer_size) {
+    warnx("Ignoring journal %s for a different download", journal.name);
+    memset(pos, 0, sizeof(*pos));
+    return 0;
+  }
+  pos->offset = offset;
+
+  return 1;
+}
+
+/* Records the position after the last acknowledged block */
+void dfu_journal_save(const struct dfu_journal *pos) {
+  char line[128];
+  int len;
+
+  if (journal.fd < 0)
+    return;
+
+  /* fixed width fields, so the record is always overwritten completely */
+  len = snprintf(line, sizeof(line),
+                 "dfu-util-resume %12lld %08lx %6d %6d %12lld %6d\n",
+                 journal.size, (unsigned long)journal.crc, journal.xfer_size,
+                 pos->element, (long long)pos->offset, pos->transaction);
+  if (lseek(journal.fd, 0, SEEK_SET) != 0 ||
+      write(journal.fd, line, len) != len)
+    err(EX_IOERR, "Could not write journal %s", journal.name);
+}
+
+/* Closes the journal, removing it once the download has completed */
+void dfu_journal_close(int completed) {
+  if (journal.fd < 0)
+    return;
+
+  close(journal.fd);
+  journal.fd = -1;
+  if (completed && unlink(journal.name))
+    warn("Could not remove journal %s", journal.name);
+  free(journal.name);
+  journal.name = NULL;
+}
+
+static char *dfu_file_holes_name(const char *name) {
+  char *holes_name = dfu_malloc(strlen(name) + sizeof(".holes"));
+
+  strcpy(holes_name, name);
+  strcat(holes_name, ".holes");
+  return holes_name;
+}
+
+/* Completes a sparse upload file and records its holes next to it */
+void dfu_file_sparse_finish(int f, const char *name) {
+  char *holes_name;
+  FILE *holes;
+  off_t size;
   int i;
+
+  dfu_file_sparse_flush(f);
+
+  /* a list left from an earlier upload must not apply to this one */
+  holes_name = dfu_file_holes_name(name);
+  if (!sparse_num_holes) {
+    remove(holes_name);
+    free(holes_name);
+    return;
+  }
+  size = lseek(f, 0, SEEK_END);
+  holes = fopen(holes_name, "w");
+  if (!holes)
+    err(EX_CANTCREAT, "Could not create %s", holes_name);
+  fprintf(holes, "dfu-util-holes %lld\n", (long long)size);
+  for (i = 0; i < sparse_num_holes; i++)
+    fprintf(holes, "%llx %llx\n", (long long)sparse_holes[i].offset,
+            (long long)sparse_holes[i].size);
+  if (fclose(holes))
+    err(EX_IOERR, "Could not write %s", holes_name);
+  if (verbose)
+    printf("Recorded %d erased holes in %s\n", sparse_num_holes, holes_name);
+
+  free(sparse_holes);
+  sparse_holes = NULL;
+  sparse_num_holes = 0;
+  free(holes_name);
+}
+
+/* Restores the erased value in the holes recorded for a sparse upload
+ * file. Holes the tool did not record itself are left alone. */
+static void dfu_file_fill_holes(struct dfu_file *file) {
+  off_t data_size = file->size.total - file->size.suffix;
+  char *holes_name = dfu_file_holes_name(file->name);
+  long long offset;
+  long long size;
+  char line[80];
+  int valid = 1;
+  FILE *holes;
+  int pass;
+
+  holes = fopen(holes_name, "r");
+  if (!holes) {
+    free(holes_name);
+    return;
+  }
+  if (!fgets(line, sizeof(line), holes) ||
+      sscanf(line, "dfu-util-holes %lld", &size) != 1 || size != data_size)
+    valid = 0;
+
+  /* check all ranges before touching any, then fill them */
+  for (pass = 0; valid && pass < 2; pass++) {
+    rewind(holes);
+    if (!fgets(line, sizeof(line), holes))
+      valid = 0;
+    while (valid && fgets(line, sizeof(line), holes)) {
+      uint8_t *hole;
+
+      if (sscanf(line, "%llx %llx", &offset, &size) != 2 || offset < 0 ||
+          size <= 0 || offset > data_size || size > data_size - offset) {
+        valid = 0;
+        break;
+      }
+      hole = file->firmware + offset;
+      /* already filled in by a tool that rewrote the file */
+      if (dfu_file_is_filled(hole, size, SPARSE_ERASED_VALUE))
+        continue;
+      if (!dfu_file_is_filled(hole, size, 0))
+        valid = 0;
+      else if (pass)
+        memset(hole, SPARSE_ERASED_VALUE, size);
+    }
+  }
+  fclose(holes);
+
+  if (!valid)
+    warnx("Warning: Ignoring %s, it does not match %s", holes_name,
+          file->name);
+  else if (verbose)
+    printf("Restored erased holes listed in %s\n", holes_name);
+  free(holes_name);
+}
+
+/* Parses a possible DFU suffix, crc covers all bytes before its CRC field */
+/* dfusuffix is NULL if the file is too short for a suffix */
+static void dfu_file_parse_suffix(struct dfu_file *file, uint32_t crc,
+                                  const uint8_t *dfusuffix,
+                                  enum suffix_req check_suffix) {
+  int missing_suffix = 0;
+  const char *reason;
+
+  if (!dfusuffix) {
+    reason = "File too short for DFU suffix";
+    missing_suffix = 1;
+    goto checked;
+  }
+
+  if (dfusuffix[10] != 'D' || dfusuffix[9] != 'F' || dfusuffix[8] != 'U') {
+    reason = "Invalid DFU suffix signature";
+    missing_suffix = 1;
+    goto checked;
+  }
+
+  file->dwCRC = (dfusuffix[15] << 24) + (dfusuffix[14] << 16) +
+                (dfusuffix[13] << 8) + dfusuffix[12];
+
+  if (file->dwCRC != crc) {
+    reason = "DFU suffix CRC does not match";
+    missing_suffix = 1;
+    goto checked;
+  }
+
+  /* At this point we believe we have a DFU suffix
+     so we require further checks to succeed */
+
+  file->bcdDFU = (dfusuffix[7] << 8) + dfusuffix[6];
+
+  if (verbose)
+    printf("DFU suffix version %x\n", file->bcdDFU);
+
+  file->size.suffix = dfusuffix[11];
+
+  if (file->size.suffix < DFU_SUFFIX_LENGTH) {
+    errx(EX_DATAERR, "Unsupported DFU suffix length %d", file->size.suffix);
+  }
+
+  if (file->size.suffix > file->size.total) {
+    errx(EX_DATAERR, "Invalid DFU suffix length %d", file->size.suffix);
+  }
+
+  file->idVendor = (dfusuffix[5] << 8) + dfusuffix[4];
+  file->idProduct = (dfusuffix[3] << 8) + dfusuffix[2];
+  file->bcdDevice = (dfusuffix[1] << 8) + dfusuffix[0];
+
+checked:
+  if (missing_suffix) {
+    if (check_suffix == NEEDS_SUFFIX) {
+      warnx("%s", reason);
+      errx(EX_DATAERR, "Valid DFU suffix needed");
+    } else if (check_suffix == MAYBE_SUFFIX) {
+      warnx("Warning: %s", reason);
+      warnx("A valid DFU suffix will be required in a future dfu-util release");
+    }
+  } else {
+    if (check_suffix == NO_SUFFIX) {
+      errx(EX_DATAERR,
+           "Please remove existing DFU suffix before adding a new one.\n");
+    }
+  }
+}
+
+/* Probes for a prefix in the first bytes of the loaded firmware */
+static void dfu_file_check_prefix(struct dfu_file *file,
+                                  enum prefix_req check_prefix) {
   int res;
 
+  res = probe_prefix(file);
+  if ((res || file->size.prefix == 0) && check_prefix == NEEDS_PREFIX)
+    errx(EX_DATAERR, "Valid DFU prefix needed");
+  if (file->size.prefix && check_prefix == NO_PREFIX)
+    errx(EX_DATAERR, "A prefix already exists, please delete it first");
+  if (file->size.prefix && verbose) {
+    uint8_t *data = file->firmware;
+    if (file->prefix_type == LMDFU_PREFIX)
+      printf("Possible TI Stellaris DFU prefix with "
+             "the following properties\n"
+             "Address:        0x%08x\n"
+             "Payload length: %d\n",
+             file->lmdfu_address,
+             data[4] | (data[5] << 8) | (data[6] << 16) | (data[7] << 24));
+    else if (file->prefix_type == LPCDFU_UNENCRYPTED_PREFIX)
+      printf("Possible unencrypted NXP LPC DFU prefix with "
+             "the following properties\n"
+             "Payload length: %d kiByte\n",
+             data[2] >> 1 | (data[3] << 7));
+    else
+      errx(EX_DATAERR, "Unknown DFU prefix type");
+  }
+}
+
+/* Sets the defaults used when a file has no valid suffix or prefix */
+static void dfu_file_reset(struct dfu_file *file) {
   file->size.prefix = 0;
   file->size.suffix = 0;
 
@@ -197,6 +683,703 @@ void dfu_load_file(struct dfu_file *file, enum suffix_req check_suffix,
   file->lmdfu_address = 0;
 
   free(file->firmware);
+  file->firmware = NULL;
+  free(file->segments);
+  file->segments = NULL;
+  file->num_segments = 0;
+  free(file->segment_buffer);
+  file->segment_buffer = NULL;
+}
+
+/* Reads an unsigned ELF field of 2, 4 or 8 bytes */
+static uint64_t elf_field(const uint8_t *p, int size, int big_endian) {
+  uint64_t value = 0;
+  int i;
+
+  for (i = 0; i < size; i++)
+    value |= (uint64_t)p[big_endian ? size - 1 - i : i] << (8 * i);
+  return value;
+}
+
+static int dfu_file_compare_segments(const void *a, const void *b) {
+  const struct dfu_segment *sa = a;
+  const struct dfu_segment *sb = b;
+
+  return sa->address < sb->address ? -1 : sa->address > sb->address;
+}
+
+enum image_type { IMAGE_BINARY, IMAGE_ELF, IMAGE_IHEX, IMAGE_SREC };
+
+/* Value of a hex digit, or 0x100 for anything else */
+static uint16_t hex_value[256];
+
+static void hex_init(void) {
+  int i;
+
+  for (i = 0; i < 256; i++)
+    hex_value[i] = 0x100;
+  for (i = 0; i < 10; i++)
+    hex_value['0' + i] = i;
+  for (i = 0; i < 6; i++)
+    hex_value['a' + i] = hex_value['A' + i] = 10 + i;
+}
+
+/* Tells images with load addresses from raw binaries by their start */
+static enum image_type dfu_file_image_type(const uint8_t *data, off_t size) {
+  if (!hex_value[0])
+    hex_init();
+  if (size >= 52 && !memcmp(data, "\177ELF", 4))
+    return IMAGE_ELF;
+  if (size >= 11 && data[0] == ':' && hex_value[data[1]] < 16 &&
+      hex_value[data[2]] < 16)
+    return IMAGE_IHEX;
+  if (size >= 10 && data[0] == 'S' && data[1] >= '0' && data[1] <= '9' &&
+      hex_value[data[2]] < 16)
+    return IMAGE_SREC;
+  return IMAGE_BINARY;
+}
+
+/* Start of the extension of the name ending at end, or NULL */
+static const char *dfu_file_ext(const char *name, const char *end) {
+  const char *p;
+
+  for (p = end; p > name && p[-1] != '/' && p[-1] != '\\'; p--)
+    if (p[-1] == '.')
+      return p;
+  return NULL;
+}
+
+/* Case insensitive comparison of the extension [ext, end) */
+static int dfu_file_ext_is(const char *ext, const char *end, const char *want) {
+  for (; ext < end && *want; ext++, want++)
+    if (tolower((unsigned char)*ext) != *want)
+      return 0;
+  return ext == end && !*want;
+}
+
+/* Whether the extension [ext, end) is one of a compressed file */
+static int dfu_file_compressed_ext(const char *ext, const char *end) {
+  return ext && (dfu_file_ext_is(ext, end, "gz") ||
+                 dfu_file_ext_is(ext, end, "zst") ||
+                 dfu_file_ext_is(ext, end, "xz"));
+}
+
+/* Tells compressed files from raw binaries by their name */
+static int dfu_file_compressed_name(const char *name) {
+  const char *end = name + strlen(name);
+
+  return dfu_file_compressed_ext(dfu_file_ext(name, end), end);
+}
+
+/* Tells image files from raw binaries by their name, looking through
+ * a compression extension */
+static int dfu_file_image_name(const char *name) {
+  static const char *const image_ext[] = {"elf", "axf", "hex", "ihex", "ihx",
+                                          "srec", "s19", "s28", "s37", "mot"};
+  const char *end = name + strlen(name);
+  const char *ext = dfu_file_ext(name, end);
+  unsigned int i;
+
+  if (dfu_file_compressed_ext(ext, end)) {
+    end = ext - 1;
+    ext = dfu_file_ext(name, end);
+  }
+  if (!ext)
+    return 0;
+  for (i = 0; i < sizeof(image_ext) / sizeof(image_ext[0]); i++)
+    if (dfu_file_ext_is(ext, end, image_ext[i]))
+      return 1;
+  return 0;
+}
+
+/* Turns the PT_LOAD program headers of an ELF32 or ELF64 image into
+ * segments at their physical addresses. Gaps between them are neither
+ * part of the segments nor erased. */
+static void dfu_file_parse_elf(struct dfu_file *file) {
+  const uint8_t *elf = file->firmware;
+  uint64_t size = file->size.total - file->size.suffix;
+  int is64 = elf[4] == 2;
+  int be = elf[5] == 2;
+  uint64_t phoff;
+  unsigned int phentsize;
+  unsigned int phnum;
+  unsigned int i;
+  int n = 0;
+
+  if ((elf[4] != 1 && elf[4] != 2) || (elf[5] != 1 && elf[5] != 2))
+    errx(EX_DATAERR, "Unsupported ELF class or data encoding");
+  if (is64 && size < 64)
+    errx(EX_DATAERR, "ELF file too short");
+
+  phoff = elf_field(elf + (is64 ? 32 : 28), is64 ? 8 : 4, be);
+  phentsize = elf_field(elf + (is64 ? 54 : 42), 2, be);
+  phnum = elf_field(elf + (is64 ? 56 : 44), 2, be);
+  if (phentsize < (is64 ? 56u : 32u) || phoff > size ||
+      (uint64_t)phnum * phentsize > size - phoff)
+    errx(EX_DATAERR, "Invalid ELF program headers");
+
+  file->segments = dfu_malloc((phnum + 1) * sizeof(*file->segments));
+  for (i = 0; i < phnum; i++) {
+    const uint8_t *ph = elf + phoff + (uint64_t)i * phentsize;
+    uint64_t offset, paddr, filesz;
+
+    /* PT_LOAD */
+    if (elf_field(ph, 4, be) != 1)
+      continue;
+    offset = elf_field(ph + (is64 ? 8 : 4), is64 ? 8 : 4, be);
+    paddr = elf_field(ph + (is64 ? 24 : 12), is64 ? 8 : 4, be);
+    filesz = elf_field(ph + (is64 ? 32 : 16), is64 ? 8 : 4, be);
+    /* nothing to program for .bss */
+    if (!filesz)
+      continue;
+    if (offset > size || filesz > size - offset)
+      errx(EX_DATAERR, "ELF segment %u beyond end of file", i);
+    if (paddr + filesz - 1 > 0xffffffff)
+      errx(EX_DATAERR, "ELF segment %u above 4 GiB", i);
+    file->segments[n].address = paddr;
+    file->segments[n].size = filesz;
+    file->segments[n].data = file->firmware + offset;
+    n++;
+  }
+  if (!n)
+    errx(EX_DATAERR, "No loadable segments in ELF file");
+
+  qsort(file->segments, n, sizeof(*file->segments),
+        dfu_file_compare_segments);
+  for (i = 1; i < (unsigned int)n; i++)
+    if (file->segments[i].address <
+        file->segments[i - 1].address + file->segments[i - 1].size)
+      errx(EX_DATAERR, "Overlapping ELF segments at 0x%08x",
+           file->segments[i].address);
+  file->num_segments = n;
+
+  if (verbose) {
+    printf("ELF%d image with %d loadable segments\n", is64 ? 64 : 32, n);
+    for (i = 0; i < (unsigned int)n; i++)
+      printf("Segment at 0x%08x, size %u\n", file->segments[i].address,
+             file->segments[i].size);
+  }
+}
+
+/* Address range of data bytes collected from a text image */
+struct text_chunk {
+  uint32_t address;
+  uint32_t size;
+  size_t offset; /* into the collected data */
+};
+
+static int dfu_file_compare_chunks(const void *a, const void *b) {
+  const struct text_chunk *ca = a;
+  const struct text_chunk *cb = b;
+
+  return ca->address < cb->address ? -1 : ca->address > cb->address;
+}
+
+/* Collected records of an Intel HEX or S-record image */
+struct text_image {
+  struct text_chunk *chunks;
+  int num_chunks;
+  int max_chunks;
+  uint8_t *data;
+  size_t size;
+  size_t max_size;
+};
+
+/* Adds the data of one record, extending the last chunk if it continues */
+static void text_image_add(struct text_image *img, uint32_t address,
+                           const uint8_t *data, int size) {
+  struct text_chunk *last = img->chunks + img->num_chunks - 1;
+
+  if (!size)
+    return;
+  if (img->size + size > img->max_size) {
+    img->max_size = img->max_size ? 2 * img->max_size : 65536;
+    img->data = realloc(img->data, img->max_size);
+    if (!img->data)
+      err(EX_SOFTWARE, "Could not allocate image buffer");
+  }
+  memcpy(img->data + img->size, data, size);
+
+  if (img->num_chunks && last->address + last->size == address &&
+      last->offset + last->size == img->size) {
+    last->size += size;
+  } else {
+    if (img->num_chunks == img->max_chunks) {
+      img->max_chunks = img->max_chunks ? 2 * img->max_chunks : 64;
+      img->chunks =
+          realloc(img->chunks, img->max_chunks * sizeof(*img->chunks));
+      if (!img->chunks)
+        err(EX_SOFTWARE, "Could not allocate image chunks");
+    }
+    last = img->chunks + img->num_chunks++;
+    last->address = address;
+    last->size = size;
+    last->offset = img->size;
+  }
+  img->size += size;
+}
+
+/* Decodes count hex digit pairs into bytes, returns their sum or -1 */
+static int hex_decode(const uint8_t *text, uint8_t *bytes, int count) {
+  unsigned int bad = 0;
+  int sum = 0;
+  int i;
+
+  for (i = 0; i < count; i++) {
+    unsigned int v = (hex_value[text[2 * i]] << 4) | hex_value[text[2 * i + 1]];
+
+    /* an invalid digit sets bits above the byte */
+    bad |= v;
+    bytes[i] = v;
+    sum += bytes[i];
+  }
+  return bad > 0xff ? -1 : sum;
+}
+
+/* Parses one Intel HEX record, returns 0 at the end of file record */
+static int ihex_record(struct text_image *img, const uint8_t *line, int len,
+                       uint32_t *base, int line_no) {
+  uint8_t rec[5 + 255];
+  int count;
+  int sum;
+  uint32_t address;
+
+  if (len < 11 || line[0] != ':' || hex_decode(line + 1, rec, 1) < 0)
+    errx(EX_DATAERR, "Invalid Intel HEX record in line %d", line_no);
+  count = rec[0];
+  if (len < 11 + 2 * count ||
+      (sum = hex_decode(line + 1, rec, 5 + count)) < 0 || (sum & 0xff) != 0)
+    errx(EX_DATAERR, "Bad Intel HEX record or checksum in line %d",
+         line_no);
+  address = (rec[1] << 8) | rec[2];
+
+  switch (rec[3]) {
+  case 0x00: /* data */
+    text_image_add(img, *base + address, rec + 4, count);
+    break;
+  case 0x01: /* end of file */
+    return 0;
+  case 0x02: /* extended segment address */
+  case 0x04: /* extended linear address */
+    if (count != 2)
+      errx(EX_DATAERR, "Bad Intel HEX address record in line %d", line_no);
+    if (rec[3] == 0x02)
+      *base = ((rec[4] << 8) | rec[5]) << 4;
+    else
+      *base = (uint32_t)((rec[4] << 8) | rec[5]) << 16;
+    break;
+  default: /* start addresses */
+    break;
+  }
+  return 1;
+}
+
+/* Parses one S-record, returns 0 at a termination record */
+static int srec_record(struct text_image *img, const uint8_t *line, int len,
+                       int line_no) {
+  /* address bytes per record type */
+  static const int address_size[10] = {2, 2, 3, 4, 0, 2, 3, 4, 3, 2};
+  uint8_t rec[256];
+  int count;
+  int asize;
+  int sum;
+  uint32_t address = 0;
+  int i;
+
+  if (len < 10 || line[0] != 'S' || line[1] < '0' || line[1] > '9' ||
+      hex_decode(line + 2, rec, 1) < 0)
+    errx(EX_DATAERR, "Invalid S-record in line %d", line_no);
+  count = rec[0];
+  asize = address_size[line[1] - '0'];
+  if (count < asize + 1 || len < 4 + 2 * count ||
+      (sum = hex_decode(line + 2, rec, 1 + count)) < 0 || (sum & 0xff) != 0xff)
+    errx(EX_DATAERR, "Bad S-record or checksum in line %d", line_no);
+  for (i = 0; i < asize; i++)
+    address = (address << 8) | rec[1 + i];
+
+  switch (line[1]) {
+  case '1':
+  case '2':
+  case '3':
+    text_image_add(img, address, rec + 1 + asize, count - asize - 1);
+    break;
+  case '7':
+  case '8':
+  case '9':
+    return 0;
+  default: /* header, record count */
+    break;
+  }
+  return 1;
+}
+
+/* Parses an Intel HEX or S-record image in one pass into segments of
+ * coalesced address ranges, sorted by address */
+static void dfu_file_parse_text(struct dfu_file *file, enum image_type type) {
+  const uint8_t *text = file->firmware;
+  const uint8_t *end = text + file->size.total - file->size.suffix;
+  struct text_image img;
+  uint32_t base = 0;
+  int line_no = 0;
+  int sorted = 1;
+  int more = 1;
+  uint8_t *data;
+  int n = 0;
+  int i;
+
+  memset(&img, 0, sizeof(img));
+  while (text < end) {
+    const uint8_t *eol = memchr(text, '\n', end - text);
+    int len;
+
+    if (!eol)
+      eol = end;
+    len = eol - text;
+    line_no++;
+    /* trailing whitespace, including the CR of CRLF line ends */
+    while (len && (text[len - 1] == '\r' || text[len - 1] == ' ' ||
+                   text[len - 1] == '\t'))
+      len--;
+    if (!len) {
+      text = eol + 1;
+      continue;
+    }
+    if (type == IMAGE_IHEX)
+      more = ihex_record(&img, text, len, &base, line_no);
+    else
+      more = srec_record(&img, text, len, line_no);
+    if (!more)
+      break;
+    text = eol + 1;
+  }
+  /* a truncated file would otherwise be written without complaint */
+  if (more)
+    errx(EX_DATAERR, "%s ends without %s record",
+         type == IMAGE_IHEX ? "Intel HEX file" : "S-record file",
+         type == IMAGE_IHEX ? "an end of file" : "a termination");
+  if (!img.num_chunks)
+    errx(EX_DATAERR, "No data records in %s",
+         type == IMAGE_IHEX ? "Intel HEX file" : "S-record file");
+
+  for (i = 1; i < img.num_chunks; i++)
+    if (img.chunks[i].address < img.chunks[i - 1].address)
+      sorted = 0;
+  if (!sorted)
+    qsort(img.chunks, img.num_chunks, sizeof(*img.chunks),
+          dfu_file_compare_chunks);
+
+  /* lay out the data in address order and merge touching chunks */
+  data = dfu_malloc(img.size);
+  file->segments = dfu_malloc(img.num_chunks * sizeof(*file->segments));
+  for (i = 0; i < img.num_chunks; i++) {
+    struct text_chunk *chunk = img.chunks + i;
+    struct dfu_segment *prev = file->segments + n - 1;
+
+    if (n && chunk->address < prev->address + prev->size)
+      errx(EX_DATAERR, "Overlapping data at 0x%08x", chunk->address);
+    if (n && chunk->address == prev->address + prev->size) {
+      memcpy(prev->data + prev->size, img.data + chunk->offset, chunk->size);
+      prev->size += chunk->size;
+    } else {
+      file->segments[n].address = chunk->address;
+      file->segments[n].size = chunk->size;
+      file->segments[n].data = n ? prev->data + prev->size : data;
+      memcpy(file->segments[n].data, img.data + chunk->offset, chunk->size);
+      n++;
+    }
+  }
+  file->segment_buffer = data;
+  file->num_segments = n;
+  free(img.chunks);
+  free(img.data);
+
+  if (verbose) {
+    printf("%s image with %d address ranges\n",
+           type == IMAGE_IHEX ? "Intel HEX" : "S-record", n);
+    for (i = 0; i < n; i++)
+      printf("Segment at 0x%08x, size %u\n", file->segments[i].address,
+             file->segments[i].size);
+  }
+}
+
+enum compression { COMPRESS_NONE, COMPRESS_GZIP, COMPRESS_ZSTD, COMPRESS_XZ };
+
+static const char *compression_name[] = {"none", "gzip", "zstd", "xz"};
+
+#define COMPRESS_MAGIC_LENGTH 6
+
+static enum compression dfu_file_compression(const uint8_t *data,
+                                             size_t size) {
+  if (size >= 2 && data[0] == 0x1f && data[1] == 0x8b)
+    return COMPRESS_GZIP;
+  if (size >= 4 && !memcmp(data, "\x28\xb5\x2f\xfd", 4))
+    return COMPRESS_ZSTD;
+  if (size >= 6 && !memcmp(data, "\xfd" "7zXZ\0", 6))
+    return COMPRESS_XZ;
+  return COMPRESS_NONE;
+}
+
+#if defined(HAVE_ZLIB) || defined(HAVE_ZSTD) || defined(HAVE_LZMA)
+/* Compressed input: bytes already read, then the rest of the file */
+struct compressed_input {
+  const uint8_t *head;
+  size_t head_len;
+  int fd; /* -1 if everything is in head */
+  uint8_t buf[STDIN_CHUNK_SIZE];
+};
+
+/* Returns the next piece of compressed input, 0 at the end */
+static size_t compressed_read(struct compressed_input *in,
+                              const uint8_t **data) {
+  ssize_t n;
+
+  if (in->head_len) {
+    n = in->head_len;
+    *data = in->head;
+    in->head_len = 0;
+    return n;
+  }
+  if (in->fd < 0) {
+    *data = NULL;
+    return 0;
+  }
+  do {
+    n = read(in->fd, in->buf, sizeof(in->buf));
+  } while (n < 0 && errno == EINTR);
+  if (n < 0)
+    err(EX_IOERR, "Could not read compressed file");
+  *data = in->buf;
+  return n;
+}
+
+/* Makes room for at least one more chunk of decompressed output */
+static void dfu_file_grow(struct dfu_file *file, size_t *capacity) {
+  if (*capacity - file->size.total >= STDIN_CHUNK_SIZE)
+    return;
+  *capacity = *capacity ? 2 * *capacity : 4 * STDIN_CHUNK_SIZE;
+  file->firmware = realloc(file->firmware, *capacity);
+  if (!file->firmware)
+    err(EX_SOFTWARE, "Could not allocate firmware buffer");
+}
+#else
+struct compressed_input {
+  const uint8_t *head;
+  size_t head_len;
+  int fd;
+};
+#endif
+
+#ifdef HAVE_ZLIB
+static void dfu_file_gunzip(struct dfu_file *file,
+                            struct compressed_input *in) {
+  size_t capacity = 0;
+  int need_input = 1;
+  int ret = Z_OK;
+  z_stream z;
+
+  memset(&z, 0, sizeof(z));
+  /* gzip wrapper only */
+  if (inflateInit2(&z, 15 + 16) != Z_OK)
+    errx(EX_SOFTWARE, "Could not initialize zlib");
+  for (;;) {
+    if (need_input && !z.avail_in) {
+      const uint8_t *data;
+      size_t n = compressed_read(in, &data);
+
+      if (!n)
+        break;
+      z.next_in = (Bytef *)data;
+      z.avail_in = n;
+    }
+    /* concatenated gzip members make up one image */
+    if (ret == Z_STREAM_END)
+      inflateReset(&z);
+    dfu_file_grow(file, &capacity);
+    z.next_out = file->firmware + file->size.total;
+    z.avail_out = capacity - file->size.total;
+    ret = inflate(&z, Z_NO_FLUSH);
+    file->size.total = capacity - z.avail_out;
+    if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR)
+      errx(EX_DATAERR, "Corrupt gzip data: %s", z.msg ? z.msg : "");
+    need_input = z.avail_out != 0;
+  }
+  inflateEnd(&z);
+  if (ret != Z_STREAM_END)
+    errx(EX_DATAERR, "Truncated gzip data");
+}
+#endif
+
+#ifdef HAVE_ZSTD
+static void dfu_file_unzstd(struct dfu_file *file,
+                            struct compressed_input *in) {
+  ZSTD_DStream *ds = ZSTD_createDStream();
+  ZSTD_inBuffer zin = {NULL, 0, 0};
+  size_t capacity = 0;
+  int need_input = 1;
+  size_t ret = 1;
+
+  if (!ds || ZSTD_isError(ZSTD_initDStream(ds)))
+    errx(EX_SOFTWARE, "Could not initialize zstd");
+  for (;;) {
+    ZSTD_outBuffer zout;
+
+    if (need_input && zin.pos == zin.size) {
+      const uint8_t *data;
+      size_t n = compressed_read(in, &data);
+
+      if (!n)
+        break;
+      zin.src = data;
+      zin.size = n;
+      zin.pos = 0;
+    }
+    dfu_file_grow(file, &capacity);
+    zout.dst = file->firmware + file->size.total;
+    zout.size = capacity - file->size.total;
+    zout.pos = 0;
+    ret = ZSTD_decompressStream(ds, &zout, &zin);
+    if (ZSTD_isError(ret))
+      errx(EX_DATAERR, "Corrupt zstd data: %s", ZSTD_getErrorName(ret));
+    file->size.total += zout.pos;
+    need_input = zout.pos < zout.size;
+  }
+  ZSTD_freeDStream(ds);
+  /* 0 once a frame is completely decoded and flushed */
+  if (ret != 0)
+    errx(EX_DATAERR, "Truncated zstd data");
+}
+#endif
+
+#ifdef HAVE_LZMA
+static void dfu_file_unxz(struct dfu_file *file, struct compressed_input *in) {
+  lzma_stream s = LZMA_STREAM_INIT;
+  lzma_action action = LZMA_RUN;
+  size_t capacity = 0;
+  lzma_ret ret;
+
+  if (lzma_stream_decoder(&s, UINT64_MAX, LZMA_CONCATENATED) != LZMA_OK)
+    errx(EX_SOFTWARE, "Could not initialize liblzma");
+  for (;;) {
+    if (!s.avail_in && action == LZMA_RUN) {
+      const uint8_t *data = NULL;
+      size_t n = compressed_read(in, &data);
+
+      if (!n)
+        action = LZMA_FINISH;
+      s.next_in = data;
+      s.avail_in = n;
+    }
+    dfu_file_grow(file, &capacity);
+    s.next_out = file->firmware + file->size.total;
+    s.avail_out = capacity - file->size.total;
+    ret = lzma_code(&s, action);
+    file->size.total = capacity - s.avail_out;
+    if (ret == LZMA_STREAM_END)
+      break;
+    if (ret == LZMA_BUF_ERROR)
+      errx(EX_DATAERR, "Truncated xz data");
+    if (ret != LZMA_OK)
+      errx(EX_DATAERR, "Corrupt xz data (liblzma error %d)", ret);
+  }
+  lzma_end(&s);
+}
+#endif
+
+/* Tells whether this build can decompress the given format */
+static int dfu_file_can_decompress(enum compression type) {
+  switch (type) {
+#ifdef HAVE_ZLIB
+  case COMPRESS_GZIP:
+    return 1;
+#endif
+#ifdef HAVE_ZSTD
+  case COMPRESS_ZSTD:
+    return 1;
+#endif
+#ifdef HAVE_LZMA
+  case COMPRESS_XZ:
+    return 1;
+#endif
+  default:
+    return 0;
+  }
+}
+
+/* Checks whether a file meant to be decompressed can be, warning when
+ * it is going to be loaded as raw data */
+static enum compression dfu_file_check_compression(struct dfu_file *file,
+                                                   const uint8_t *data,
+                                                   size_t size) {
+  enum compression type = dfu_file_compression(data, size);
+
+  if (type == COMPRESS_NONE) {
+    warnx("Warning: %s does not look compressed, loading it as raw data",
+          file->name);
+    return type;
+  }
+  if (dfu_file_can_decompress(type))
+    return type;
+  warnx("Warning: %s looks %s compressed, which this build does not "
+        "support, loading it as raw data",
+        file->name, compression_name[type]);
+  return COMPRESS_NONE;
+}
+
+/* Replaces the firmware by the decompressed image, streaming through
+ * the compressed bytes in head and then the rest of file descriptor fd */
+static void dfu_file_decompress(struct dfu_file *file, enum compression type,
+                                const uint8_t *head, size_t head_len,
+                                int fd) {
+  struct compressed_input *in = dfu_malloc(sizeof(*in));
+  uint8_t *compressed = file->firmware;
+
+  in->head = head;
+  in->head_len = head_len;
+  in->fd = fd;
+  file->firmware = NULL;
+  file->size.total = 0;
+
+  switch (type) {
+#ifdef HAVE_ZLIB
+  case COMPRESS_GZIP:
+    dfu_file_gunzip(file, in);
+    break;
+#endif
+#ifdef HAVE_ZSTD
+  case COMPRESS_ZSTD:
+    dfu_file_unzstd(file, in);
+    break;
+#endif
+#ifdef HAVE_LZMA
+  case COMPRESS_XZ:
+    dfu_file_unxz(file, in);
+    break;
+#endif
+  default:
+    errx(EX_DATAERR, "%s is %s compressed, which this build does not support",
+         file->name, compression_name[type]);
+  }
+  free(in);
+  free(compressed);
+  if (verbose)
+    printf("Decompressed %lld bytes of %s data\n",
+           (long long)file->size.total, compression_name[type]);
+}
+
+void dfu_load_file(struct dfu_file *file, enum suffix_req check_suffix,
+                   enum prefix_req check_prefix) {
+  uint32_t crc = 0xffffffff;
+  int parse_image;
+  int uncompress;
+  off_t offset;
+  int f;
+
+  dfu_file_reset(file);
+
+  /* raw images may well start with a compression magic */
+  uncompress = dfu_file_uncompress == DETECT_ALWAYS ||
+               (dfu_file_uncompress == DETECT_BY_NAME &&
+                dfu_file_compressed_name(file->name));
 
   if (!strcmp(file->name, "-")) {
     size_t read_bytes;
@@ -220,14 +1403,35 @@ void dfu_load_file(struct dfu_file *file, enum suffix_req check_suffix,
       printf("Read %lli bytes from stdin\n", (long long)file->size.total);
     /* Never require suffix when reading from stdin */
     check_suffix = MAYBE_SUFFIX;
+    if (uncompress) {
+      enum compression type =
+          dfu_file_check_compression(file, file->firmware, file->size.total);
+
+      if (type != COMPRESS_NONE)
+        dfu_file_decompress(file, type, file->firmware, file->size.total, -1);
+    }
   } else {
     ssize_t read_count;
     off_t read_total = 0;
+    uint8_t magic[COMPRESS_MAGIC_LENGTH];
+    enum compression type = COMPRESS_NONE;
 
     f = open(file->name, O_RDONLY | O_BINARY);
     if (f < 0)
       err(EX_NOINPUT, "Could not open file %s for reading", file->name);
 
+    if (uncompress) {
+      read_count = read(f, magic, sizeof(magic));
+      if (read_count > 0)
+        type = dfu_file_check_compression(file, magic, read_count);
+      if (type != COMPRESS_NONE) {
+        /* decoded on the fly, in the same single pass over the file */
+        dfu_file_decompress(file, type, magic, read_count, f);
+        close(f);
+        goto loaded;
+      }
+    }
+
     offset = lseek(f, 0, SEEK_END);
 
     if (offset < 0)
@@ -238,8 +1442,9 @@ void dfu_load_file(struct dfu_file *file, enum suffix_req check_suffix,
 
     file->size.total = offset;
 
+    /* the image is loaded into memory as a whole */
     if (file->size.total > SSIZE_MAX) {
-      err(EX_SOFTWARE, "File too large for memory allocation on this platform");
+      errx(EX_SOFTWARE, "File too large for memory allocation on this platform");
     }
     file->firmware = dfu_malloc(file->size.total);
 
@@ -261,147 +1466,170 @@ void dfu_load_file(struct dfu_file *file, enum suffix_req check_suffix,
     }
     close(f);
   }
+loaded:
 
-  /* Check for possible DFU file suffix by trying to parse one */
-  {
-    uint32_t crc = 0xffffffff;
-    const uint8_t *dfusuffix;
-    int missing_suffix = 0;
-    const char *reason;
-
-    if (file->size.total < DFU_SUFFIX_LENGTH) {
-      reason = "File too short for DFU suffix";
-      missing_suffix = 1;
-      goto checked;
-    }
-
-    dfusuffix = file->firmware + file->size.total - DFU_SUFFIX_LENGTH;
+  parse_image = dfu_file_parse_images == DETECT_ALWAYS ||
+                (dfu_file_parse_images == DETECT_BY_NAME &&
+                 dfu_file_image_name(file->name));
 
-    for (i = 0; i < file->size.total - 4; i++)
-      crc = crc32_byte(crc, file->firmware[i]);
+  /* images with load addresses do not need a DFU suffix */
+  if (check_suffix == MAYBE_SUFFIX && parse_image &&
+      dfu_file_image_type(file->firmware, file->size.total) != IMAGE_BINARY)
+    check_suffix = ANY_SUFFIX;
 
-    if (dfusuffix[10] != 'D' || dfusuffix[9] != 'F' || dfusuffix[8] != 'U') {
-      reason = "Invalid DFU suffix signature";
-      missing_suffix = 1;
-      goto checked;
-    }
-
-    file->dwCRC = (dfusuffix[15] << 24) + (dfusuffix[14] << 16) +
-                  (dfusuffix[13] << 8) + dfusuffix[12];
+  /* Check for possible DFU file suffix by trying to parse one */
+  if (file->size.total >= DFU_SUFFIX_LENGTH) {
+    crc = dfu_file_crc(crc, file->firmware, file->size.total - 4);
+    dfu_file_parse_suffix(file, crc,
+                          file->firmware + file->size.total -
+                              DFU_SUFFIX_LENGTH,
+                          check_suffix);
+  } else {
+    dfu_file_parse_suffix(file, crc, NULL, check_suffix);
+  }
+  dfu_file_check_prefix(file, check_prefix);
 
-    if (file->dwCRC != crc) {
-      reason = "DFU suffix CRC does not match";
-      missing_suffix = 1;
-      goto checked;
-    }
+  if (strcmp(file->name, "-"))
+    dfu_file_fill_holes(file);
 
-    /* At this point we believe we have a DFU suffix
-       so we require further checks to succeed */
+  if (parse_image)
+    dfu_file_parse_image(file);
+}
 
-    file->bcdDFU = (dfusuffix[7] << 8) + dfusuffix[6];
+/* Splits an ELF, Intel HEX or S-record image into its address ranges,
+ * leaving anything else alone */
+void dfu_file_parse_image(struct dfu_file *file) {
+  if (file->segments || file->bcdDFU == 0x11a)
+    return;
 
-    if (verbose)
-      printf("DFU suffix version %x\n", file->bcdDFU);
+  switch (dfu_file_image_type(file->firmware,
+                              file->size.total - file->size.suffix)) {
+  case IMAGE_ELF:
+    dfu_file_parse_elf(file);
+    break;
+  case IMAGE_IHEX:
+    dfu_file_parse_text(file, IMAGE_IHEX);
+    break;
+  case IMAGE_SREC:
+    dfu_file_parse_text(file, IMAGE_SREC);
+    break;
+  default:
+    break;
+  }
+}
 
-    file->size.suffix = dfusuffix[11];
+/* Builds a DFU suffix from the file fields, crc covers all data before it */
+static void dfu_file_make_suffix(uint8_t *dfusuffix, uint32_t crc,
+                                 struct dfu_file *file) {
+  dfusuffix[0] = file->bcdDevice & 0xff;
+  dfusuffix[1] = file->bcdDevice >> 8;
+  dfusuffix[2] = file->idProduct & 0xff;
+  dfusuffix[3] = file->idProduct >> 8;
+  dfusuffix[4] = file->idVendor & 0xff;
+  dfusuffix[5] = file->idVendor >> 8;
+  dfusuffix[6] = file->bcdDFU & 0xff;
+  dfusuffix[7] = file->bcdDFU >> 8;
+  dfusuffix[8] = 'U';
+  dfusuffix[9] = 'F';
+  dfusuffix[10] = 'D';
+  dfusuffix[11] = DFU_SUFFIX_LENGTH;
+
+  crc = dfu_file_crc(crc, dfusuffix, DFU_SUFFIX_LENGTH - 4);
+
+  dfusuffix[12] = crc;
+  dfusuffix[13] = crc >> 8;
+  dfusuffix[14] = crc >> 16;
+  dfusuffix[15] = crc >> 24;
+  file->dwCRC = crc;
+}
 
-    if (file->size.suffix < DFU_SUFFIX_LENGTH) {
-      errx(EX_DATAERR, "Unsupported DFU suffix length %d", file->size.suffix);
-    }
+/* Writes a DFU suffix from the file fields, crc covers all data before it */
+void dfu_file_write_suffix(int f, uint32_t crc, struct dfu_file *file) {
+  uint8_t dfusuffix[DFU_SUFFIX_LENGTH];
 
-    if (file->size.suffix > file->size.total) {
-      errx(EX_DATAERR, "Invalid DFU suffix length %d", file->size.suffix);
-    }
+  dfu_file_make_suffix(dfusuffix, crc, file);
+  dfu_file_write_crc(f, crc, dfusuffix, DFU_SUFFIX_LENGTH);
+}
 
-    file->idVendor = (dfusuffix[5] << 8) + dfusuffix[4];
-    file->idProduct = (dfusuffix[3] << 8) + dfusuffix[2];
-    file->bcdDevice = (dfusuffix[1] << 8) + dfusuffix[0];
-
-  checked:
-    if (missing_suffix) {
-      if (check_suffix == NEEDS_SUFFIX) {
-        warnx("%s", reason);
-        errx(EX_DATAERR, "Valid DFU suffix needed");
-      } else if (check_suffix == MAYBE_SUFFIX) {
-        warnx("Warning: %s", reason);
-        warnx(
-            "A valid DFU suffix will be required in a future dfu-util release");
-      }
-    } else {
-      if (check_suffix == NO_SUFFIX) {
-        errx(EX_DATAERR,
-             "Please remove existing DFU suffix before adding a new one.\n");
-      }
-    }
+/* Builds the prefix for the file fields, returns its length */
+static int dfu_file_make_prefix(struct dfu_file *file, uint8_t *prefix) {
+  if (file->prefix_type == LMDFU_PREFIX) {
+    uint32_t addr = file->lmdfu_address / 1024;
+
+    /* lmdfu_dfu_prefix payload length excludes prefix and suffix */
+    uint32_t len = file->size.total - file->size.prefix - file->size.suffix;
+
+    prefix[0] = 0x01; /* STELLARIS_DFU_PROG */
+    prefix[1] = 0x00; /* Reserved */
+    prefix[2] = (uint8_t)(addr & 0xff);
+    prefix[3] = (uint8_t)(addr >> 8);
+    prefix[4] = (uint8_t)(len & 0xff);
+    prefix[5] = (uint8_t)(len >> 8) & 0xff;
+    prefix[6] = (uint8_t)(len >> 16) & 0xff;
+    prefix[7] = (uint8_t)(len >> 24);
+    return LMDFU_PREFIX_LENGTH;
   }
-  res = probe_prefix(file);
-  if ((res || file->size.prefix == 0) && check_prefix == NEEDS_PREFIX)
-    errx(EX_DATAERR, "Valid DFU prefix needed");
-  if (file->size.prefix && check_prefix == NO_PREFIX)
-    errx(EX_DATAERR, "A prefix already exists, please delete it first");
-  if (file->size.prefix && verbose) {
-    uint8_t *data = file->firmware;
-    if (file->prefix_type == LMDFU_PREFIX)
-      printf("Possible TI Stellaris DFU prefix with "
-             "the following properties\n"
-             "Address:        0x%08x\n"
-             "Payload length: %d\n",
-             file->lmdfu_address,
-             data[4] | (data[5] << 8) | (data[6] << 16) | (data[7] << 24));
-    else if (file->prefix_type == LPCDFU_UNENCRYPTED_PREFIX)
-      printf("Possible unencrypted NXP LPC DFU prefix with "
-             "the following properties\n"
-             "Payload length: %d kiByte\n",
-             data[2] >> 1 | (data[3] << 7));
-    else
-      errx(EX_DATAERR, "Unknown DFU prefix type");
+  if (file->prefix_type == LPCDFU_UNENCRYPTED_PREFIX) {
+    int i;
+
+    /* Payload is firmware and prefix rounded to 512 bytes */
+    uint32_t len = (file->size.total - file->size.suffix + 511) / 512;
+
+    memset(prefix, 0, LPCDFU_PREFIX_LENGTH);
+    prefix[0] = 0x1a; /* Unencypted*/
+    prefix[1] = 0x3f; /* Reserved */
+    prefix[2] = (uint8_t)(len & 0xff);
+    prefix[3] = (uint8_t)((len >> 8) & 0xff);
+    for (i = 12; i < LPCDFU_PREFIX_LENGTH; i++)
+      prefix[i] = 0xff;
+    return LPCDFU_PREFIX_LENGTH;
   }
+  return 0;
+}
+
+/* Creates a new temporary file next to the file it will replace */
+int dfu_file_open_temp(const char *target, char **tmp) {
+  *tmp = dfu_malloc(strlen(target) + 8);
+  sprintf(*tmp, "%s.XXXXXX", target);
+#ifdef WIN32
+  if (!_mktemp(*tmp))
+    return -1;
+  return open(*tmp, O_WRONLY | O_BINARY | O_CREAT | O_EXCL, 0666);
+#else
+  return mkstemp(*tmp);
+#endif
 }
 
+/* Writes the file to a temporary file and renames it over the original,
+ * so that a crash never leaves a half written file behind */
 void dfu_store_file(struct dfu_file *file, int write_suffix, int write_prefix) {
+  const char *target = file->name;
+  char *resolved = NULL;
   uint32_t crc = 0xffffffff;
+  struct stat st;
+  char *tmp;
   int f;
 
-  f = open(file->name, O_WRONLY | O_BINARY | O_TRUNC | O_CREAT, 0666);
+#ifndef WIN32
+  /* replace the file a symlink points to, not the link */
+  if (!lstat(file->name, &st) && S_ISLNK(st.st_mode)) {
+    resolved = realpath(file->name, NULL);
+    if (!resolved)
+      err(EX_CANTCREAT, "Could not resolve symlink %s", file->name);
+    target = resolved;
+  }
+#endif
+
+  f = dfu_file_open_temp(target, &tmp);
   if (f < 0)
-    err(EX_CANTCREAT, "Could not open file %s for writing", file->name);
+    err(EX_CANTCREAT, "Could not create temporary file %s", tmp);
 
   /* write prefix, if any */
   if (write_prefix) {
-    if (file->prefix_type == LMDFU_PREFIX) {
-      uint8_t lmdfu_prefix[LMDFU_PREFIX_LENGTH];
-      uint32_t addr = file->lmdfu_address / 1024;
-
-      /* lmdfu_dfu_prefix payload length excludes prefix and suffix */
-      uint32_t len = file->size.total - file->size.prefix - file->size.suffix;
-
-      lmdfu_prefix[0] = 0x01; /* STELLARIS_DFU_PROG */
-      lmdfu_prefix[1] = 0x00; /* Reserved */
-      lmdfu_prefix[2] = (uint8_t)(addr & 0xff);
-      lmdfu_prefix[3] = (uint8_t)(addr >> 8);
-      lmdfu_prefix[4] = (uint8_t)(len & 0xff);
-      lmdfu_prefix[5] = (uint8_t)(len >> 8) & 0xff;
-      lmdfu_prefix[6] = (uint8_t)(len >> 16) & 0xff;
-      lmdfu_prefix[7] = (uint8_t)(len >> 24);
-
-      crc = dfu_file_write_crc(f, crc, lmdfu_prefix, LMDFU_PREFIX_LENGTH);
-    }
-    if (file->prefix_type == LPCDFU_UNENCRYPTED_PREFIX) {
-      uint8_t lpcdfu_prefix[LPCDFU_PREFIX_LENGTH] = {0};
-      int i;
-
-      /* Payload is firmware and prefix rounded to 512 bytes */
-      uint32_t len = (file->size.total - file->size.suffix + 511) / 512;
-
-      lpcdfu_prefix[0] = 0x1a; /* Unencypted*/
-      lpcdfu_prefix[1] = 0x3f; /* Reserved */
-      lpcdfu_prefix[2] = (uint8_t)(len & 0xff);
-      lpcdfu_prefix[3] = (uint8_t)((len >> 8) & 0xff);
-      for (i = 12; i < LPCDFU_PREFIX_LENGTH; i++)
-        lpcdfu_prefix[i] = 0xff;
+    uint8_t prefix[LPCDFU_PREFIX_LENGTH];
+    int len = dfu_file_make_prefix(file, prefix);
 
-      crc = dfu_file_write_crc(f, crc, lpcdfu_prefix, LPCDFU_PREFIX_LENGTH);
-    }
+    crc = dfu_file_write_crc(f, crc, prefix, len);
   }
   /* write firmware binary */
   crc = dfu_file_write_crc(f, crc, file->firmware + file->size.prefix,
@@ -409,32 +1637,176 @@ void dfu_store_file(struct dfu_file *file, int write_suffix, int write_prefix) {
                                file->size.suffix);
 
   /* write suffix, if any */
-  if (write_suffix) {
-    uint8_t dfusuffix[DFU_SUFFIX_LENGTH];
+  if (write_suffix)
+    dfu_file_write_suffix(f, crc, file);
+  if (fsync(f) || close(f)) {
+    unlink(tmp);
+    err(EX_IOERR, "Could not write file %s", tmp);
+  }
 
-    dfusuffix[0] = file->bcdDevice & 0xff;
-    dfusuffix[1] = file->bcdDevice >> 8;
-    dfusuffix[2] = file->idProduct & 0xff;
-    dfusuffix[3] = file->idProduct >> 8;
-    dfusuffix[4] = file->idVendor & 0xff;
-    dfusuffix[5] = file->idVendor >> 8;
-    dfusuffix[6] = file->bcdDFU & 0xff;
-    dfusuffix[7] = file->bcdDFU >> 8;
-    dfusuffix[8] = 'U';
-    dfusuffix[9] = 'F';
-    dfusuffix[10] = 'D';
-    dfusuffix[11] = DFU_SUFFIX_LENGTH;
+  /* keep the permissions of the file being replaced */
+  if (!stat(target, &st)) {
+    chmod(tmp, st.st_mode & 0777);
+#ifdef WIN32
+    /* rename() does not replace existing files here */
+    remove(target);
+#endif
+  } else {
+#ifndef WIN32
+    /* mkstemp() creates the file readable by the owner only */
+    mode_t mask = umask(0);
+
+    umask(mask);
+    chmod(tmp, 0666 & ~mask);
+#endif
+  }
+  if (rename(tmp, target)) {
+    unlink(tmp);
+    err(EX_CANTCREAT, "Could not rename %s to %s", tmp, target);
+  }
+  free(resolved);
+  free(tmp);
+}
 
-    crc = dfu_file_write_crc(f, crc, dfusuffix, DFU_SUFFIX_LENGTH - 4);
+/* Like dfu_load_file, but keeps only the first bytes of the file in
+ * memory, enough for probing and rewriting the prefix. The CRC is
+ * computed while streaming through the file. */
+void dfu_scan_file(struct dfu_file *file, enum suffix_req check_suffix,
+                   enum prefix_req check_prefix) {
+  uint8_t tail[DFU_SUFFIX_LENGTH];
+  uint32_t crc = 0xffffffff;
+  uint8_t *buf;
+  off_t data_end;
+  off_t pos;
+  int head;
+  int f;
+
+  /* there is no going back in a stream */
+  if (!strcmp(file->name, "-")) {
+    dfu_load_file(file, check_suffix, check_prefix);
+    file->data_crc = dfu_file_crc(0xffffffff, file->firmware,
+                                  file->size.total - file->size.suffix);
+    return;
+  }
 
-    dfusuffix[12] = crc;
-    dfusuffix[13] = crc >> 8;
-    dfusuffix[14] = crc >> 16;
-    dfusuffix[15] = crc >> 24;
+  dfu_file_reset(file);
 
-    crc = dfu_file_write_crc(f, crc, dfusuffix + 12, 4);
+  f = open(file->name, O_RDONLY | O_BINARY);
+  if (f < 0)
+    err(EX_NOINPUT, "Could not open file %s for reading", file->name);
+  file->size.total = lseek(f, 0, SEEK_END);
+  if (file->size.total < 0 || lseek(f, 0, SEEK_SET) != 0)
+    err(EX_IOERR, "Could not seek in file %s", file->name);
+
+  /* the data a suffix would cover, and its own first 12 bytes */
+  data_end = file->size.total >= DFU_SUFFIX_LENGTH
+                 ? file->size.total - DFU_SUFFIX_LENGTH
+                 : file->size.total;
+
+  head = file->size.total < LPCDFU_PREFIX_LENGTH ? (int)file->size.total
+                                                 : LPCDFU_PREFIX_LENGTH;
+  file->firmware = dfu_malloc(LPCDFU_PREFIX_LENGTH);
+  buf = dfu_malloc(STDIN_CHUNK_SIZE);
+  for (pos = 0; pos < data_end;) {
+    ssize_t len = data_end - pos;
+
+    if (len > STDIN_CHUNK_SIZE)
+      len = STDIN_CHUNK_SIZE;
+    len = read(f, buf, len);
+    if (len < 0 && errno == EINTR)
+      continue;
+    if (len <= 0)
+      err(EX_IOERR, "Could not read file %s", file->name);
+    if (pos < head)
+      memcpy(file->firmware + pos, buf,
+             len < head - pos ? (size_t)len : (size_t)(head - pos));
+    crc = dfu_file_crc(crc, buf, len);
+    pos += len;
   }
+  free(buf);
+  if (data_end < file->size.total &&
+      read(f, tail, DFU_SUFFIX_LENGTH) != DFU_SUFFIX_LENGTH)
+    err(EX_IOERR, "Could not read file %s", file->name);
   close(f);
+
+  if (data_end < file->size.total) {
+    if (data_end < head)
+      memcpy(file->firmware + data_end, tail, head - data_end);
+    file->data_crc = dfu_file_crc(crc, tail, DFU_SUFFIX_LENGTH - 4);
+    dfu_file_parse_suffix(file, file->data_crc, tail, check_suffix);
+    /* without a suffix the tail is data as well */
+    if (file->size.suffix)
+      file->data_crc = crc;
+    else
+      file->data_crc = dfu_file_crc(file->data_crc, tail + 12, 4);
+  } else {
+    file->data_crc = crc;
+    dfu_file_parse_suffix(file, crc, NULL, check_suffix);
+  }
+  dfu_file_check_prefix(file, check_prefix);
+}
+
+/* Adds the suffix from the file fields to a file read by dfu_scan_file,
+ * or removes its suffix. Only the suffix is written or truncated away,
+ * unless the prefix must change, then the whole file is rewritten. */
+void dfu_update_suffix(struct dfu_file *file, int write_suffix) {
+  uint8_t prefix[LPCDFU_PREFIX_LENGTH];
+  off_t data_end;
+  int f;
+
+  /* a stream was loaded completely */
+  if (!strcmp(file->name, "-")) {
+    dfu_store_file(file, write_suffix, file->size.prefix != 0);
+    return;
+  }
+
+  if (file->size.prefix) {
+    int len = dfu_file_make_prefix(file, prefix);
+
+    if (len != file->size.prefix || memcmp(prefix, file->firmware, len)) {
+      struct dfu_file loaded = *file;
+
+      printf("Prefix changes, rewriting file\n");
+      loaded.firmware = NULL;
+      dfu_load_file(&loaded, write_suffix ? NO_SUFFIX : NEEDS_SUFFIX,
+                    NEEDS_PREFIX);
+      loaded.bcdDFU = file->bcdDFU;
+      loaded.idVendor = file->idVendor;
+      loaded.idProduct = file->idProduct;
+      loaded.bcdDevice = file->bcdDevice;
+      dfu_store_file(&loaded, write_suffix, 1);
+      free(loaded.firmware);
+      return;
+    }
+  }
+
+  data_end = file->size.total - file->size.suffix;
+  f = open(file->name, O_RDWR | O_BINARY);
+  if (f < 0)
+    err(EX_CANTCREAT, "Could not open file %s for writing", file->name);
+
+  if (write_suffix) {
+    uint8_t dfusuffix[DFU_SUFFIX_LENGTH];
+
+    dfu_file_make_suffix(dfusuffix, file->data_crc, file);
+    if (lseek(f, data_end, SEEK_SET) != data_end)
+      err(EX_IOERR, "Could not seek in file %s", file->name);
+    /* a failed write must not leave a broken suffix behind */
+    if (write(f, dfusuffix, DFU_SUFFIX_LENGTH) != DFU_SUFFIX_LENGTH) {
+      int saved = errno;
+
+      if (ftruncate(f, data_end))
+        warn("Could not restore size of %s", file->name);
+      errno = saved;
+      err(EX_IOERR, "Could not add suffix to %s", file->name);
+    }
+  } else if (ftruncate(f, data_end)) {
+    err(EX_IOERR, "Could not remove suffix from %s", file->name);
+  }
+  if (fsync(f) || close(f))
+    err(EX_IOERR, "Could not write file %s", file->name);
+  file->size.total = data_end + (write_suffix ? DFU_SUFFIX_LENGTH : 0);
+  file->size.suffix = write_suffix ? DFU_SUFFIX_LENGTH : 0;
 }
 
 void show_suffix_and_prefix(struct dfu_file *file) {
@@ -463,3 +1835,153 @@ void show_suffix_and_prefix(struct dfu_file *file) {
     printf("CRC:\t\t0x%08X\n", file->dwCRC);
   }
 }
+
+/* Prints the properties of a file on one line, for batch mode */
+void dfu_file_summary(struct dfu_file *file) {
+  const char *prefix = "none";
+
+  if (file->size.prefix == LMDFU_PREFIX_LENGTH)
+    prefix = "stellaris";
+  else if (file->size.prefix == LPCDFU_PREFIX_LENGTH)
+    prefix = "lpc";
+  if (file->size.suffix)
+    printf("%s: CRC 0x%08X VID 0x%04X PID 0x%04X prefix %s\n", file->name,
+           file->dwCRC, file->idVendor, file->idProduct, prefix);
+  else
+    printf("%s: no suffix, prefix %s\n", file->name, prefix);
+}
+
+static int dfu_file_compare_names(const void *a, const void *b) {
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* Reads the file names of a batch, from a directory or a list file */
+static char **dfu_file_batch_names(const char *list, int *num_names) {
+  char **names = NULL;
+  int n = 0;
+  struct stat st;
+
+  if (!stat(list, &st) && S_ISDIR(st.st_mode)) {
+    DIR *dir = opendir(list);
+    struct dirent *entry;
+
+    if (!dir)
+      err(EX_NOINPUT, "Could not open directory %s", list);
+    while ((entry = readdir(dir))) {
+      char *name;
+
+      if (entry->d_name[0] == '.')
+        continue;
+      name = dfu_malloc(strlen(list) + strlen(entry->d_name) + 2);
+      sprintf(name, "%s/%s", list, entry->d_name);
+      if (stat(name, &st) || !S_ISREG(st.st_mode)) {
+        free(name);
+        continue;
+      }
+      names = realloc(names, (n + 1) * sizeof(*names));
+      if (!names)
+        err(EX_SOFTWARE, "Could not allocate file list");
+      names[n++] = name;
+    }
+    closedir(dir);
+    qsort(names, n, sizeof(*names), dfu_file_compare_names);
+  } else {
+    FILE *f = strcmp(list, "-") ? fopen(list, "r") : stdin;
+    char line[4096];
+
+    if (!f)
+      err(EX_NOINPUT, "Could not open file list %s", list);
+    while (fgets(line, sizeof(line), f)) {
+      line[strcspn(line, "\r\n")] = 0;
+      if (!line[0])
+        continue;
+      names = realloc(names, (n + 1) * sizeof(*names));
+      if (!names)
+        err(EX_SOFTWARE, "Could not allocate file list");
+      names[n] = dfu_malloc(strlen(line) + 1);
+      strcpy(names[n++], line);
+    }
+    if (f != stdin)
+      fclose(f);
+  }
+  *num_names = n;
+  return names;
+}
+
+/* Calls fn for every file of a batch, where list is a directory or a
+ * file with one name per line. Files are handled by parallel worker
+ * processes where fork() is available, a failing worker only fails its
+ * own file. Returns the number of failed files. */
+int dfu_file_batch(const char *list, void (*fn)(struct dfu_file *file)) {
+  struct dfu_file file;
+  char **names;
+  int num_names;
+  int failed = 0;
+  int i;
+#ifndef WIN32
+  pid_t *workers;
+  int max_workers = 4;
+  int running = 0;
+  int next = 0;
+#endif
+
+  names = dfu_file_batch_names(list, &num_names);
+  if (!num_names)
+    warnx("No files in %s", list);
+
+#ifdef WIN32
+  /* no fork() here, an error exits on the spot */
+  for (i = 0; i < num_names; i++) {
+    memset(&file, 0, sizeof(file));
+    file.name = names[i];
+    fn(&file);
+    free(file.firmware);
+  }
+#else
+#ifdef _SC_NPROCESSORS_ONLN
+  max_workers = sysconf(_SC_NPROCESSORS_ONLN);
+  if (max_workers < 1)
+    max_workers = 1;
+#endif
+  workers = dfu_malloc((num_names + 1) * sizeof(*workers));
+
+  /* nothing buffered may be printed again by the workers */
+  fflush(stdout);
+  while (next < num_names || running) {
+    int status;
+    pid_t pid;
+
+    if (next < num_names && running < max_workers) {
+      pid = fork();
+      if (pid < 0)
+        err(EX_SOFTWARE, "Could not start worker");
+      if (pid == 0) {
+        memset(&file, 0, sizeof(file));
+        file.name = names[next];
+        fn(&file);
+        exit(EX_OK);
+      }
+      workers[next++] = pid;
+      running++;
+      continue;
+    }
+
+    pid = wait(&status);
+    if (pid < 0)
+      err(EX_SOFTWARE, "Could not wait for worker");
+    running--;
+    if (WIFEXITED(status) && WEXITSTATUS(status) == EX_OK)
+      continue;
+    for (i = 0; i < next; i++)
+      if (workers[i] == pid)
+        warnx("%s: failed", names[i]);
+    failed++;
+  }
+  free(workers);
+#endif
+
+  for (i = 0; i < num_names; i++)
+    free(names[i]);
+  free(names);
+  return failed;
+}
@@ -4,6 +4,13 @@
 
 #include <stdint.h>
 
+/* A piece of an image with its own load address */
+struct dfu_segment {
+	uint32_t address;
+	uint32_t size;
+	uint8_t *data;
+};
+
 struct dfu_file {
     /* File name */
     const char *name;
@@ -26,12 +33,30 @@ struct dfu_file {
     uint16_t idVendor;
     uint16_t idProduct;
     uint16_t bcdDevice;
+
+    /* CRC of the data before any suffix, set by dfu_scan_file */
+    uint32_t data_crc;
+
+    /* Loadable segments sorted by address, for images with load
+     * addresses (ELF, Intel HEX, S-record), otherwise NULL */
+    struct dfu_segment *segments;
+    int num_segments;
+    /* Decoded segment data, when not pointing into firmware */
+    uint8_t *segment_buffer;
+};
+
+/* Download position after the last acknowledged block */
+struct dfu_journal {
+	int element;
+	off_t offset;
+	int transaction;
 };
 
 enum suffix_req {
 	NO_SUFFIX,
 	NEEDS_SUFFIX,
-	MAYBE_SUFFIX
+	MAYBE_SUFFIX,
+	ANY_SUFFIX	/* like MAYBE_SUFFIX, without warning */
 };
 
 enum prefix_req {
@@ -40,6 +65,13 @@ enum prefix_req {
 	MAYBE_PREFIX
 };
 
+/* When a file is treated as an image or as compressed data */
+enum file_detect {
+	DETECT_NEVER,
+	DETECT_BY_NAME,		/* by the file name extension */
+	DETECT_ALWAYS		/* by the file contents */
+};
+
 enum prefix_type {
 	ZERO_PREFIX,
 	LMDFU_PREFIX,
@@ -47,14 +79,34 @@ enum prefix_type {
 };
 
 extern int verbose;
+extern int dfu_file_sparse;
+extern int dfu_file_resume;
+extern enum file_detect dfu_file_uncompress;
+extern enum file_detect dfu_file_parse_images;
 
 void dfu_load_file(struct dfu_file *file, enum suffix_req check_suffix, enum prefix_req check_prefix);
 void dfu_store_file(struct dfu_file *file, int write_suffix, int write_prefix);
+void dfu_scan_file(struct dfu_file *file, enum suffix_req check_suffix, enum prefix_req check_prefix);
+void dfu_update_suffix(struct dfu_file *file, int write_suffix);
+void dfu_file_parse_image(struct dfu_file *file);
 
+void dfu_setup_output(void);
 void dfu_progress_bar(const char *desc, unsigned long long curr,
 		unsigned long long max);
+unsigned long long dfu_get_time_ms(void);
 void *dfu_malloc(size_t size);
+uint32_t dfu_file_crc(uint32_t crc, const void *buf, size_t size);
 uint32_t dfu_file_write_crc(int f, uint32_t crc, const void *buf, int size);
+void dfu_file_sparse_flush(int f);
+void dfu_file_sparse_finish(int f, const char *name);
+int dfu_file_open_temp(const char *target, char **tmp);
+int dfu_journal_open(struct dfu_file *file, int xfer_size,
+		     struct dfu_journal *pos);
+void dfu_journal_save(const struct dfu_journal *pos);
+void dfu_journal_close(int completed);
+void dfu_file_write_suffix(int f, uint32_t crc, struct dfu_file *file);
 void show_suffix_and_prefix(struct dfu_file *file);
+void dfu_file_summary(struct dfu_file *file);
+int dfu_file_batch(const char *list, void (*fn)(struct dfu_file *file));
 
 #endif /* DFU_FILE_H */
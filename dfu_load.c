@@ -45,6 +45,10 @@
 #include "quirks.h"
 #include "usb_dfu.h"
 
+/* Bounds of the backoff between status requests during manifestation */
+#define MANIFEST_POLL_MIN 10
+#define MANIFEST_POLL_MAX 1000
+
 int dfuload_do_upload(struct dfu_if *dif, int xfer_size, int expected_size,
                       int fd) {
   off_t total_bytes = 0;
@@ -96,120 +100,336 @@ int dfuload_do_upload(struct dfu_if *dif, int xfer_size, int expected_size,
   return ret;
 }
 
-int dfuload_do_dnload(struct dfu_if *dif, int xfer_size,
-                      struct dfu_file *file) {
-  off_t bytes_sent;
-  off_t expected_size;
-  unsigned char *buf;
+/* Uploads the device contents and compares them with the image */
+/* returns 1 if the device already holds the image, 0 otherwise */
+static int dfuload_image_on_device(struct dfu_if *dif, int xfer_size,
+                                   const unsigned char *data, off_t size) {
   unsigned short transaction = 0;
-  struct dfu_status dst;
-  int ret;
+  unsigned char *buf;
+  off_t offset = 0;
+  int same;
 
-  printf("Copying data from PC to DFU device\n");
+  buf = dfu_malloc(xfer_size);
+  while (offset < size) {
+    int rc = dfu_upload(dif->dev_handle, dif->interface, xfer_size,
+                        transaction++, buf);
+    if (rc < 0) {
+      warnx("Cannot read back the device, downloading unconditionally");
+      dfu_clear_status(dif->dev_handle, dif->interface);
+      break;
+    }
+    /* memory beyond the image is left as it is */
+    if (rc > size - offset)
+      rc = (int)(size - offset);
+    if (memcmp(buf, data + offset, rc))
+      break;
+    offset += rc;
+    if (rc < xfer_size)
+      break;
+  }
+  same = offset == size;
+  free(buf);
+  dfu_abort_to_idle(dif);
+
+  return same;
+}
 
-  buf = file->firmware;
-  expected_size = file->size.total - file->size.suffix;
-  bytes_sent = 0;
+void dfuload_machine_init(struct dfuload_machine *m, struct dfu_if *dif,
+                          struct dfu_file *file, int xfer_size,
+                          const char *prefix) {
+  memset(m, 0, sizeof(*m));
+  m->dif = dif;
+  m->prefix = prefix;
+  m->state = DFULOAD_DNLOAD;
+  m->image = file->firmware;
+  m->size = file->size.total - file->size.suffix;
+  m->xfer_size = xfer_size;
+  m->manifest_poll = MANIFEST_POLL_MIN;
+}
 
-  dfu_progress_bar("Download", 0, 1);
-  while (bytes_sent < expected_size) {
-    off_t bytes_left;
-    int chunk_size;
-
-    bytes_left = expected_size - bytes_sent;
-    if (bytes_left < xfer_size)
-      chunk_size = (int)bytes_left;
-    else
-      chunk_size = xfer_size;
-
-    ret = dfu_download(dif->dev_handle, dif->interface, chunk_size,
-                       transaction++, chunk_size ? buf : NULL);
-    if (ret < 0) {
-      warnx("Error during download (%s)", libusb_error_name(ret));
-      goto out;
+/* Fill in the request for the current state */
+void dfuload_machine_request(struct dfuload_machine *m,
+                             struct dfuload_request *req) {
+  off_t bytes_left;
+
+  memset(req, 0, sizeof(*req));
+  req->direction = LIBUSB_ENDPOINT_OUT;
+  switch (m->state) {
+  case DFULOAD_STATUS:
+  case DFULOAD_DNLOAD_STATUS:
+  case DFULOAD_MANIFEST_STATUS:
+    req->direction = LIBUSB_ENDPOINT_IN;
+    req->request = DFU_GETSTATUS;
+    req->data = m->response;
+    req->length = sizeof(m->response);
+    break;
+  case DFULOAD_CLRSTATUS:
+    req->request = DFU_CLRSTATUS;
+    break;
+  case DFULOAD_ABORT:
+    req->request = DFU_ABORT;
+    break;
+  case DFULOAD_DNLOAD:
+    bytes_left = m->size - m->bytes_sent;
+    m->chunk_size = bytes_left < m->xfer_size ? (int)bytes_left : m->xfer_size;
+    req->request = DFU_DNLOAD;
+    req->value = m->transaction;
+    req->data = m->chunk_size ? m->image + m->bytes_sent : NULL;
+    req->length = m->chunk_size;
+    break;
+  default:
+    break;
+  }
+}
+
+static void dfuload_machine_fail(struct dfuload_machine *m, const char *what,
+                                 const char *why, int error) {
+  m->error = what;
+  m->reason = why;
+  m->error_code = error;
+  m->state = DFULOAD_FAILED;
+}
+
+/* Handle a failed request, returns 1 if it is worth another try */
+static int dfuload_machine_retry(struct dfuload_machine *m, const char *what,
+                                 int ret) {
+  /* whether a failed DNLOAD reached the device can not be told
+   * apart, but asking for the status again is harmless */
+  if (m->state != DFULOAD_STATUS && m->state != DFULOAD_DNLOAD_STATUS &&
+      m->state != DFULOAD_MANIFEST_STATUS)
+    return 0;
+  if (!dfu_transient_error(ret) || m->attempt >= dfu_retry_limit)
+    return 0;
+  warnx("%s%s (%s), retrying", m->prefix, what, libusb_error_name(ret));
+  m->delay = DFU_RETRY_DELAY << m->attempt;
+  m->attempt++;
+  return 1;
+}
+
+/* Advance the state machine with the result of the last request, the
+ * number of bytes transferred or a libusb error */
+void dfuload_machine_complete(struct dfuload_machine *m, int ret) {
+  static const char *const failed[] = {
+      [DFULOAD_STATUS] = "Error reading DFU status",
+      [DFULOAD_CLRSTATUS] = "Error clearing DFU status",
+      [DFULOAD_ABORT] = "Error aborting previous transfer",
+      [DFULOAD_DNLOAD] = "Error during download",
+      [DFULOAD_DNLOAD_STATUS] = "Error during download get_status",
+      [DFULOAD_MANIFEST_STATUS] = "Unable to read DFU status after completion",
+  };
+  struct dfu_status *dst = &m->status;
+
+  m->delay = 0;
+  if (ret < 0) {
+    if (!dfuload_machine_retry(m, failed[m->state], ret)) {
+      if (m->state == DFULOAD_DNLOAD && !m->chunk_size)
+        dfuload_machine_fail(m, "Error sending completion packet",
+                             libusb_error_name(ret), ret);
+      else
+        dfuload_machine_fail(m, failed[m->state], libusb_error_name(ret),
+                             ret);
     }
-    bytes_sent += chunk_size;
-    buf += chunk_size;
-
-    do {
-      ret = dfu_get_status(dif, &dst);
-      if (ret < 0) {
-        errx(EX_IOERR, "Error during download get_status (%s)",
-             libusb_error_name(ret));
-        goto out;
-      }
+    return;
+  }
+  /* only retries that succeeded count */
+  dfu_retry_count += m->attempt;
+  m->attempt = 0;
 
-      if (dst.bState == DFU_STATE_dfuDNLOAD_IDLE ||
-          dst.bState == DFU_STATE_dfuERROR)
-        break;
+  if (m->state == DFULOAD_STATUS || m->state == DFULOAD_DNLOAD_STATUS ||
+      m->state == DFULOAD_MANIFEST_STATUS) {
+    if (ret != sizeof(m->response)) {
+      dfuload_machine_fail(m, failed[m->state], "short status response",
+                           LIBUSB_ERROR_IO);
+      return;
+    }
+    dfu_decode_status(m->dif, m->response, dst);
+  }
 
-      /* Wait while device executes flashing */
-      milli_sleep(dst.bwPollTimeout);
-      if (verbose > 1)
-        fprintf(stderr, "Poll timeout %i ms\n", dst.bwPollTimeout);
+  switch (m->state) {
+  case DFULOAD_STATUS:
+    m->delay = dst->bwPollTimeout;
+    switch (dst->bState) {
+    case DFU_STATE_appIDLE:
+    case DFU_STATE_appDETACH:
+      dfuload_machine_fail(m, "Device still in Run-Time Mode",
+                           dfu_state_to_string(dst->bState), 0);
+      break;
+    case DFU_STATE_dfuERROR:
+      m->state = DFULOAD_CLRSTATUS;
+      break;
+    case DFU_STATE_dfuDNLOAD_IDLE:
+    case DFU_STATE_dfuUPLOAD_IDLE:
+      m->state = DFULOAD_ABORT;
+      break;
+    default:
+      if (dst->bStatus != DFU_STATUS_OK)
+        m->state = DFULOAD_CLRSTATUS;
+      else
+        m->state = DFULOAD_DNLOAD;
+      break;
+    }
+    break;
+  case DFULOAD_CLRSTATUS:
+  case DFULOAD_ABORT:
+    m->state = DFULOAD_STATUS;
+    break;
+  case DFULOAD_DNLOAD:
+    m->transaction++;
+    if (m->chunk_size == 0) {
+      m->state = DFULOAD_MANIFEST_STATUS;
+      /* the TAS1020b does not answer right after the completion packet */
+      if (m->dif->quirks & QUIRK_MANIFEST_DELAY)
+        m->delay = MANIFEST_DELAY;
+    } else {
+      m->bytes_sent += m->chunk_size;
+      m->state = DFULOAD_DNLOAD_STATUS;
+    }
+    break;
+  case DFULOAD_DNLOAD_STATUS:
+    if (dst->bState != DFU_STATE_dfuDNLOAD_IDLE &&
+        dst->bState != DFU_STATE_dfuERROR) {
+      /* poll again when the device expects to be done flashing */
+      m->delay = dst->bwPollTimeout;
+      break;
+    }
+    if (dst->bStatus != DFU_STATUS_OK) {
+      dfuload_machine_fail(m, "Download failed",
+                           dfu_status_to_string(dst->bStatus), 0);
+      break;
+    }
+    m->state = DFULOAD_DNLOAD;
+    break;
+  case DFULOAD_MANIFEST_STATUS:
+    m->delay = dst->bwPollTimeout;
+    /* FIXME: deal correctly with ManifestationTolerant=0 / WillDetach bits */
+    switch (dst->bState) {
+    case DFU_STATE_dfuMANIFEST_SYNC:
+    case DFU_STATE_dfuMANIFEST:
+      if (!m->manifest_start)
+        m->manifest_start = dfu_get_time_ms();
+      /* most devices finish within tens of ms, so start short */
+      m->delay += m->manifest_poll;
+      m->manifest_poll *= 2;
+      if (m->manifest_poll > MANIFEST_POLL_MAX)
+        m->manifest_poll = MANIFEST_POLL_MAX;
+      break;
+    case DFU_STATE_dfuMANIFEST_WAIT_RST:
+      m->needs_reset = 1;
+      /* fall through */
+    default:
+      m->state = DFULOAD_DONE;
+      break;
+    }
+    break;
+  default:
+    break;
+  }
+}
+
+int dfuload_do_dnload(struct dfu_if *dif, int xfer_size, int upload_xfer_size,
+                      struct dfu_file *file) {
+  struct dfuload_machine m;
+  struct dfu_status dst;
+  struct dfu_journal journal;
+  int ret;
+
+  printf("Copying data from PC to DFU device\n");
+
+  dfuload_machine_init(&m, dif, file, xfer_size, "");
 
-    } while (1);
+  if (dfu_file_resume) {
+    int resumable = dfu_journal_open(file, xfer_size, &journal);
 
-    if (dst.bStatus != DFU_STATUS_OK) {
-      printf(" failed!\n");
-      printf("DFU state(%u) = %s, status(%u) = %s\n", dst.bState,
-             dfu_state_to_string(dst.bState), dst.bStatus,
-             dfu_status_to_string(dst.bStatus));
-      ret = -1;
-      goto out;
+    /* The block sequence can only be continued within the same
+     * download operation, anything else requires a restart */
+    ret = dfu_get_status(dif, &dst);
+    if (resumable && ret >= 0 && dst.bState == DFU_STATE_dfuDNLOAD_IDLE &&
+        dst.bStatus == DFU_STATUS_OK) {
+      printf("Resuming download at offset %lli, block %i\n",
+             (long long)journal.offset, journal.transaction);
+      m.bytes_sent = journal.offset;
+      m.transaction = journal.transaction;
+    } else {
+      if (resumable)
+        printf("Device is not in dfuDNLOAD-IDLE, restarting download\n");
+      /* main.c keeps an unfinished transfer alive for the journal */
+      if (ret >= 0 && dst.bState != DFU_STATE_dfuIDLE)
+        dfu_abort_to_idle(dif);
+      memset(&journal, 0, sizeof(journal));
     }
-    dfu_progress_bar("Download", bytes_sent, bytes_sent + bytes_left);
   }
 
-  /* send one zero sized download request to signalize end */
-  ret = dfu_download(dif->dev_handle, dif->interface, 0, transaction, NULL);
-  if (ret < 0) {
-    errx(EX_IOERR, "Error sending completion packet (%s)",
-         libusb_error_name(ret));
-    goto out;
+  /* a resumed download is known to be incomplete */
+  if (dfu_skip_if_same && !m.bytes_sent) {
+    if (!(dif->func_dfu.bmAttributes & USB_DFU_CAN_UPLOAD)) {
+      warnx("Device can not upload, downloading unconditionally");
+    } else if (dfuload_image_on_device(dif, upload_xfer_size, m.image,
+                                       m.size)) {
+      printf("Device already holds this image, skipping download\n");
+      dfu_journal_close(1);
+      return DFU_IMAGE_ON_DEVICE;
+    }
   }
 
-  dfu_progress_bar("Download", bytes_sent, bytes_sent);
+  dfu_progress_bar("Download", 0, 1);
+  while (m.state != DFULOAD_DONE && m.state != DFULOAD_FAILED) {
+    enum dfuload_state prev = m.state;
+    struct dfuload_request req;
 
-  if (verbose)
-    printf("Sent a total of %lli bytes\n", (long long)bytes_sent);
+    milli_sleep(m.delay);
+    dfuload_machine_request(&m, &req);
+    ret = dfu_request(dif, req.direction, req.request, req.value, req.data,
+                      req.length);
+    dfuload_machine_complete(&m, ret);
 
-get_status:
-  /* Transition to MANIFEST_SYNC state */
-  ret = dfu_get_status(dif, &dst);
-  if (ret < 0) {
-    warnx("unable to read DFU status after completion (%s)",
-          libusb_error_name(ret));
-    goto out;
+    if (prev == DFULOAD_DNLOAD_STATUS && m.state == DFULOAD_DNLOAD) {
+      /* the block is written */
+      if (dfu_file_resume) {
+        journal.offset = m.bytes_sent;
+        journal.transaction = m.transaction;
+        dfu_journal_save(&journal);
+      }
+      dfu_progress_bar("Download", m.bytes_sent, m.size);
+    } else if (prev == DFULOAD_DNLOAD_STATUS && ret >= 0 && m.delay &&
+               verbose > 1) {
+      fprintf(stderr, "Poll timeout %i ms\n", m.delay);
+    } else if (prev == DFULOAD_DNLOAD &&
+               m.state == DFULOAD_MANIFEST_STATUS) {
+      dfu_progress_bar("Download", m.bytes_sent, m.bytes_sent);
+      if (verbose)
+        printf("Sent a total of %lli bytes\n", (long long)m.bytes_sent);
+      dfu_journal_close(1);
+    } else if (prev == DFULOAD_MANIFEST_STATUS && ret >= 0) {
+      printf("DFU state(%u) = %s, status(%u) = %s\n", m.status.bState,
+             dfu_state_to_string(m.status.bState), m.status.bStatus,
+             dfu_status_to_string(m.status.bStatus));
+    }
   }
-  printf("DFU state(%u) = %s, status(%u) = %s\n", dst.bState,
-         dfu_state_to_string(dst.bState), dst.bStatus,
-         dfu_status_to_string(dst.bStatus));
-
-  milli_sleep(dst.bwPollTimeout);
-
-  /* FIXME: deal correctly with ManifestationTolerant=0 / WillDetach bits */
-  switch (dst.bState) {
-  case DFU_STATE_dfuMANIFEST_SYNC:
-  case DFU_STATE_dfuMANIFEST:
-    /* some devices (e.g. TAS1020b) need some time before we
-     * can obtain the status */
-    milli_sleep(1000);
-    goto get_status;
-    break;
-  case DFU_STATE_dfuMANIFEST_WAIT_RST:
+
+  if (m.state == DFULOAD_FAILED) {
+    if (m.error_code) {
+      warnx("%s (%s)", m.error, m.reason);
+      return m.error_code;
+    }
+    printf(" failed!\n");
+    printf("DFU state(%u) = %s, status(%u) = %s\n", m.status.bState,
+           dfu_state_to_string(m.status.bState), m.status.bStatus,
+           dfu_status_to_string(m.status.bStatus));
+    return -1;
+  }
+
+  milli_sleep(m.delay);
+  if (m.needs_reset) {
     printf("Resetting USB to switch back to runtime mode\n");
     ret = libusb_reset_device(dif->dev_handle);
     if (ret < 0 && ret != LIBUSB_ERROR_NOT_FOUND) {
       fprintf(stderr, "error resetting after download (%s)\n",
               libusb_error_name(ret));
     }
-    break;
-  case DFU_STATE_dfuIDLE:
-    break;
   }
+  if (m.manifest_start)
+    printf("Manifestation took %llu ms\n",
+           dfu_get_time_ms() - m.manifest_start);
   printf("Done!\n");
-
-out:
-  return ret;
+  return 0;
 }
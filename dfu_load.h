@@ -1,7 +1,59 @@
 #ifndef DFU_LOAD_H
 #define DFU_LOAD_H
 
+/* Plain DFU download state machine, stepped by dfuload_do_dnload() with
+ * synchronous requests and by dfu_engine.c with asynchronous ones */
+enum dfuload_state {
+	DFULOAD_STATUS,          /* find the initial state */
+	DFULOAD_CLRSTATUS,       /* leave dfuERROR */
+	DFULOAD_ABORT,           /* drop a previous incomplete transfer */
+	DFULOAD_DNLOAD,          /* send the next block, or the final empty one */
+	DFULOAD_DNLOAD_STATUS,   /* wait for the block to be written */
+	DFULOAD_MANIFEST_STATUS, /* wait for manifestation */
+	DFULOAD_DONE,
+	DFULOAD_FAILED
+};
+
+/* The class request to the DFU interface that the machine waits for */
+struct dfuload_request {
+	uint8_t direction;
+	uint8_t request;
+	uint16_t value;
+	unsigned char *data;
+	uint16_t length;
+};
+
+struct dfuload_machine {
+	struct dfu_if *dif;
+	const char *prefix;          /* in front of messages */
+	enum dfuload_state state;
+	unsigned char *image;
+	off_t size;
+	off_t bytes_sent;
+	int xfer_size;
+	int chunk_size;
+	unsigned short transaction;
+	int attempt;                 /* retries of the current request */
+	unsigned int delay;          /* ms to wait before the next request */
+	unsigned int manifest_poll;
+	unsigned long long manifest_start;
+	int needs_reset;             /* device waits for a USB reset */
+	struct dfu_status status;    /* last status response */
+	unsigned char response[6];
+	const char *error;           /* what failed and why */
+	const char *reason;
+	int error_code;              /* libusb error, or 0 */
+};
+
+void dfuload_machine_init(struct dfuload_machine *m, struct dfu_if *dif,
+			  struct dfu_file *file, int xfer_size,
+			  const char *prefix);
+void dfuload_machine_request(struct dfuload_machine *m,
+			     struct dfuload_request *req);
+void dfuload_machine_complete(struct dfuload_machine *m, int ret);
+
 int dfuload_do_upload(struct dfu_if *dif, int xfer_size, int expected_size, int fd);
-int dfuload_do_dnload(struct dfu_if *dif, int xfer_size, struct dfu_file *file);
+int dfuload_do_dnload(struct dfu_if *dif, int xfer_size, int upload_xfer_size,
+		      struct dfu_file *file);
 
 #endif /* DFU_LOAD_H */
@@ -34,6 +34,7 @@
 #include <string.h>
 
 #include "dfu.h"
+#include "dfu_cache.h"
 #include "dfu_file.h"
 #include "dfu_util.h"
 #include "portable.h"
@@ -73,6 +74,77 @@ static int find_descriptor(const uint8_t *desc_list, int list_len,
   return -1;
 }
 
+/* String descriptor fetched ahead of the probe, see probe_prefetch() */
+#define PROBE_MAX_STRINGS 16
+
+struct probe_string {
+  uint8_t index;
+  int submitted;
+  int length; /* bytes received, or a negative libusb error */
+  unsigned char data[255];
+};
+
+/*
+ * A device being probed. It is opened, and its language ID and serial
+ * number are read, only when first needed and then only once.
+ */
+struct probe_device {
+  libusb_device *dev;
+  struct libusb_device_descriptor desc;
+  libusb_device_handle *devh;
+  int open_error;
+  int langid;
+  int have_serial;
+  char serial_name[MAX_DESC_STR_LEN + 1];
+  struct probe_string langids;
+  int num_strings;
+  struct probe_string strings[PROBE_MAX_STRINGS];
+  uint32_t digest;
+  struct dfu_cache *cache;
+  int cache_miss;
+};
+
+/* returns 0 when the device is open */
+static int probe_open(struct probe_device *pdev) {
+  if (!pdev->devh && !pdev->open_error) {
+    pdev->open_error = libusb_open(pdev->dev, &pdev->devh);
+    if (pdev->open_error)
+      pdev->devh = NULL;
+  }
+  return pdev->open_error;
+}
+
+static void probe_close(struct probe_device *pdev) {
+  if (pdev->devh)
+    libusb_close(pdev->devh);
+  pdev->devh = NULL;
+  dfu_cache_free(pdev->cache);
+  pdev->cache = NULL;
+}
+
+/* get the language IDs and pick the first one */
+static int probe_langid(struct probe_device *pdev) {
+  unsigned char tbuf[255];
+  int r;
+
+  if (pdev->langid >= 0)
+    return pdev->langid;
+
+  r = libusb_get_string_descriptor(pdev->devh, 0, 0, tbuf, sizeof(tbuf));
+  if (r < 0) {
+    warnx("Failed to retrieve language identifiers");
+    return r;
+  }
+  if (r < 4 || tbuf[0] < 4 ||
+      tbuf[1] != LIBUSB_DT_STRING) { /* must have at least one ID */
+    warnx("Broken LANGID string descriptor");
+    return -1;
+  }
+  pdev->langid = tbuf[2] | (tbuf[3] << 8);
+
+  return pdev->langid;
+}
+
 /*
  * Get a string descriptor that's UTF-8 (or ASCII) encoded instead
  * of UTF-16 encoded like the USB specification mandates. Some
@@ -81,28 +153,29 @@ static int find_descriptor(const uint8_t *desc_list, int list_len,
  * function does NOT append a NUL terminator to its buffer, so you
  * must use the returned length to ensure you stay within bounds.
  */
-static int get_utf8_string_descriptor(libusb_device_handle *devh,
+static int get_utf8_string_descriptor(struct probe_device *pdev,
                                       uint8_t desc_index, unsigned char *data,
                                       int length) {
+  libusb_device_handle *devh = pdev->devh;
   unsigned char tbuf[255];
-  uint16_t langid;
+  int langid;
   int r, outlen;
 
-  /* get the language IDs and pick the first one */
-  r = libusb_get_string_descriptor(devh, 0, 0, tbuf, sizeof(tbuf));
-  if (r < 0) {
-    warnx("Failed to retrieve language identifiers");
-    return r;
+  for (r = 0; r < pdev->num_strings; r++) {
+    if (pdev->strings[r].index == desc_index && pdev->strings[r].submitted)
+      break;
   }
-  if (r < 4 || tbuf[0] < 4 ||
-      tbuf[1] != LIBUSB_DT_STRING) { /* must have at least one ID */
-    warnx("Broken LANGID string descriptor");
-    return -1;
+  if (r < pdev->num_strings) {
+    memcpy(tbuf, pdev->strings[r].data, sizeof(tbuf));
+    r = pdev->strings[r].length;
+  } else {
+    langid = probe_langid(pdev);
+    if (langid < 0)
+      return langid;
+
+    r = libusb_get_string_descriptor(devh, desc_index, langid, tbuf,
+                                     sizeof(tbuf));
   }
-  langid = tbuf[2] | (tbuf[3] << 8);
-
-  r = libusb_get_string_descriptor(devh, desc_index, langid, tbuf,
-                                   sizeof(tbuf));
   if (r < 0) {
     warnx("Failed to retrieve string descriptor %d", desc_index);
     return r;
@@ -135,13 +208,13 @@ static int get_utf8_string_descriptor(libusb_device_handle *devh,
  * truncated descriptors (descriptor length mismatch) seen on
  * e.g. the STM32F427 ROM bootloader.
  */
-static int get_string_descriptor_ascii(libusb_device_handle *devh,
+static int get_string_descriptor_ascii(struct probe_device *pdev,
                                        uint8_t desc_index, unsigned char *data,
                                        int length) {
   unsigned char buf[255];
   int r, di, si;
 
-  r = get_utf8_string_descriptor(devh, desc_index, buf, sizeof(buf));
+  r = get_utf8_string_descriptor(pdev, desc_index, buf, sizeof(buf));
   if (r < 0)
     return r;
 
@@ -156,16 +229,61 @@ static int get_string_descriptor_ascii(libusb_device_handle *devh,
   return di;
 }
 
-static void probe_configuration(libusb_device *dev,
+/* Serial number string, read once per device */
+static const char *probe_serial(struct probe_device *pdev,
+                                struct libusb_device_descriptor *desc,
+                                uint16_t quirks) {
+  int ret = -1;
+
+  if (pdev->have_serial)
+    return pdev->serial_name;
+
+  if (desc->iSerialNumber != 0) {
+    if (quirks & QUIRK_UTF8_SERIAL) {
+      ret = get_utf8_string_descriptor(pdev, desc->iSerialNumber,
+                                       (void *)pdev->serial_name,
+                                       MAX_DESC_STR_LEN - 1);
+      if (ret >= 0)
+        pdev->serial_name[ret] = '\0';
+    } else {
+      ret = get_string_descriptor_ascii(pdev, desc->iSerialNumber,
+                                        (void *)pdev->serial_name,
+                                        MAX_DESC_STR_LEN);
+    }
+  }
+  if (ret < 1)
+    strcpy(pdev->serial_name, "UNKNOWN");
+  pdev->have_serial = 1;
+
+  return pdev->serial_name;
+}
+
+/* Whether the device can match the vendor, product and devnum filters,
+ * in run-time or DFU mode, so other devices need not be opened */
+static int probe_match_device(libusb_device *dev,
+                              struct libusb_device_descriptor *desc) {
+  if (match_devnum >= 0 && match_devnum != libusb_get_device_address(dev))
+    return 0;
+  if ((match_vendor < 0 || match_vendor == desc->idVendor) &&
+      (match_product < 0 || match_product == desc->idProduct))
+    return 1;
+  if ((match_vendor_dfu < 0 || match_vendor_dfu == desc->idVendor) &&
+      (match_product_dfu < 0 || match_product_dfu == desc->idProduct))
+    return 1;
+  return 0;
+}
+
+static void probe_configuration(struct probe_device *pdev,
                                 struct libusb_device_descriptor *desc) {
   struct usb_dfu_func_descriptor func_dfu;
-  libusb_device_handle *devh;
+  libusb_device *dev = pdev->dev;
+  const char *serial_name;
+  const char *cached_name;
   struct dfu_if *pdfu;
   struct libusb_config_descriptor *cfg;
   const struct libusb_interface_descriptor *intf;
   const struct libusb_interface *uif;
   char alt_name[MAX_DESC_STR_LEN + 1];
-  char serial_name[MAX_DESC_STR_LEN + 1];
   int cfg_idx;
   int intf_idx;
   int alt_idx;
@@ -223,10 +341,9 @@ static void probe_configuration(libusb_device *dev,
        * device directly This is not supported on
        * all devices for non-standard types
        */
-      if (libusb_open(dev, &devh) == 0) {
-        ret = libusb_get_descriptor(devh, USB_DT_DFU, 0, (void *)&func_dfu,
-                                    sizeof(func_dfu));
-        libusb_close(devh);
+      if (probe_open(pdev) == 0) {
+        ret = libusb_get_descriptor(pdev->devh, USB_DT_DFU, 0,
+                                    (void *)&func_dfu, sizeof(func_dfu));
         if (ret > -1)
           goto found_dfu;
       }
@@ -319,43 +436,16 @@ static void probe_configuration(libusb_device *dev,
         if (match_devnum >= 0 && match_devnum != libusb_get_device_address(dev))
           continue;
 
-        ret = libusb_open(dev, &devh);
+        ret = probe_open(pdev);
         if (ret) {
           warnx("Cannot open DFU device %04x:%04x found on devnum %i (%s)",
                 desc->idVendor, desc->idProduct, libusb_get_device_address(dev),
                 libusb_error_name(ret));
           break;
         }
-        if (intf->iInterface != 0)
-          ret = get_string_descriptor_ascii(devh, intf->iInterface,
-                                            (void *)alt_name, MAX_DESC_STR_LEN);
-        else
-          ret = -1;
-        if (ret < 1)
-          strcpy(alt_name, "UNKNOWN");
-        if (desc->iSerialNumber != 0) {
-          if (quirks & QUIRK_UTF8_SERIAL) {
-            ret = get_utf8_string_descriptor(devh, desc->iSerialNumber,
-                                             (void *)serial_name,
-                                             MAX_DESC_STR_LEN - 1);
-            if (ret >= 0)
-              serial_name[ret] = '\0';
-          } else {
-            ret = get_string_descriptor_ascii(devh, desc->iSerialNumber,
-                                              (void *)serial_name,
-                                              MAX_DESC_STR_LEN);
-          }
-        } else {
-          ret = -1;
-        }
-        if (ret < 1)
-          strcpy(serial_name, "UNKNOWN");
-        libusb_close(devh);
-
-        if (dfu_mode && match_iface_alt_name != NULL &&
-            strcmp(alt_name, match_iface_alt_name))
-          continue;
 
+        /* the serial number is shared by all interfaces, check it first */
+        serial_name = probe_serial(pdev, desc, quirks);
         if (dfu_mode) {
           if (match_serial_dfu != NULL && strcmp(match_serial_dfu, serial_name))
             continue;
@@ -364,6 +454,25 @@ static void probe_configuration(libusb_device *dev,
             continue;
         }
 
+        cached_name = dfu_cache_alt_name(
+            pdev->cache, intf->bInterfaceNumber, intf->bAlternateSetting);
+        if (cached_name) {
+          snprintf(alt_name, sizeof(alt_name), "%s", cached_name);
+        } else {
+          if (intf->iInterface != 0)
+            ret = get_string_descriptor_ascii(
+                pdev, intf->iInterface, (void *)alt_name, MAX_DESC_STR_LEN);
+          else
+            ret = -1;
+          if (ret < 1)
+            strcpy(alt_name, "UNKNOWN");
+          pdev->cache_miss = 1;
+        }
+
+        if (dfu_mode && match_iface_alt_name != NULL &&
+            strcmp(alt_name, match_iface_alt_name))
+          continue;
+
         pdfu = dfu_malloc(sizeof(*pdfu));
 
         memset(pdfu, 0, sizeof(*pdfu));
@@ -393,6 +502,7 @@ static void probe_configuration(libusb_device *dev,
           pdfu->func_dfu.bcdDFUVersion = libusb_cpu_to_le16(0x0110);
         }
         pdfu->bMaxPacketSize0 = desc->bMaxPacketSize0;
+        pdfu->desc_digest = pdev->digest;
 
         /* append to list */
         if (!dfu_root) {
@@ -432,22 +542,238 @@ char *get_path(libusb_device *dev) {
 #endif
 }
 
+static int probe_pending;
+
+static void LIBUSB_CALL probe_string_cb(struct libusb_transfer *transfer) {
+  struct probe_string *str = transfer->user_data;
+
+  if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
+    str->length = transfer->actual_length;
+    memcpy(str->data, libusb_control_transfer_get_data(transfer),
+           str->length);
+  } else if (transfer->status == LIBUSB_TRANSFER_STALL) {
+    str->length = LIBUSB_ERROR_PIPE;
+  } else if (transfer->status == LIBUSB_TRANSFER_TIMED_OUT) {
+    str->length = LIBUSB_ERROR_TIMEOUT;
+  } else if (transfer->status == LIBUSB_TRANSFER_NO_DEVICE) {
+    str->length = LIBUSB_ERROR_NO_DEVICE;
+  } else {
+    str->length = LIBUSB_ERROR_IO;
+  }
+  libusb_free_transfer(transfer);
+  probe_pending--;
+}
+
+/* Submit an asynchronous GET_DESCRIPTOR(STRING) request */
+static int probe_submit_string(struct probe_device *pdev,
+                               struct probe_string *str, uint16_t langid) {
+  struct libusb_transfer *transfer;
+  unsigned char *buf;
+
+  transfer = libusb_alloc_transfer(0);
+  buf = malloc(LIBUSB_CONTROL_SETUP_SIZE + sizeof(str->data));
+  if (!transfer || !buf) {
+    libusb_free_transfer(transfer);
+    free(buf);
+    return -1;
+  }
+  libusb_fill_control_setup(buf, LIBUSB_ENDPOINT_IN,
+                            LIBUSB_REQUEST_GET_DESCRIPTOR,
+                            (LIBUSB_DT_STRING << 8) | str->index, langid,
+                            sizeof(str->data));
+  libusb_fill_control_transfer(transfer, pdev->devh, buf, probe_string_cb,
+                               str, 1000);
+  transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+  if (libusb_submit_transfer(transfer) < 0) {
+    libusb_free_transfer(transfer);
+    return -1;
+  }
+  str->submitted = 1;
+  probe_pending++;
+  return 0;
+}
+
+static void probe_wait(libusb_context *ctx) {
+  while (probe_pending > 0) {
+    if (libusb_handle_events(ctx) < 0)
+      errx(EX_IOERR, "Failed to handle USB events during probe");
+  }
+}
+
+/* Queue a string index of the device for prefetching, once */
+static void probe_add_string(struct probe_device *pdev, uint8_t index) {
+  struct probe_string *str;
+  int i;
+
+  for (i = 0; i < pdev->num_strings; i++) {
+    if (pdev->strings[i].index == index)
+      return;
+  }
+  if (pdev->num_strings == PROBE_MAX_STRINGS)
+    return;
+  str = &pdev->strings[pdev->num_strings++];
+  str->index = index;
+  str->length = LIBUSB_ERROR_IO;
+}
+
+/* Queue the names of all DFU interfaces, returns how many there are */
+static int probe_add_interface_strings(struct probe_device *pdev) {
+  struct libusb_config_descriptor *cfg;
+  int cfg_idx, intf_idx, alt_idx;
+  int found = 0;
+
+  for (cfg_idx = 0; cfg_idx != pdev->desc.bNumConfigurations; cfg_idx++) {
+    if (libusb_get_config_descriptor(pdev->dev, cfg_idx, &cfg) != 0 || !cfg)
+      break;
+    for (intf_idx = 0; intf_idx < cfg->bNumInterfaces; intf_idx++) {
+      const struct libusb_interface *uif = &cfg->interface[intf_idx];
+
+      for (alt_idx = 0; alt_idx < uif->num_altsetting; alt_idx++) {
+        const struct libusb_interface_descriptor *intf =
+            &uif->altsetting[alt_idx];
+
+        if (intf->bInterfaceClass != 0xfe || intf->bInterfaceSubClass != 1)
+          continue;
+        found++;
+        if (intf->iInterface != 0)
+          probe_add_string(pdev, intf->iInterface);
+      }
+    }
+    libusb_free_config_descriptor(cfg);
+  }
+  return found;
+}
+
+/* Submit the not yet requested strings of a device */
+static void probe_submit_strings(struct probe_device *pdev) {
+  int i;
+
+  for (i = 0; i < pdev->num_strings; i++) {
+    if (pdev->strings[i].submitted)
+      continue;
+    if (probe_submit_string(pdev, &pdev->strings[i], pdev->langid) < 0)
+      break;
+  }
+}
+
+/*
+ * Read the string descriptors of all candidate devices with overlapping
+ * asynchronous control transfers, so that probing takes as long as the
+ * slowest device instead of the sum of all of them. The language IDs
+ * are read first, then the serial numbers, which every device is matched
+ * on. Interface names are only needed for devices that match, so they
+ * are read later and synchronously, unless the descriptor cache misses
+ * them and all names of the device are read here to fill it.
+ */
+static void probe_prefetch(libusb_context *ctx, struct probe_device *pdevs,
+                           int num) {
+  int i;
+
+  for (i = 0; i < num; i++) {
+    struct probe_device *pdev = &pdevs[i];
+
+    /* only devices with a DFU interface are opened at all */
+    if (probe_add_interface_strings(pdev) == 0)
+      continue;
+    if (pdev->desc.iSerialNumber != 0)
+      probe_add_string(pdev, pdev->desc.iSerialNumber);
+    pdev->langids.length = LIBUSB_ERROR_IO;
+    if (probe_open(pdev) == 0)
+      probe_submit_string(pdev, &pdev->langids, 0);
+  }
+  probe_wait(ctx);
+
+  for (i = 0; i < num; i++) {
+    struct probe_device *pdev = &pdevs[i];
+    const unsigned char *tbuf = pdev->langids.data;
+    int j;
+
+    if (pdev->langids.length < 4 || tbuf[0] < 4 ||
+        tbuf[1] != LIBUSB_DT_STRING) {
+      /* leave the error reporting to the synchronous path */
+      pdev->num_strings = 0;
+      continue;
+    }
+    pdev->langid = tbuf[2] | (tbuf[3] << 8);
+
+    for (j = 0; j < pdev->num_strings; j++) {
+      if (pdev->strings[j].index == pdev->desc.iSerialNumber)
+        probe_submit_string(pdev, &pdev->strings[j], pdev->langid);
+    }
+  }
+  probe_wait(ctx);
+
+  if (!dfu_cache_enabled)
+    return;
+
+  for (i = 0; i < num; i++) {
+    struct probe_device *pdev = &pdevs[i];
+    uint16_t quirks;
+
+    if (pdev->langid < 0)
+      continue;
+    quirks = get_quirks(pdev->desc.idVendor, pdev->desc.idProduct,
+                        pdev->desc.bcdDevice);
+    pdev->cache = dfu_cache_load(pdev->desc.idVendor, pdev->desc.idProduct,
+                                 pdev->desc.bcdDevice,
+                                 probe_serial(pdev, &pdev->desc, quirks),
+                                 pdev->digest);
+    if (!pdev->cache)
+      probe_submit_strings(pdev);
+  }
+  probe_wait(ctx);
+}
+
 void probe_devices(libusb_context *ctx) {
   libusb_device **list;
+  struct probe_device *pdevs;
   ssize_t num_devs;
   ssize_t i;
+  int num = 0;
 
   num_devs = libusb_get_device_list(ctx, &list);
+  if (num_devs < 0)
+    return;
+  pdevs = calloc(num_devs + 1, sizeof(*pdevs));
+  if (!pdevs)
+    errx(EX_SOFTWARE, "Out of memory");
+
   for (i = 0; i < num_devs; ++i) {
-    struct libusb_device_descriptor desc;
     struct libusb_device *dev = list[i];
+    struct probe_device *pdev = &pdevs[num];
 
     if (match_path != NULL && strcmp(get_path(dev), match_path) != 0)
       continue;
-    if (libusb_get_device_descriptor(dev, &desc))
+    if (libusb_get_device_descriptor(dev, &pdev->desc))
+      continue;
+    if (!probe_match_device(dev, &pdev->desc))
       continue;
-    probe_configuration(dev, &desc);
+
+    pdev->dev = dev;
+    pdev->langid = -1;
+    if (dfu_cache_enabled)
+      pdev->digest = dfu_cache_digest(dev, &pdev->desc);
+    num++;
+  }
+
+  probe_prefetch(ctx, pdevs, num);
+
+  /* build the list in device list order, whatever completed first */
+  for (i = 0; i < num; i++) {
+    probe_configuration(&pdevs[i], &pdevs[i].desc);
+    if (pdevs[i].cache_miss) {
+      struct dfu_if *pdfu;
+
+      for (pdfu = dfu_root; pdfu; pdfu = pdfu->next) {
+        if (pdfu->dev == pdevs[i].dev) {
+          dfu_cache_store(pdfu, 0, 0);
+          break;
+        }
+      }
+    }
+    probe_close(&pdevs[i]);
   }
+  free(pdevs);
   libusb_free_device_list(list, 1);
 }
 
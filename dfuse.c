@@ -32,6 +32,7 @@
 #include <string.h>
 
 #include "dfu.h"
+#include "dfu_cache.h"
 #include "dfu_file.h"
 #include "dfuse.h"
 #include "dfuse_mem.h"
@@ -41,6 +42,16 @@
 
 #define DFU_TIMEOUT 5000
 
+/* Page erase time estimate when neither configured nor measured */
+#define DFUSE_DEFAULT_ERASE_MS_PER_KB 10
+
+/* Read time estimate for the blank check when not yet measured */
+#define DFUSE_DEFAULT_READ_MS_PER_KB 1
+
+/* Vendor special command: CRC32 over <address> <length>, result is read
+ * with an upload of block 1. Advertised in the Get Command response. */
+#define DFUSE_CMD_CRC32 0xb1
+
 extern int verbose;
 static unsigned int last_erased_page = 1; /* non-aligned value, won't match */
 static unsigned int dfuse_address = 0;
@@ -51,12 +62,121 @@ static int dfuse_leave = 0;
 static int dfuse_unprotect = 0;
 static int dfuse_mass_erase = 0;
 static int dfuse_will_reset = 0;
+static int dfuse_auto_erase = 0;
+
+/* Read back and compare each element after writing it */
+int dfuse_verify = 0;
+static unsigned long long verify_ms = 0;
+static unsigned long long verify_bytes = 0;
+static int dfuse_crc_supported = -1; /* unknown until asked */
+
+/* Skip erasing pages that read back as blank */
+static int dfuse_blank_check = 0;
+static struct {
+  unsigned int read_ms_per_kb; /* measured readback time per KiB */
+  unsigned int checked;        /* pages checked */
+  unsigned int blank;          /* pages found blank, erase skipped */
+  unsigned int misses;         /* programmed pages found in a row */
+} blank_check;
+
+/* Progress of the current download, and where a resumed one continues */
+static struct dfu_journal dfuse_journal;
+static int dfuse_resuming = 0;
+
+/* Download transfer sizes into flash and other memory, 0 if not tuned */
+static unsigned int flash_xfer_size = 0;
+static unsigned int ram_xfer_size = 0;
+
+/* Address ranges that must survive an automatic mass erase */
+static struct dfuse_range *dfuse_keep = NULL;
+static int dfuse_num_keep = 0;
+
+/* Address ranges to upload in one session */
+static struct dfuse_range *upload_ranges = NULL;
+static int num_upload_ranges = 0;
+
+/* Erase timings, configured with dfuse options or measured on the device */
+static struct {
+  unsigned int page_ms;           /* configured time per ERASE_PAGE */
+  unsigned int mass_ms;           /* configured time for MASS_ERASE */
+  unsigned int learned_ms_per_kb; /* measured ERASE_PAGE time per KiB */
+  unsigned int learned_mass_ms;   /* measured MASS_ERASE time */
+} erase_timing;
+
+/* One contiguous piece of firmware destined for an alternate setting */
+struct dfuse_element {
+  struct dfu_if *dif; /* NULL if the device has no such alternate setting */
+  unsigned int address;
+  unsigned int size;
+  uint8_t *data;
+};
 
 static unsigned int quad2uint(unsigned char *p) {
   return (*p + (*(p + 1) << 8) + (*(p + 2) << 16) + (*(p + 3) << 24));
 }
 
-static void dfuse_parse_options(const char *options) {
+static unsigned int dfuse_parse_value(const char *str, const char *endword,
+                                      const char *options) {
+  char *end;
+  unsigned int number;
+
+  number = strtoul(str, &end, 0);
+  if (end == str || end != endword)
+    errx(EX_USAGE, "Invalid dfuse modifier: %s", options);
+  return number;
+}
+
+/* Parses [<alt>:]<address>+<length> ending at endword */
+static void dfuse_parse_range(const char *str, const char *endword,
+                              struct dfuse_range *range) {
+  const char *start = str;
+  char *end;
+
+  range->alt = -1;
+  range->address = strtoul(str, &end, 0);
+  if (end != str && *end == ':') {
+    range->alt = range->address;
+    str = end + 1;
+    range->address = strtoul(str, &end, 0);
+  }
+  if (end == str || *end != '+')
+    errx(EX_USAGE, "Invalid range: %s", start);
+  range->length = dfuse_parse_value(end + 1, endword, start);
+  if (!range->length)
+    errx(EX_USAGE, "Empty range: %s", start);
+  if (range->address + (range->length - 1) < range->address)
+    errx(EX_USAGE, "Range wraps around: %s", start);
+}
+
+static void dfuse_append_range(struct dfuse_range **list, int *count,
+                               const struct dfuse_range *range) {
+  *list = realloc(*list, (*count + 1) * sizeof(**list));
+  if (!*list)
+    errx(EX_SOFTWARE, "Out of memory");
+  (*list)[(*count)++] = *range;
+}
+
+/* keep=<address>+<length>[@<alt>], ':' separates the DfuSe modifiers */
+static void dfuse_parse_keep(const char *str, const char *endword) {
+  struct dfuse_range range;
+  const char *at = memchr(str, '@', endword - str);
+
+  dfuse_parse_range(str, at ? at : endword, &range);
+  if (at)
+    range.alt = dfuse_parse_value(at + 1, endword, str);
+  dfuse_append_range(&dfuse_keep, &dfuse_num_keep, &range);
+}
+
+void dfuse_add_upload_range(const char *spec) {
+  struct dfuse_range range;
+
+  dfuse_parse_range(spec, spec + strlen(spec), &range);
+  dfuse_append_range(&upload_ranges, &num_upload_ranges, &range);
+}
+
+int dfuse_num_upload_ranges(void) { return num_upload_ranges; }
+
+void dfuse_parse_options(const char *options) {
   char *end;
   const char *endword;
   unsigned int number;
@@ -86,6 +206,31 @@ static void dfuse_parse_options(const char *options) {
     if (!endword)
       endword = options + strlen(options);
 
+    if (!strncmp(options, "keep=", 5)) {
+      dfuse_parse_keep(options + 5, endword);
+      options = endword;
+      continue;
+    }
+    if (!strncmp(options, "erase-time=", 11)) {
+      erase_timing.page_ms = dfuse_parse_value(options + 11, endword, options);
+      options = endword;
+      continue;
+    }
+    if (!strncmp(options, "mass-erase-time=", 16)) {
+      erase_timing.mass_ms = dfuse_parse_value(options + 16, endword, options);
+      options = endword;
+      continue;
+    }
+    if (!strncmp(options, "flash-transfer-size=", 20)) {
+      flash_xfer_size = dfuse_parse_value(options + 20, endword, options);
+      options = endword;
+      continue;
+    }
+    if (!strncmp(options, "ram-transfer-size=", 18)) {
+      ram_xfer_size = dfuse_parse_value(options + 18, endword, options);
+      options = endword;
+      continue;
+    }
     if (!strncmp(options, "force", endword - options)) {
       dfuse_force++;
       options += 5;
@@ -111,6 +256,16 @@ static void dfuse_parse_options(const char *options) {
       options += 10;
       continue;
     }
+    if (!strncmp(options, "auto-erase", endword - options)) {
+      dfuse_auto_erase = 1;
+      options += 10;
+      continue;
+    }
+    if (!strncmp(options, "blank-check", endword - options)) {
+      dfuse_blank_check = 1;
+      options += 11;
+      continue;
+    }
 
     /* any valid number is interpreted as upload length */
     number = strtoul(options, &end, 0);
@@ -169,13 +324,34 @@ static int dfuse_download(struct dfu_if *dif, const unsigned short length,
   return status;
 }
 
+/* Keep a running average of measured erase times for the cost model */
+static void dfuse_learn_erase_time(enum dfuse_command command, int page_size,
+                                   unsigned long long elapsed) {
+  unsigned int sample;
+
+  if (command == MASS_ERASE) {
+    sample = (unsigned int)elapsed;
+    if (erase_timing.learned_mass_ms)
+      sample = (3 * erase_timing.learned_mass_ms + sample) / 4;
+    erase_timing.learned_mass_ms = sample ? sample : 1;
+  } else if (page_size > 0) {
+    sample = (unsigned int)(elapsed * 1024 / page_size);
+    if (erase_timing.learned_ms_per_kb)
+      sample = (3 * erase_timing.learned_ms_per_kb + sample) / 4;
+    erase_timing.learned_ms_per_kb = sample ? sample : 1;
+  }
+}
+
 /* DfuSe only commands */
 /* Leaves the device in dfuDNLOAD-IDLE state */
-static int dfuse_special_command(struct dfu_if *dif, unsigned int address,
-                                 enum dfuse_command command) {
+/* size is only used by commands operating on a range */
+/* USB errors exit unless fatal is 0, then they are returned */
+static int dfuse_try_special_command(struct dfu_if *dif, unsigned int address,
+                                     unsigned int size,
+                                     enum dfuse_command command, int fatal) {
   const char *dfuse_command_name[] = {"SET_ADDRESS", "ERASE_PAGE", "MASS_ERASE",
-                                      "READ_UNPROTECT"};
-  unsigned char buf[5];
+                                      "READ_UNPROTECT", "CRC32"};
+  unsigned char buf[9];
   int length = 0;
   int ret;
   struct dfu_status dst;
@@ -191,10 +367,12 @@ static int dfuse_special_command(struct dfu_if *dif, unsigned int address,
   unsigned int poll_timeout = 0;
   unsigned int n_timeouts = 0;
 
+  unsigned long long start_time = dfu_get_time_ms();
+  int page_size = 0;
+
   switch (command) {
   case ERASE_PAGE: {
     struct memsegment *segment;
-    int page_size;
 
     segment = find_segment(dif->mem_layout, address);
     if (!segment || !(segment->memtype & DFUSE_ERASABLE)) {
@@ -224,6 +402,17 @@ static int dfuse_special_command(struct dfu_if *dif, unsigned int address,
     buf[0] = 0x92;
     length = 1;
   } break;
+  case CRC32: {
+    if (verbose > 1)
+      fprintf(stderr, "  Computing CRC32 of 0x%08x-0x%08x\n", address,
+              address + size - 1);
+    buf[0] = DFUSE_CMD_CRC32; /* vendor extension */
+    buf[5] = size & 0xff;
+    buf[6] = (size >> 8) & 0xff;
+    buf[7] = (size >> 16) & 0xff;
+    buf[8] = (size >> 24) & 0xff;
+    length = 9;
+  } break;
   default:
     errx(EX_SOFTWARE, "Non-supported special command %d", command);
     break;
@@ -236,8 +425,11 @@ static int dfuse_special_command(struct dfu_if *dif, unsigned int address,
 
   ret = dfuse_download(dif, length, buf, 0);
   if (ret < 0) {
-    errx(EX_IOERR, "Error during special command \"%s\" download: %d (%s)",
-         dfuse_command_name[command], ret, libusb_error_name(ret));
+    warnx("Error during special command \"%s\" download: %d (%s)",
+          dfuse_command_name[command], ret, libusb_error_name(ret));
+    if (fatal)
+      exit(EX_IOERR);
+    return ret;
   }
 
   do {
@@ -270,8 +462,11 @@ static int dfuse_special_command(struct dfu_if *dif, unsigned int address,
         fprintf(stderr,
                 "* Device stalled USB pipe, reusing last poll timeout\n");
     } else if (ret < 0) {
-      errx(EX_IOERR, "Error during special command \"%s\" get_status: %d (%s)",
-           dfuse_command_name[command], ret, libusb_error_name(ret));
+      warnx("Error during special command \"%s\" get_status: %d (%s)",
+            dfuse_command_name[command], ret, libusb_error_name(ret));
+      if (fatal)
+        exit(EX_IOERR);
+      return ret;
     } else {
       poll_timeout = dst.bwPollTimeout;
     }
@@ -326,9 +521,24 @@ static int dfuse_special_command(struct dfu_if *dif, unsigned int address,
     }
   }
 
+  if (command == ERASE_PAGE || command == MASS_ERASE)
+    dfuse_learn_erase_time(command, page_size,
+                           dfu_get_time_ms() - start_time);
+
   return ret;
 }
 
+static int dfuse_special_command_range(struct dfu_if *dif, unsigned int address,
+                                       unsigned int size,
+                                       enum dfuse_command command) {
+  return dfuse_try_special_command(dif, address, size, command, 1);
+}
+
+static int dfuse_special_command(struct dfu_if *dif, unsigned int address,
+                                 enum dfuse_command command) {
+  return dfuse_special_command_range(dif, address, 0, command);
+}
+
 /* returns number of bytes sent */
 static int dfuse_dnload_chunk(struct dfu_if *dif, unsigned char *data, int size,
                               int transaction) {
@@ -338,8 +548,7 @@ static int dfuse_dnload_chunk(struct dfu_if *dif, unsigned char *data, int size,
 
   ret = dfuse_download(dif, size, size ? data : NULL, transaction);
   if (ret < 0) {
-    errx(EX_IOERR, "Error during download: %d (%s)", ret,
-         libusb_error_name(ret));
+    warnx("Error during download: %d (%s)", ret, libusb_error_name(ret));
     return ret;
   }
   bytes_sent = ret;
@@ -347,8 +556,8 @@ static int dfuse_dnload_chunk(struct dfu_if *dif, unsigned char *data, int size,
   do {
     ret = dfu_get_status(dif, &dst);
     if (ret < 0) {
-      errx(EX_IOERR, "Error during download get_status: %d (%s)", ret,
-           libusb_error_name(ret));
+      warnx("Error during download get_status: %d (%s)", ret,
+            libusb_error_name(ret));
       return ret;
     }
     milli_sleep(dst.bwPollTimeout);
@@ -365,11 +574,24 @@ static int dfuse_dnload_chunk(struct dfu_if *dif, unsigned char *data, int size,
     fprintf(stderr, "DFU state(%u) = %s, status(%u) = %s\n", dst.bState,
             dfu_state_to_string(dst.bState), dst.bStatus,
             dfu_status_to_string(dst.bStatus));
-    return -1;
+    return -EINVAL;
   }
   return bytes_sent;
 }
 
+/* Get back to dfuIDLE after a failed chunk, so it can be sent again */
+static void dfuse_recover(struct dfu_if *dif, int attempt) {
+  struct dfu_status dst;
+
+  milli_sleep(DFU_RETRY_DELAY << attempt);
+  if (dfu_get_status(dif, &dst) < 0)
+    return;
+  if (dst.bState == DFU_STATE_dfuERROR || dst.bStatus != DFU_STATUS_OK)
+    dfu_clear_status(dif->dev_handle, dif->interface);
+  else if (dst.bState != DFU_STATE_dfuIDLE)
+    dfu_abort(dif->dev_handle, dif->interface);
+}
+
 static void dfuse_do_leave(struct dfu_if *dif) {
   if (dfuse_address_present)
     dfuse_special_command(dif, dfuse_address, SET_ADDRESS);
@@ -381,22 +603,124 @@ static void dfuse_do_leave(struct dfu_if *dif) {
     /* Or it might leave after this request, with or without a response */
     dfu_get_status(dif, &dst);
   } else {
-    dfuse_dnload_chunk(dif, NULL, 0, 2);
+    /* a USB error is fatal, an error status was already reported */
+    int ret = dfuse_dnload_chunk(dif, NULL, 0, 2);
+
+    if (ret < 0 && ret != -EINVAL)
+      exit(EX_IOERR);
   }
 }
 
-int dfuse_do_upload(struct dfu_if *dif, int xfer_size, int fd,
-                    const char *dfuse_options) {
-  int total_bytes = 0;
-  int upload_limit = 0;
+/* Parse the memory layouts of all alternate settings in the list,
+ * or take them and the learned erase timings from the cache */
+static void dfuse_parse_layouts(struct dfu_if *dif) {
+  struct dfu_cache *cache;
+  struct dfu_if *adif;
+  const char *name;
+
+  cache = dfu_cache_load_dfu_if(dif);
+  if (cache) {
+    if (!erase_timing.learned_ms_per_kb)
+      erase_timing.learned_ms_per_kb = cache->erase_ms_per_kb;
+    if (!erase_timing.learned_mass_ms)
+      erase_timing.learned_mass_ms = cache->mass_erase_ms;
+  }
+
+  for (adif = dif; adif; adif = adif->next) {
+    name = dfu_cache_alt_name(cache, adif->interface, adif->altsetting);
+    if (name && !strcmp(name, adif->alt_name)) {
+      adif->mem_layout =
+          dfu_cache_layout(cache, adif->interface, adif->altsetting);
+      if (adif->mem_layout)
+        continue;
+    }
+    adif->mem_layout = parse_memory_layout((char *)adif->alt_name);
+    if (!adif->mem_layout)
+      errx(EX_IOERR, "Failed to parse memory layout for alternate interface %i",
+           adif->altsetting);
+    if (adif->quirks & QUIRK_DFUSE_LAYOUT)
+      fixup_dfuse_layout(adif, &(adif->mem_layout));
+  }
+  dfu_cache_free(cache);
+}
+
+static void dfuse_free_layouts(struct dfu_if *dif) {
+  struct dfu_if *adif;
+
+  dfu_cache_store(dif, erase_timing.learned_ms_per_kb,
+                  erase_timing.learned_mass_ms);
+  for (adif = dif; adif; adif = adif->next) {
+    free_segment_list(adif->mem_layout);
+    adif->mem_layout = NULL;
+  }
+}
+
+/* Block numbers are 16 bits wide, long reads continue from a new address */
+static void dfuse_next_upload_block(struct dfu_if *dif, unsigned int address,
+                                    int *transaction) {
+  if (*transaction <= 0xffff)
+    return;
+  dfu_abort_to_idle(dif);
+  dfuse_special_command(dif, address, SET_ADDRESS);
+  dfu_abort_to_idle(dif);
+  *transaction = 2;
+}
+
+/* Uploads up to upload_limit bytes from address into fd */
+/* returns 0 with the number of bytes in *received, or < 0 on error */
+static int dfuse_upload_to_file(struct dfu_if *dif, int xfer_size,
+                                unsigned int address,
+                                unsigned long long upload_limit, int fd,
+                                uint32_t *crc, unsigned long long *received) {
+  unsigned long long total_bytes = 0;
   unsigned char *buf;
   int transaction;
   int ret;
 
   buf = dfu_malloc(xfer_size);
 
-  if (dfuse_options)
-    dfuse_parse_options(dfuse_options);
+  dfu_progress_bar("Upload", 0, 1);
+
+  transaction = 2;
+  while (1) {
+    int rc;
+
+    /* last chunk can be smaller than original xfer_size */
+    if (upload_limit - total_bytes < (unsigned int)xfer_size)
+      xfer_size = (int)(upload_limit - total_bytes);
+    dfuse_next_upload_block(dif, address + total_bytes, &transaction);
+    rc = dfuse_upload(dif, xfer_size, buf, transaction++);
+    if (rc < 0) {
+      ret = rc;
+      goto out_free;
+    }
+
+    *crc = dfu_file_write_crc(fd, *crc, buf, rc);
+    total_bytes += rc;
+
+    if (rc < xfer_size || total_bytes >= upload_limit) {
+      /* last block, return successfully */
+      ret = 0;
+      break;
+    }
+    dfu_progress_bar("Upload", total_bytes, upload_limit);
+  }
+
+  dfu_progress_bar("Upload", total_bytes, total_bytes);
+
+out_free:
+  free(buf);
+  *received = total_bytes;
+
+  return ret;
+}
+
+int dfuse_do_upload(struct dfu_if *dif, int xfer_size, int fd) {
+  unsigned long long upload_limit = 0;
+  unsigned long long received;
+  uint32_t crc = 0;
+  int ret;
+
   if (dfuse_length)
     upload_limit = dfuse_length;
   if (dfuse_address_present) {
@@ -414,14 +738,14 @@ int dfuse_do_upload(struct dfu_if *dif, int xfer_size, int fd,
 
     if (!upload_limit) {
       if (segment) {
-        upload_limit = segment->end - dfuse_address + 1;
+        upload_limit = segment->end - dfuse_address + 1ULL;
         printf("Limiting upload to end of memory segment, "
-               "%i bytes\n",
+               "%llu bytes\n",
                upload_limit);
       } else {
         /* unknown segment - i.e. "force" has been used */
         upload_limit = 0x4000;
-        printf("Limiting upload to %i bytes\n", upload_limit);
+        printf("Limiting upload to %llu bytes\n", upload_limit);
       }
     }
     dfuse_special_command(dif, dfuse_address, SET_ADDRESS);
@@ -433,192 +757,1296 @@ int dfuse_do_upload(struct dfu_if *dif, int xfer_size, int fd,
       warnx("Unbound upload not supported on DfuSe devices");
       upload_limit = 0x4000;
     }
-    printf("Limiting default upload to %i bytes\n", upload_limit);
+    printf("Limiting default upload to %llu bytes\n", upload_limit);
+    if (upload_limit > 0xfffeULL * xfer_size)
+      errx(EX_USAGE, "Upload of more than %llu bytes needs an address",
+           0xfffeULL * xfer_size);
   }
 
-  dfu_progress_bar("Upload", 0, 1);
-
-  transaction = 2;
-  while (1) {
-    int rc;
+  ret = dfuse_upload_to_file(dif, xfer_size, dfuse_address, upload_limit, fd,
+                             &crc, &received);
+  if (ret < 0)
+    return ret;
 
-    /* last chunk can be smaller than original xfer_size */
-    if (upload_limit - total_bytes < xfer_size)
-      xfer_size = upload_limit - total_bytes;
-    rc = dfuse_upload(dif, xfer_size, buf, transaction++);
-    if (rc < 0) {
-      ret = rc;
-      goto out_free;
-    }
+  dfu_abort_to_idle(dif);
 
-    dfu_file_write_crc(fd, 0, buf, rc);
-    total_bytes += rc;
+  return 0;
+}
 
-    if (total_bytes < 0)
-      errx(EX_SOFTWARE, "Received too many bytes");
+/* Switches to another alternate setting of the same interface */
+static void dfuse_set_alt(struct dfu_if *dif, struct dfu_if *adif) {
+  int ret;
 
-    if (rc < xfer_size || total_bytes >= upload_limit) {
-      /* last block, return successfully */
-      ret = 0;
-      break;
-    }
-    dfu_progress_bar("Upload", total_bytes, upload_limit);
+  adif->dev_handle = dif->dev_handle;
+  printf("Setting Alternate Interface #%d ...\n", adif->altsetting);
+  ret = libusb_set_interface_alt_setting(adif->dev_handle, adif->interface,
+                                         adif->altsetting);
+  if (ret < 0) {
+    errx(EX_IOERR, "Cannot set alternate interface: %s",
+         libusb_error_name(ret));
   }
+}
 
-  dfu_progress_bar("Upload", total_bytes, total_bytes);
-
-  dfu_abort_to_idle(dif);
-  if (dfuse_leave)
-    dfuse_do_leave(dif);
+static void dfuse_put_quad(uint8_t *p, unsigned int value) {
+  p[0] = value & 0xff;
+  p[1] = (value >> 8) & 0xff;
+  p[2] = (value >> 16) & 0xff;
+  p[3] = (value >> 24) & 0xff;
+}
 
-out_free:
-  free(buf);
+static int dfuse_has_dfu_extension(const char *name) {
+  size_t len = strlen(name);
 
-  return ret;
+  return len > 4 && (!strcmp(name + len - 4, ".dfu") ||
+                     !strcmp(name + len - 4, ".DFU"));
 }
 
-/* Writes an element of any size to the device, taking care of page erases */
-/* returns 0 on success, otherwise -EINVAL */
-static int dfuse_dnload_element(struct dfu_if *dif,
-                                unsigned int dwElementAddress,
-                                unsigned int dwElementSize, unsigned char *data,
-                                int xfer_size) {
-  int p;
-  int ret;
-  struct memsegment *segment;
-
-  /* Check at least that we can write to the last address */
-  segment = find_segment(dif->mem_layout, dwElementAddress + dwElementSize - 1);
-  if (!dfuse_force && (!segment || !(segment->memtype & DFUSE_WRITEABLE))) {
-    errx(EX_USAGE, "Last page at 0x%08x is not writeable",
-         dwElementAddress + dwElementSize - 1);
+/* Writes a DfuSe target prefix, named after the alternate setting */
+static uint32_t dfuse_write_target_prefix(int fd, uint32_t crc,
+                                          struct dfu_if *adif,
+                                          unsigned int target_size,
+                                          unsigned int num_elements) {
+  uint8_t targetprefix[274];
+  const char *name = adif->alt_name;
+  size_t len;
+
+  memset(targetprefix, 0, sizeof(targetprefix));
+  memcpy(targetprefix, "Target", 6);
+  targetprefix[6] = adif->altsetting;
+
+  /* DfuSe interface name between '@' and the first '/' */
+  if (name[0] == '@')
+    name++;
+  len = strcspn(name, "/");
+  while (len && name[len - 1] == ' ')
+    len--;
+  if (len > 254)
+    len = 254;
+  if (len) {
+    targetprefix[7] = 1;
+    memcpy(targetprefix + 11, name, len);
   }
+  dfuse_put_quad(targetprefix + 266, target_size);
+  dfuse_put_quad(targetprefix + 270, num_elements);
 
-  if (!verbose)
-    dfu_progress_bar("Erase   ", 0, 1);
-
-  /* First pass: Erase involved pages if needed */
-  for (p = 0; p < (int)dwElementSize; p += xfer_size) {
-    int page_size;
-    unsigned int erase_address;
-    unsigned int address = dwElementAddress + p;
-    int chunk_size = xfer_size;
+  return dfu_file_write_crc(fd, crc, targetprefix, sizeof(targetprefix));
+}
 
-    segment = find_segment(dif->mem_layout, address);
-    if (!dfuse_force && (!segment || !(segment->memtype & DFUSE_WRITEABLE))) {
-      errx(EX_USAGE, "Page at 0x%08x is not writeable", address);
+/* Upload the list of address ranges, possibly from different alternate
+ * settings, in one session. The result is written as a DfuSe file with
+ * one element per range, or as a sparse binary file where each range
+ * lands at its offset from the lowest address. A DfuSe file is always
+ * used when more than one alternate setting is involved.
+ * The memory layouts must have been parsed */
+static int dfuse_upload_range_list(struct dfu_if *dif, int xfer_size, int fd,
+                                   int container) {
+  struct dfu_if **range_dif;
+  struct dfu_if *current = dif;
+  int *order;
+  int num_targets = 0;
+  unsigned int base = 0xffffffff;
+  uint32_t crc = 0xffffffff;
+  int i, j, n;
+  int ret = 0;
+
+  range_dif = dfu_malloc(num_upload_ranges * sizeof(*range_dif));
+  order = dfu_malloc(num_upload_ranges * sizeof(*order));
+
+  for (i = 0; i < num_upload_ranges; i++) {
+    struct dfuse_range *range = &upload_ranges[i];
+    struct memsegment *first, *last;
+    struct dfu_if *adif = dif;
+
+    if (range->alt >= 0) {
+      while (adif && adif->altsetting != range->alt)
+        adif = adif->next;
+      if (!adif)
+        errx(EX_USAGE, "No alternate setting %d for upload range",
+             range->alt);
     }
-    /* If the location is not in the memory map we skip erasing */
-    /* since we wouldn't know the correct page size for flash erase */
-    if (!segment)
+    range_dif[i] = adif;
+
+    first = find_segment(adif->mem_layout, range->address);
+    last = find_segment(adif->mem_layout,
+                        range->address + range->length - 1);
+    if (!dfuse_force && (!first || !(first->memtype & DFUSE_READABLE) ||
+                         !last || !(last->memtype & DFUSE_READABLE)))
+      errx(EX_USAGE, "Range at 0x%08x is not readable", range->address);
+
+    if (range->address < base)
+      base = range->address;
+  }
+
+  /* group ranges by alternate setting, in order of first appearance */
+  for (i = 0, n = 0; i < num_upload_ranges; i++) {
+    for (j = 0; j < i; j++)
+      if (range_dif[j] == range_dif[i])
+        break;
+    if (j < i)
       continue;
+    num_targets++;
+    for (j = i; j < num_upload_ranges; j++)
+      if (range_dif[j] == range_dif[i])
+        order[n++] = j;
+  }
 
-    page_size = segment->pagesize;
+  if (num_targets > 1)
+    container = 1;
+  if (container) {
+    uint8_t dfuprefix[11];
+    unsigned long long image_size = sizeof(dfuprefix);
+
+    printf("Writing %i ranges as DfuSe file with %i images\n",
+           num_upload_ranges, num_targets);
+    for (i = 0; i < num_upload_ranges; i++)
+      image_size += 8 + upload_ranges[i].length;
+    image_size += num_targets * 274;
+    /* the sizes in a DfuSe file are 32 bits wide */
+    if (image_size > 0xffffffff)
+      errx(EX_USAGE, "Ranges too large for a DfuSe file, "
+                     "use a file name without .dfu");
+
+    memcpy(dfuprefix, "DfuSe", 5);
+    dfuprefix[5] = 0x01;
+    dfuse_put_quad(dfuprefix + 6, image_size);
+    dfuprefix[10] = num_targets;
+    crc = dfu_file_write_crc(fd, crc, dfuprefix, sizeof(dfuprefix));
+  } else {
+    printf("Writing %i ranges as sparse file from 0x%08x\n",
+           num_upload_ranges, base);
+  }
 
-    /* check if this is the last chunk */
-    if (p + chunk_size > (int)dwElementSize)
-      chunk_size = dwElementSize - p;
+  for (n = 0; n < num_upload_ranges; n++) {
+    struct dfuse_range *range = &upload_ranges[order[n]];
+    struct dfu_if *adif = range_dif[order[n]];
+    unsigned long long received;
 
-    /* Erase only for flash memory downloads */
-    if ((segment->memtype & DFUSE_ERASABLE) && !dfuse_mass_erase) {
-      /* erase all involved pages */
-      for (erase_address = address; erase_address < address + chunk_size;
-           erase_address += page_size)
-        if ((erase_address & ~(page_size - 1)) != last_erased_page)
-          dfuse_special_command(dif, erase_address, ERASE_PAGE);
+    if (container && (n == 0 || range_dif[order[n - 1]] != adif)) {
+      unsigned int target_size = 0;
+      int num_elements = 0;
 
-      if (((address + chunk_size - 1) & ~(page_size - 1)) != last_erased_page) {
-        if (verbose > 1)
-          fprintf(stderr, " Chunk extends into next page,"
-                          " erase it as well\n");
-        dfuse_special_command(dif, address + chunk_size - 1, ERASE_PAGE);
+      for (j = n; j < num_upload_ranges && range_dif[order[j]] == adif; j++) {
+        target_size += 8 + upload_ranges[order[j]].length;
+        num_elements++;
       }
-      if (!verbose)
-        dfu_progress_bar("Erase   ", p, dwElementSize);
+      crc = dfuse_write_target_prefix(fd, crc, adif, target_size,
+                                      num_elements);
     }
-  }
-  if (!verbose)
-    dfu_progress_bar("Erase   ", dwElementSize, dwElementSize);
-  if (!verbose)
-    dfu_progress_bar("Download", 0, 1);
 
-  /* Second pass: Write data to (erased) pages */
-  for (p = 0; p < (int)dwElementSize; p += xfer_size) {
-    unsigned int address = dwElementAddress + p;
-    int chunk_size = xfer_size;
+    if (adif != current) {
+      dfuse_set_alt(dif, adif);
+      current = adif;
+    }
 
-    /* check if this is the last chunk */
-    if (p + chunk_size > (int)dwElementSize)
-      chunk_size = dwElementSize - p;
+    if (container) {
+      uint8_t elementheader[8];
 
-    if (verbose) {
-      fprintf(stderr,
-              " Download from image offset "
-              "%08x to memory %08x-%08x, size %i\n",
-              p, address, address + chunk_size - 1, chunk_size);
+      dfuse_put_quad(elementheader, range->address);
+      dfuse_put_quad(elementheader + 4, range->length);
+      crc = dfu_file_write_crc(fd, crc, elementheader, sizeof(elementheader));
     } else {
-      dfu_progress_bar("Download", p, dwElementSize);
+      dfu_file_sparse_flush(fd);
+      if (lseek(fd, range->address - base, SEEK_SET) < 0)
+        err(EX_IOERR, "Could not seek in output file");
     }
 
-    dfuse_special_command(dif, address, SET_ADDRESS);
+    printf("Uploading range 0x%08x-0x%08x from alternate setting %i\n",
+           range->address, range->address + range->length - 1,
+           adif->altsetting);
+    dfuse_special_command(adif, range->address, SET_ADDRESS);
+    dfu_abort_to_idle(adif);
 
-    /* transaction = 2 for no address offset */
-    ret = dfuse_dnload_chunk(dif, data + p, chunk_size, 2);
-    if (ret != chunk_size) {
-      errx(EX_IOERR,
-           "Failed to write whole chunk: "
-           "%i of %i bytes",
-           ret, chunk_size);
-      return -EINVAL;
-    }
+    ret = dfuse_upload_to_file(adif, xfer_size, range->address, range->length,
+                               fd, &crc, &received);
+    if (ret < 0)
+      goto out_free;
+    if (received != range->length)
+      errx(EX_IOERR, "Short upload of range at 0x%08x: %llu of %u bytes",
+           range->address, received, range->length);
+    dfu_abort_to_idle(adif);
   }
-  if (!verbose)
-    dfu_progress_bar("Download", dwElementSize, dwElementSize);
-  return 0;
-}
 
-static void dfuse_memcpy(unsigned char *dst, unsigned char **src, int *rem,
-                         int size) {
-  if (size > *rem) {
-    errx(EX_NOINPUT,
-         "Corrupt DfuSe file: "
-         "Cannot read %d bytes from %d bytes",
-         size, *rem);
+  if (container) {
+    struct dfu_file suffix;
+
+    memset(&suffix, 0, sizeof(suffix));
+    suffix.bcdDevice = 0xffff;
+    suffix.idProduct = dif->product;
+    suffix.idVendor = dif->vendor;
+    suffix.bcdDFU = 0x011a;
+    dfu_file_write_suffix(fd, crc, &suffix);
   }
-  if (dst != NULL)
-    memcpy(dst, *src, size);
-  (*src) += size;
-  (*rem) -= size;
-}
 
-/* Download raw binary file to DfuSe device */
-static int dfuse_do_bin_dnload(struct dfu_if *dif, int xfer_size,
-                               struct dfu_file *file,
-                               unsigned int start_address) {
-  unsigned int dwElementAddress;
-  unsigned int dwElementSize;
-  unsigned char *data;
-  int ret;
+  if (current != dif) {
+    ret = libusb_set_interface_alt_setting(dif->dev_handle, dif->interface,
+                                           dif->altsetting);
+    if (ret < 0) {
+      errx(EX_IOERR, "Cannot set alternate interface: %s",
+           libusb_error_name(ret));
+    }
+  }
+  ret = 0;
 
-  dwElementAddress = start_address;
-  dwElementSize = file->size.total - file->size.suffix - file->size.prefix;
+out_free:
+  free(range_dif);
+  free(order);
 
-  printf("Downloading element to address = 0x%08x, size = %i\n",
-         dwElementAddress, dwElementSize);
+  return ret;
+}
 
-  data = file->firmware + file->size.prefix;
+int dfuse_do_upload_ranges(struct dfu_if *dif, int xfer_size, int fd,
+                           const char *file_name) {
+  int ret;
 
-  ret = dfuse_dnload_element(dif, dwElementAddress, dwElementSize, data,
-                             xfer_size);
-  if (ret == 0)
-    printf("File downloaded successfully\n");
+  if (dfuse_address_present)
+    errx(EX_USAGE, "Upload ranges can not be combined with a DfuSe address");
+
+  dfuse_parse_layouts(dif);
+  ret = dfuse_upload_range_list(dif, xfer_size, fd,
+                                dfuse_has_dfu_extension(file_name));
+  dfuse_free_layouts(dif);
 
   return ret;
 }
 
-/* Parse a DfuSe file and download contents to device */
-static int dfuse_do_dfuse_dnload(struct dfu_if *dif, int xfer_size,
-                                 struct dfu_file *file) {
+static int dfuse_compare_ranges(const void *a, const void *b) {
+  const struct dfuse_range *ra = a;
+  const struct dfuse_range *rb = b;
+
+  if (ra->address != rb->address)
+    return ra->address < rb->address ? -1 : 1;
+  return ra->alt - rb->alt;
+}
+
+/* Upload all readable segments of all alternate settings into a DfuSe file */
+int dfuse_do_dump_all(struct dfu_if *dif, int xfer_size, int fd) {
+  struct dfu_if *adif;
+  int ret;
+
+  if (dfuse_address_present || num_upload_ranges)
+    errx(EX_USAGE, "Full dump can not be combined with an address or ranges");
+
+  dfuse_parse_layouts(dif);
+
+  for (adif = dif; adif; adif = adif->next) {
+    struct memsegment *segment;
+    struct dfuse_range range;
+    int open_range = 0;
+
+    for (segment = adif->mem_layout; segment; segment = segment->next) {
+      if (!(segment->memtype & DFUSE_READABLE))
+        continue;
+      /* coalesce adjacent segments into one element */
+      if (open_range && segment->start == range.address + range.length) {
+        range.length += segment->end - segment->start + 1;
+        continue;
+      }
+      if (open_range)
+        dfuse_append_range(&upload_ranges, &num_upload_ranges, &range);
+      range.alt = adif->altsetting;
+      range.address = segment->start;
+      range.length = segment->end - segment->start + 1;
+      open_range = 1;
+    }
+    if (open_range)
+      dfuse_append_range(&upload_ranges, &num_upload_ranges, &range);
+  }
+  if (!num_upload_ranges)
+    errx(EX_USAGE, "No readable memory segments found");
+
+  qsort(upload_ranges, num_upload_ranges, sizeof(*upload_ranges),
+        dfuse_compare_ranges);
+
+  ret = dfuse_upload_range_list(dif, xfer_size, fd, 1);
+  dfuse_free_layouts(dif);
+
+  return ret;
+}
+
+/* Asks the device with Get Command whether it implements the CRC32 command */
+static int dfuse_has_crc_command(struct dfu_if *dif) {
+  unsigned char commands[32];
+  int ret;
+  int i;
+
+  if (dfuse_crc_supported >= 0)
+    return dfuse_crc_supported;
+
+  dfuse_crc_supported = 0;
+  dfu_abort_to_idle(dif);
+  ret = dfuse_upload(dif, sizeof(commands), commands, 0);
+  if (ret < 0)
+    dfu_clear_status(dif->dev_handle, dif->interface);
+  /* first byte is the Get Command command itself */
+  for (i = 1; i < ret; i++)
+    if (commands[i] == DFUSE_CMD_CRC32)
+      dfuse_crc_supported = 1;
+  dfu_abort_to_idle(dif);
+
+  if (verbose)
+    printf("Device %s CRC32 command\n",
+           dfuse_crc_supported ? "supports" : "does not support");
+
+  return dfuse_crc_supported;
+}
+
+static unsigned int dfuse_page_erase_ms(int page_size) {
+  unsigned int kb = page_size >= 1024 ? page_size / 1024 : 1;
+
+  if (erase_timing.page_ms)
+    return erase_timing.page_ms;
+  if (erase_timing.learned_ms_per_kb)
+    return kb * erase_timing.learned_ms_per_kb;
+  return kb * DFUSE_DEFAULT_ERASE_MS_PER_KB;
+}
+
+/* Estimated cost of a blank check, compared against an erase */
+static unsigned int dfuse_blank_check_ms(struct dfu_if *dif, int page_size) {
+  unsigned int kb = page_size >= 1024 ? page_size / 1024 : 1;
+
+  /* the CRC is computed on the device, only four bytes are read */
+  if (dfuse_has_crc_command(dif))
+    return 0;
+  if (blank_check.read_ms_per_kb)
+    return kb * blank_check.read_ms_per_kb;
+  return kb * DFUSE_DEFAULT_READ_MS_PER_KB;
+}
+
+/* Checks a page only while that looks cheaper than erasing it */
+static int dfuse_blank_check_worth(struct dfu_if *dif,
+                                   struct memsegment *segment) {
+  if (!dfuse_blank_check)
+    return 0;
+  /* after a few used pages in a row the flash is probably not fresh */
+  if (blank_check.misses >= 4 && !blank_check.blank)
+    return 0;
+  if (!dfuse_has_crc_command(dif) && !(segment->memtype & DFUSE_READABLE))
+    return 0;
+  return dfuse_blank_check_ms(dif, segment->pagesize) <
+         dfuse_page_erase_ms(segment->pagesize);
+}
+
+/* Compares the device CRC32 of a page with that of an erased page. A
+ * programmed page with the same CRC32 would be left unerased, a chance
+ * of one in 2^32 that the help of blank-check points out. */
+static int dfuse_crc_page_is_blank(struct dfu_if *dif, unsigned int page,
+                                   int page_size) {
+  static uint32_t blank_crc;
+  static int blank_crc_size = 0;
+  unsigned char result[4];
+  int ret;
+
+  if (blank_crc_size != page_size) {
+    unsigned char *ones = dfu_malloc(page_size);
+
+    memset(ones, 0xff, page_size);
+    blank_crc = dfu_file_crc(0xffffffff, ones, page_size);
+    blank_crc_size = page_size;
+    free(ones);
+  }
+
+  ret = dfuse_try_special_command(dif, page, page_size, CRC32, 0);
+  if (ret < 0)
+    return ret;
+  dfu_abort_to_idle(dif);
+  ret = dfuse_upload(dif, sizeof(result), result, 1);
+  dfu_abort_to_idle(dif);
+  if (ret < 0)
+    return ret;
+  if (ret != sizeof(result))
+    return -EINVAL;
+  return quad2uint(result) == blank_crc;
+}
+
+/* Reads back a page, stopping at the first programmed byte */
+static int dfuse_read_page_is_blank(struct dfu_if *dif, unsigned int page,
+                                    int page_size, int xfer_size) {
+  unsigned long long start_time = dfu_get_time_ms();
+  unsigned char *buf;
+  int transaction = 2;
+  int blank = 1;
+  int p;
+  int x;
+
+  if (xfer_size > page_size)
+    xfer_size = page_size;
+  buf = dfu_malloc(xfer_size);
+
+  blank = dfuse_try_special_command(dif, page, 0, SET_ADDRESS, 0);
+  if (blank >= 0) {
+    blank = 1;
+    dfu_abort_to_idle(dif);
+  }
+  for (p = 0; blank > 0 && p < page_size; p += xfer_size) {
+    int chunk_size = xfer_size;
+    int rc;
+
+    if (p + chunk_size > page_size)
+      chunk_size = page_size - p;
+    rc = dfuse_upload(dif, chunk_size, buf, transaction++);
+    if (rc != chunk_size) {
+      blank = rc < 0 ? rc : -EINVAL;
+      break;
+    }
+    for (x = 0; x < chunk_size; x++)
+      if (buf[x] != 0xff)
+        blank = 0;
+  }
+  free(buf);
+  dfu_abort_to_idle(dif);
+
+  /* only a complete read tells the full page read time */
+  if (blank > 0) {
+    unsigned int sample = (unsigned int)((dfu_get_time_ms() - start_time) *
+                                         1024 / page_size);
+
+    if (blank_check.read_ms_per_kb)
+      sample = (3 * blank_check.read_ms_per_kb + sample) / 4;
+    blank_check.read_ms_per_kb = sample ? sample : 1;
+  }
+  return blank;
+}
+
+/* Erases the page holding address unless it is already blank */
+static void dfuse_erase_page(struct dfu_if *dif, unsigned int address,
+                             int upload_xfer_size) {
+  struct memsegment *segment = find_segment(dif->mem_layout, address);
+  unsigned int page;
+  int ret;
+
+  if (!segment || !dfuse_blank_check_worth(dif, segment)) {
+    dfuse_special_command(dif, address, ERASE_PAGE);
+    return;
+  }
+
+  page = address & ~(segment->pagesize - 1);
+  if (dfuse_has_crc_command(dif))
+    ret = dfuse_crc_page_is_blank(dif, page, segment->pagesize);
+  else
+    ret = dfuse_read_page_is_blank(dif, page, segment->pagesize,
+                                   upload_xfer_size);
+  blank_check.checked++;
+
+  if (ret > 0) {
+    if (verbose > 1)
+      fprintf(stderr, " Page at 0x%08x is blank, not erasing\n", page);
+    blank_check.blank++;
+    blank_check.misses = 0;
+    last_erased_page = page;
+    return;
+  }
+  if (ret < 0) {
+    /* a failed check costs nothing but the erase */
+    warnx("Blank check of page at 0x%08x failed, erasing it", page);
+    dfu_clear_status(dif->dev_handle, dif->interface);
+    dfu_abort_to_idle(dif);
+  } else {
+    blank_check.misses++;
+  }
+  dfuse_special_command(dif, address, ERASE_PAGE);
+}
+
+/* Download transfer size for memory of the type found at address */
+static int dfuse_dnload_xfer_size(struct dfu_if *dif, unsigned int address,
+                                  int xfer_size) {
+  struct memsegment *segment = find_segment(dif->mem_layout, address);
+  unsigned int *size;
+
+  if (!segment)
+    return xfer_size;
+  size = segment->memtype & DFUSE_ERASABLE ? &flash_xfer_size : &ram_xfer_size;
+  if (!*size)
+    return xfer_size;
+  /* limited once, quietly afterwards */
+  *size = dfu_limit_transfer_size(
+      dif, segment->memtype & DFUSE_ERASABLE ? "flash " : "RAM ", *size);
+  return *size;
+}
+
+/* Size of the chunk written at address, so that no chunk straddles pages */
+static int dfuse_chunk_size(struct memsegment *segment, unsigned int address,
+                            int xfer_size) {
+  unsigned int page_size;
+  unsigned int end;
+
+  if (!segment || !(segment->memtype & DFUSE_ERASABLE))
+    return xfer_size;
+
+  page_size = segment->pagesize;
+  /* transfers that divide a page stay aligned after a short first one */
+  if ((unsigned int)xfer_size < page_size && page_size % xfer_size == 0)
+    return xfer_size - address % xfer_size;
+
+  /* otherwise end on the last page boundary within reach */
+  end = address + xfer_size;
+  if (end % page_size && end - end % page_size > address)
+    end -= end % page_size;
+  return end - address;
+}
+
+/* Reads size bytes at address back into buf, returns 0 or < 0 on error */
+static int dfuse_read_back(struct dfu_if *dif, unsigned int address,
+                           unsigned char *buf, int size, int xfer_size) {
+  int transaction = 2;
+  int ret;
+  int p;
+
+  ret = dfuse_try_special_command(dif, address, 0, SET_ADDRESS, 0);
+  if (ret < 0)
+    return ret;
+  dfu_abort_to_idle(dif);
+  for (p = 0; p < size; p += xfer_size) {
+    int chunk_size = size - p < xfer_size ? size - p : xfer_size;
+
+    ret = dfuse_upload(dif, chunk_size, buf + p, transaction++);
+    if (ret != chunk_size) {
+      dfu_clear_status(dif->dev_handle, dif->interface);
+      dfu_abort_to_idle(dif);
+      return ret < 0 ? ret : -EINVAL;
+    }
+  }
+  dfu_abort_to_idle(dif);
+  return 0;
+}
+
+/*
+ * A chunk that failed on the way may still have been written, or only
+ * partly, and flash can not take new data without an erase. Reads the
+ * chunk back and returns the element offset to go on writing from: past
+ * the chunk if it is there after all, the chunk itself if its memory is
+ * still blank, or else the start of its page once that is erased again.
+ */
+static unsigned long long dfuse_retry_offset(struct dfu_if *dif,
+                                             struct memsegment *segment,
+                                             unsigned int dwElementAddress,
+                                             unsigned long long start,
+                                             unsigned long long p,
+                                             const unsigned char *data,
+                                             int chunk_size,
+                                             int upload_xfer_size) {
+  unsigned int address = dwElementAddress + p;
+  unsigned int erase_address;
+  unsigned int page;
+  unsigned char *buf;
+  int blank = 0;
+  int i;
+
+  /* RAM simply takes the chunk again */
+  if (!segment || !(segment->memtype & DFUSE_ERASABLE))
+    return p;
+
+  if (segment->memtype & DFUSE_READABLE) {
+    buf = dfu_malloc(chunk_size);
+    if (dfuse_read_back(dif, address, buf, chunk_size, upload_xfer_size) == 0) {
+      if (!memcmp(buf, data, chunk_size)) {
+        free(buf);
+        return p + chunk_size;
+      }
+      for (i = 0, blank = 1; i < chunk_size && blank; i++)
+        blank = buf[i] == 0xff;
+    }
+    free(buf);
+    if (blank)
+      return p;
+  }
+
+  /* earlier chunks in the page are lost with it and written again */
+  page = address & ~(segment->pagesize - 1);
+  if (page < dwElementAddress + start)
+    errx(EX_IOERR, "Cannot erase page at 0x%08x again, it holds data "
+                   "from before 0x%08x",
+         page, (unsigned int)(dwElementAddress + start));
+  if (verbose)
+    printf("Erasing page at 0x%08x again\n", page);
+  for (erase_address = page; erase_address < address + chunk_size;
+       erase_address += segment->pagesize)
+    dfuse_special_command(dif, erase_address, ERASE_PAGE);
+  return page - dwElementAddress;
+}
+
+/* Writes an element of any size to the device, taking care of page erases */
+/* Writing starts at offset start, which is page aligned when resuming */
+/* returns 0 on success, otherwise -EINVAL */
+static int dfuse_dnload_element(struct dfu_if *dif,
+                                unsigned int dwElementAddress,
+                                unsigned int dwElementSize, unsigned char *data,
+                                int xfer_size, int upload_xfer_size,
+                                unsigned int start) {
+  /* wide enough not to wrap at the end of the 32-bit address space */
+  unsigned long long p;
+  unsigned long long retry_end = 0;
+  int ret;
+  int attempt = 0;
+  int chunk_size;
+  struct memsegment *segment;
+
+  xfer_size = dfuse_dnload_xfer_size(dif, dwElementAddress + start, xfer_size);
+  if (verbose)
+    printf("Transfer size %i for element at 0x%08x\n", xfer_size,
+           dwElementAddress);
+
+  /* Check at least that we can write to the last address */
+  segment = find_segment(dif->mem_layout, dwElementAddress + dwElementSize - 1);
+  if (!dfuse_force && (!segment || !(segment->memtype & DFUSE_WRITEABLE))) {
+    errx(EX_USAGE, "Last page at 0x%08x is not writeable",
+         dwElementAddress + dwElementSize - 1);
+  }
+
+  if (!verbose)
+    dfu_progress_bar("Erase   ", 0, 1);
+
+  /* First pass: Erase involved pages if needed */
+  for (p = start; p < dwElementSize; p += chunk_size) {
+    int page_size;
+    unsigned int erase_address;
+    unsigned int address = dwElementAddress + p;
+
+    segment = find_segment(dif->mem_layout, address);
+    chunk_size = dfuse_chunk_size(segment, address, xfer_size);
+    if (!dfuse_force && (!segment || !(segment->memtype & DFUSE_WRITEABLE))) {
+      errx(EX_USAGE, "Page at 0x%08x is not writeable", address);
+    }
+    /* If the location is not in the memory map we skip erasing */
+    /* since we wouldn't know the correct page size for flash erase */
+    if (!segment)
+      continue;
+
+    page_size = segment->pagesize;
+
+    /* check if this is the last chunk */
+    if (p + chunk_size > dwElementSize)
+      chunk_size = dwElementSize - p;
+
+    /* Erase only for flash memory downloads */
+    if ((segment->memtype & DFUSE_ERASABLE) && !dfuse_mass_erase) {
+      /* erase all involved pages */
+      for (erase_address = address; erase_address < address + chunk_size;
+           erase_address += page_size)
+        if ((erase_address & ~(page_size - 1)) != last_erased_page)
+          dfuse_erase_page(dif, erase_address, upload_xfer_size);
+
+      if (((address + chunk_size - 1) & ~(page_size - 1)) != last_erased_page) {
+        if (verbose > 1)
+          fprintf(stderr, " Chunk extends into next page,"
+                          " erase it as well\n");
+        dfuse_erase_page(dif, address + chunk_size - 1, upload_xfer_size);
+      }
+      if (!verbose)
+        dfu_progress_bar("Erase   ", p, dwElementSize);
+    }
+  }
+  if (!verbose)
+    dfu_progress_bar("Erase   ", dwElementSize, dwElementSize);
+  if (!verbose)
+    dfu_progress_bar("Download", 0, 1);
+
+  /* Second pass: Write data to (erased) pages */
+  for (p = start; p < dwElementSize; p += chunk_size) {
+    unsigned int address = dwElementAddress + p;
+
+    segment = find_segment(dif->mem_layout, address);
+    chunk_size = dfuse_chunk_size(segment, address, xfer_size);
+
+    /* check if this is the last chunk */
+    if (p + chunk_size > dwElementSize)
+      chunk_size = dwElementSize - p;
+
+    if (verbose) {
+      fprintf(stderr,
+              " Download from image offset "
+              "%08llx to memory %08x-%08x, size %i\n",
+              p, address, address + chunk_size - 1, chunk_size);
+    } else {
+      dfu_progress_bar("Download", p, dwElementSize);
+    }
+
+    /* the address is set for every chunk, so a chunk that failed
+     * on the way can be sent again once its pages are erased again */
+    ret = dfuse_try_special_command(dif, address, 0, SET_ADDRESS, 0);
+    /* transaction = 2 for no address offset */
+    if (ret >= 0)
+      ret = dfuse_dnload_chunk(dif, data + p, chunk_size, 2);
+    if (ret < 0 && dfu_transient_error(ret) && attempt < dfu_retry_limit) {
+      warnx("Retrying chunk at 0x%08x", address);
+      dfuse_recover(dif, attempt++);
+      retry_end = p + chunk_size;
+      p = dfuse_retry_offset(dif, segment, dwElementAddress, start, p,
+                             data + p, chunk_size, upload_xfer_size);
+      if (p >= retry_end) {
+        /* it was written after all */
+        dfu_retry_count += attempt;
+        attempt = 0;
+      }
+      chunk_size = 0;
+      continue;
+    }
+    if (ret < 0)
+      errx(EX_IOERR, "Failed to write chunk at 0x%08x", address);
+    if (ret != chunk_size) {
+      errx(EX_IOERR,
+           "Failed to write whole chunk: "
+           "%i of %i bytes",
+           ret, chunk_size);
+      return -EINVAL;
+    }
+    /* recovered once the failed chunk is written */
+    if (attempt && p + chunk_size >= retry_end) {
+      dfu_retry_count += attempt;
+      attempt = 0;
+    }
+    if (dfu_file_resume) {
+      dfuse_journal.offset = p + chunk_size;
+      dfu_journal_save(&dfuse_journal);
+    }
+  }
+  if (!verbose)
+    dfu_progress_bar("Download", dwElementSize, dwElementSize);
+  return 0;
+}
+
+/* Reads back an element from offset start and compares it with the data */
+/* returns the number of mismatching pages, or < 0 on error */
+static int dfuse_verify_element(struct dfu_if *dif,
+                                unsigned int dwElementAddress,
+                                unsigned int dwElementSize,
+                                unsigned char *data, int xfer_size,
+                                unsigned int start) {
+  unsigned long long start_time = dfu_get_time_ms();
+  unsigned int last_bad_page = 1; /* non-aligned value, won't match */
+  struct memsegment *segment;
+  unsigned char *buf;
+  int transaction = 2;
+  int bad_pages = 0;
+  unsigned long long p;
+  int ret = 0;
+
+  segment = find_segment(dif->mem_layout, dwElementAddress + start);
+  if (!segment || !(segment->memtype & DFUSE_READABLE)) {
+    warnx("Memory at 0x%08x is not readable, skipping verify",
+          dwElementAddress + start);
+    return 0;
+  }
+
+  buf = dfu_malloc(xfer_size);
+
+  dfuse_special_command(dif, dwElementAddress + start, SET_ADDRESS);
+  dfu_abort_to_idle(dif);
+
+  if (!verbose)
+    dfu_progress_bar("Verify  ", 0, 1);
+
+  for (p = start; p < dwElementSize; p += xfer_size) {
+    unsigned int address = dwElementAddress + p;
+    int chunk_size = xfer_size;
+    int rc;
+    int x;
+
+    if (p + chunk_size > dwElementSize)
+      chunk_size = dwElementSize - p;
+
+    dfuse_next_upload_block(dif, address, &transaction);
+    rc = dfuse_upload(dif, chunk_size, buf, transaction++);
+    if (rc < 0) {
+      ret = rc;
+      goto out_free;
+    }
+    if (rc != chunk_size)
+      errx(EX_IOERR, "Short read back at 0x%08x: %i of %i bytes", address, rc,
+           chunk_size);
+
+    if (!memcmp(buf, data + p, chunk_size)) {
+      if (!verbose)
+        dfu_progress_bar("Verify  ", p, dwElementSize);
+      continue;
+    }
+
+    /* locate the mismatching pages */
+    for (x = 0; x < chunk_size; x++) {
+      unsigned int page;
+
+      if (buf[x] == data[p + x])
+        continue;
+      segment = find_segment(dif->mem_layout, address + x);
+      page = segment ? (address + x) & ~(segment->pagesize - 1) : address + x;
+      if (page == last_bad_page)
+        continue;
+      last_bad_page = page;
+      bad_pages++;
+      fprintf(stderr,
+              "\nVerify mismatch in page at 0x%08x (0x%02x != 0x%02x)\n", page,
+              buf[x], data[p + x]);
+    }
+  }
+  if (!verbose)
+    dfu_progress_bar("Verify  ", dwElementSize, dwElementSize);
+  ret = bad_pages;
+
+out_free:
+  free(buf);
+  dfu_abort_to_idle(dif);
+  verify_ms += dfu_get_time_ms() - start_time;
+  verify_bytes += dwElementSize - start;
+
+  return ret;
+}
+
+/* Reads the CRC32 the device computes over a memory range */
+static int dfuse_device_crc(struct dfu_if *dif, unsigned int address,
+                            unsigned int size, uint32_t *crc) {
+  unsigned char result[4];
+  int ret;
+
+  dfuse_special_command_range(dif, address, size, CRC32);
+  dfu_abort_to_idle(dif);
+  ret = dfuse_upload(dif, sizeof(result), result, 1);
+  if (ret < 0)
+    return ret;
+  if (ret != sizeof(result))
+    errx(EX_PROTOCOL, "Short CRC32 response: %i bytes", ret);
+  dfu_abort_to_idle(dif);
+
+  *crc = quad2uint(result);
+  return 0;
+}
+
+/* Compares the CRC32 of an element computed by the device with our own */
+/* returns 0 on match, 1 on mismatch, or < 0 on error */
+static int dfuse_crc_verify_element(struct dfu_if *dif,
+                                    unsigned int dwElementAddress,
+                                    unsigned int dwElementSize,
+                                    unsigned char *data, unsigned int start) {
+  unsigned long long start_time = dfu_get_time_ms();
+  uint32_t device_crc;
+  uint32_t crc;
+  int ret;
+
+  crc = dfu_file_crc(0xffffffff, data + start, dwElementSize - start);
+
+  ret = dfuse_device_crc(dif, dwElementAddress + start, dwElementSize - start,
+                         &device_crc);
+  if (ret < 0)
+    return ret;
+
+  verify_ms += dfu_get_time_ms() - start_time;
+  verify_bytes += dwElementSize - start;
+
+  if (device_crc == crc)
+    return 0;
+  fprintf(stderr, "Device CRC32 0x%08x of 0x%08x-0x%08x, expected 0x%08x\n",
+          device_crc, dwElementAddress + start,
+          dwElementAddress + dwElementSize - 1, crc);
+  return 1;
+}
+
+/* Checks whether an element is already in the device memory */
+/* returns 1 if it is, 0 at the first difference, or < 0 on error */
+static int dfuse_element_on_device(struct dfu_if *dif,
+                                   struct dfuse_element *element,
+                                   int xfer_size) {
+  struct memsegment *first;
+  struct memsegment *last;
+  unsigned char *buf;
+  int transaction = 2;
+  unsigned long long p;
+  uint32_t crc;
+  int same = 1;
+  int ret;
+
+  if (!element->size)
+    return 1;
+
+  if (dfuse_has_crc_command(dif)) {
+    ret = dfuse_device_crc(dif, element->address, element->size, &crc);
+    if (ret < 0) {
+      dfu_clear_status(dif->dev_handle, dif->interface);
+      dfu_abort_to_idle(dif);
+      return ret;
+    }
+    return crc == dfu_file_crc(0xffffffff, element->data, element->size);
+  }
+
+  /* what can not be read back has to be written */
+  first = find_segment(dif->mem_layout, element->address);
+  last = find_segment(dif->mem_layout, element->address + element->size - 1);
+  if (!first || !last || !(first->memtype & DFUSE_READABLE) ||
+      !(last->memtype & DFUSE_READABLE))
+    return 0;
+
+  buf = dfu_malloc(xfer_size);
+
+  dfuse_special_command(dif, element->address, SET_ADDRESS);
+  dfu_abort_to_idle(dif);
+
+  for (p = 0; p < element->size && same == 1; p += xfer_size) {
+    int chunk_size = xfer_size;
+
+    if (p + chunk_size > element->size)
+      chunk_size = element->size - p;
+
+    dfuse_next_upload_block(dif, element->address + p, &transaction);
+    ret = dfuse_upload(dif, chunk_size, buf, transaction++);
+    if (ret < 0) {
+      dfu_clear_status(dif->dev_handle, dif->interface);
+      same = ret;
+    } else {
+      same = ret == chunk_size && !memcmp(buf, element->data + p, chunk_size);
+    }
+  }
+  free(buf);
+  dfu_abort_to_idle(dif);
+
+  return same;
+}
+
+static void dfuse_memcpy(unsigned char *dst, unsigned char **src,
+                         unsigned long long *rem, unsigned int size) {
+  if (size > *rem) {
+    errx(EX_NOINPUT,
+         "Corrupt DfuSe file: "
+         "Cannot read %u bytes from %llu bytes",
+         size, *rem);
+  }
+  if (dst != NULL)
+    memcpy(dst, *src, size);
+  (*src) += size;
+  (*rem) -= size;
+}
+
+/* Pages a download is going to erase, sorted by address */
+struct dfuse_erase_plan {
+  struct dfu_if *dif; /* alternate setting owning the pages */
+  int multiple_alt;   /* pages are spread over several alternate settings */
+  unsigned int *pages;
+  int num_pages;
+  int max_pages;
+};
+
+static int dfuse_compare_pages(const void *a, const void *b) {
+  unsigned int pa = *(const unsigned int *)a;
+  unsigned int pb = *(const unsigned int *)b;
+
+  return pa < pb ? -1 : pa > pb;
+}
+
+static void dfuse_plan_add_element(struct dfuse_erase_plan *plan,
+                                   struct dfuse_element *element) {
+  struct memsegment *segment;
+  unsigned int last;
+
+  if (!element->dif || !element->size)
+    return;
+  last = element->address + element->size - 1;
+
+  for (segment = element->dif->mem_layout; segment; segment = segment->next) {
+    unsigned int first_page, last_page, page;
+
+    if (!(segment->memtype & DFUSE_ERASABLE) ||
+        segment->start > last || segment->end < element->address)
+      continue;
+
+    first_page = (element->address > segment->start ? element->address
+                                                    : segment->start) &
+                 ~(segment->pagesize - 1);
+    last_page = (last < segment->end ? last : segment->end) &
+                ~(segment->pagesize - 1);
+
+    if (!plan->dif)
+      plan->dif = element->dif;
+    else if (plan->dif != element->dif)
+      plan->multiple_alt = 1;
+
+    for (page = first_page;; page += segment->pagesize) {
+      if (plan->num_pages == plan->max_pages) {
+        plan->max_pages = plan->max_pages ? 2 * plan->max_pages : 64;
+        plan->pages =
+            realloc(plan->pages, plan->max_pages * sizeof(*plan->pages));
+        if (!plan->pages)
+          errx(EX_SOFTWARE, "Out of memory");
+      }
+      plan->pages[plan->num_pages++] = page;
+      if (page == last_page)
+        break;
+    }
+  }
+}
+
+static int dfuse_plan_has_page(struct dfuse_erase_plan *plan,
+                               unsigned int page) {
+  return bsearch(&page, plan->pages, plan->num_pages, sizeof(*plan->pages),
+                 dfuse_compare_pages) != NULL;
+}
+
+/* Returns the kept range that a mass erase would destroy, if any */
+/* pages in the plan are erased anyway, plan may be NULL */
+static struct dfuse_range *dfuse_plan_lost_keep(struct dfu_if *dif,
+                                                struct dfuse_erase_plan *plan) {
+  struct memsegment *segment;
+  int i;
+
+  for (segment = dif->mem_layout; segment; segment = segment->next) {
+    unsigned int page = segment->start;
+    int count;
+
+    if (!(segment->memtype & DFUSE_ERASABLE))
+      continue;
+    count = (segment->end - segment->start + 1) / segment->pagesize;
+    for (; count--; page += segment->pagesize) {
+      if (plan && dfuse_plan_has_page(plan, page))
+        continue;
+      for (i = 0; i < dfuse_num_keep; i++) {
+        if (dfuse_keep[i].alt >= 0 && dfuse_keep[i].alt != dif->altsetting)
+          continue;
+        if (dfuse_keep[i].address <= page + (segment->pagesize - 1) &&
+            dfuse_keep[i].address + (dfuse_keep[i].length - 1) >= page)
+          return &dfuse_keep[i];
+      }
+    }
+  }
+  return NULL;
+}
+
+/* Replace the planned page erases by a single mass erase if the cost
+ * model says it is faster and nothing outside the image is lost that
+ * the user asked to keep */
+static void dfuse_auto_mass_erase(struct dfu_if *dif,
+                                  struct dfuse_element *elements,
+                                  int num_elements) {
+  struct dfuse_erase_plan plan;
+  struct memsegment *segment;
+  struct dfuse_range *keep;
+  unsigned int page_cost = 0;
+  unsigned int bank_cost = 0;
+  unsigned int mass_cost;
+  int bank_pages = 0;
+  int i, j;
+
+  memset(&plan, 0, sizeof(plan));
+  for (i = 0; i < num_elements; i++)
+    dfuse_plan_add_element(&plan, &elements[i]);
+
+  if (!plan.num_pages)
+    goto out;
+  if (plan.multiple_alt || plan.dif != dif) {
+    if (verbose)
+      printf("Erase plan spans other alternate settings, "
+             "not considering mass erase\n");
+    goto out;
+  }
+
+  /* sort and remove pages shared by several elements */
+  qsort(plan.pages, plan.num_pages, sizeof(*plan.pages), dfuse_compare_pages);
+  for (i = 1, j = 0; i < plan.num_pages; i++)
+    if (plan.pages[i] != plan.pages[j])
+      plan.pages[++j] = plan.pages[i];
+  plan.num_pages = j + 1;
+
+  for (i = 0; i < plan.num_pages; i++) {
+    segment = find_segment(dif->mem_layout, plan.pages[i]);
+    if (segment)
+      page_cost += dfuse_page_erase_ms(segment->pagesize);
+  }
+
+  for (segment = dif->mem_layout; segment; segment = segment->next) {
+    int n;
+
+    if (!(segment->memtype & DFUSE_ERASABLE))
+      continue;
+    n = (segment->end - segment->start + 1) / segment->pagesize;
+    bank_pages += n;
+    bank_cost += n * dfuse_page_erase_ms(segment->pagesize);
+  }
+
+  /* Without any timing information, assume a mass erase takes as long
+   * as erasing every page, so it only wins by saving the commands */
+  if (erase_timing.mass_ms)
+    mass_cost = erase_timing.mass_ms;
+  else if (erase_timing.learned_mass_ms)
+    mass_cost = erase_timing.learned_mass_ms;
+  else
+    mass_cost = bank_cost;
+
+  printf("Erase plan: %i of %i pages, estimated %u ms, "
+         "mass erase estimated %u ms\n",
+         plan.num_pages, bank_pages, page_cost, mass_cost);
+
+  if (mass_cost > page_cost)
+    goto out;
+
+  if (plan.num_pages < bank_pages && !dfuse_force) {
+    printf("Not using mass erase, it would erase %i pages outside "
+           "the image (requires \"force\")\n",
+           bank_pages - plan.num_pages);
+    goto out;
+  }
+  keep = dfuse_plan_lost_keep(dif, &plan);
+  if (keep) {
+    printf("Not using mass erase, it would erase kept range "
+           "0x%08x-0x%08x\n",
+           keep->address, keep->address + (keep->length - 1));
+    goto out;
+  }
+
+  printf("Using mass erase instead of %i page erases\n", plan.num_pages);
+  dfuse_special_command(dif, 0, MASS_ERASE);
+  /* all pages of the plan are erased now */
+  dfuse_mass_erase = 1;
+
+out:
+  free(plan.pages);
+}
+
+/* Finds where to continue an interrupted download: at the start of the
+ * page holding the first unacknowledged byte. That page is erased again,
+ * so earlier elements sharing it are written again as well. */
+static int dfuse_resume_point(struct dfuse_element *elements, int num_elements,
+                              unsigned int *start) {
+  int element = dfuse_journal.element;
+  unsigned int address;
+  struct memsegment *segment;
+
+  *start = dfuse_journal.offset;
+  if (element >= num_elements)
+    return num_elements;
+  if (*start >= elements[element].size) {
+    element++;
+    *start = 0;
+    if (element >= num_elements)
+      return num_elements;
+  }
+  if (!elements[element].dif)
+    return element;
+
+  address = elements[element].address + *start;
+  segment = find_segment(elements[element].dif->mem_layout, address);
+  if (!segment || !(segment->memtype & DFUSE_ERASABLE))
+    return element;
+
+  address &= ~(segment->pagesize - 1);
+  while (element > 0 && elements[element - 1].dif == elements[element].dif &&
+         elements[element - 1].address + elements[element - 1].size > address)
+    element--;
+  *start = address > elements[element].address
+               ? address - elements[element].address
+               : 0;
+
+  return element;
+}
+
+/* Compares all elements with the device memory */
+/* returns 1 if the device already holds them, 0 if not, or < 0 on error */
+static int dfuse_image_on_device(struct dfu_if *dif, int xfer_size,
+                                 struct dfuse_element *elements,
+                                 int num_elements) {
+  struct dfu_if *current = dif;
+  int same = 1;
+  int element;
+
+  for (element = 0; element < num_elements && same == 1; element++) {
+    struct dfu_if *adif = elements[element].dif;
+
+    /* elements for missing alternate settings are not downloaded either */
+    if (!adif)
+      continue;
+
+    if (adif != current) {
+      dfuse_set_alt(dif, adif);
+      current = adif;
+    }
+    same = dfuse_element_on_device(adif, &elements[element], xfer_size);
+  }
+  if (current != dif)
+    dfuse_set_alt(dif, dif);
+
+  return same;
+}
+
+static int dfuse_dnload_elements(struct dfu_if *dif, int xfer_size,
+                                 int upload_xfer_size,
+                                 struct dfuse_element *elements,
+                                 int num_elements) {
+  struct dfu_if *current = dif;
+  unsigned int start = 0;
+  int first = 0;
+  int element;
+  int ret;
+
+  if (dfuse_resuming) {
+    first = dfuse_resume_point(elements, num_elements, &start);
+    if (first < num_elements)
+      printf("Resuming download at element %i, address 0x%08x\n", first + 1,
+             elements[first].address + start);
+  } else if (dfuse_auto_erase && !dfuse_mass_erase) {
+    dfuse_auto_mass_erase(dif, elements, num_elements);
+  }
+
+  for (element = first; element < num_elements; element++) {
+    struct dfu_if *adif = elements[element].dif;
+
+    /* skip elements for missing alternate settings */
+    if (!adif)
+      continue;
+
+    if (adif != current) {
+      dfuse_set_alt(dif, adif);
+      current = adif;
+    }
+
+    if (num_elements > 1)
+      printf("Downloading element %i, address = 0x%08x, size = %u\n",
+             element + 1, elements[element].address, elements[element].size);
+
+    dfuse_journal.element = element;
+    ret = dfuse_dnload_element(adif, elements[element].address,
+                               elements[element].size, elements[element].data,
+                               xfer_size, upload_xfer_size,
+                               element == first ? start : 0);
+    if (ret != 0)
+      return ret;
+
+    if (dfuse_verify && !dfuse_will_reset) {
+      unsigned int offset = element == first ? start : 0;
+
+      /* a device computed CRC saves reading everything back */
+      if (dfuse_has_crc_command(adif)) {
+        ret = dfuse_crc_verify_element(adif, elements[element].address,
+                                       elements[element].size,
+                                       elements[element].data, offset);
+        if (ret < 0)
+          return ret;
+        if (ret > 0) {
+          printf("Reading back element to locate mismatching pages\n");
+          ret = dfuse_verify_element(adif, elements[element].address,
+                                     elements[element].size,
+                                     elements[element].data,
+                                     upload_xfer_size, offset);
+          if (ret == 0)
+            errx(EX_IOERR, "Verify failed: CRC32 mismatch");
+        }
+      } else {
+        ret = dfuse_verify_element(adif, elements[element].address,
+                                   elements[element].size,
+                                   elements[element].data, upload_xfer_size,
+                                   offset);
+      }
+      if (ret < 0)
+        return ret;
+      if (ret > 0)
+        errx(EX_IOERR, "Verify failed: %i mismatching pages", ret);
+    }
+  }
+  if (blank_check.checked)
+    printf("Blank check skipped %u of %u checked page erases\n",
+           blank_check.blank, blank_check.checked);
+  if (dfuse_verify && !dfuse_will_reset)
+    printf("Verified %llu bytes in %llu ms\n", verify_bytes, verify_ms);
+  else if (dfuse_verify)
+    printf("Device resets after download, skipping verify\n");
+  return 0;
+}
+
+/* Parse a DfuSe file into a list of elements to download */
+static int dfuse_parse_dfuse_file(struct dfu_if *dif, struct dfu_file *file,
+                                  struct dfuse_element **elements) {
   uint8_t dfuprefix[11];
   uint8_t targetprefix[274];
   uint8_t elementheader[8];
@@ -631,16 +2059,16 @@ static int dfuse_do_dfuse_dnload(struct dfu_if *dif, int xfer_size,
   unsigned int dwElementAddress;
   unsigned int dwElementSize;
   uint8_t *data;
-  int ret;
-  int rem;
+  unsigned long long rem;
   int bFirstAddressSaved = 0;
+  int num_elements = 0;
 
+  *elements = NULL;
   rem = file->size.total - file->size.prefix - file->size.suffix;
   data = file->firmware + file->size.prefix;
 
   /* Must be larger than a minimal DfuSe header and suffix */
-  if (rem <
-      (int)(sizeof(dfuprefix) + sizeof(targetprefix) + sizeof(elementheader))) {
+  if (rem < sizeof(dfuprefix) + sizeof(targetprefix) + sizeof(elementheader)) {
     errx(EX_DATAERR, "File too small for a DfuSe file");
   }
 
@@ -672,24 +2100,12 @@ static int dfuse_do_dfuse_dnload(struct dfu_if *dif, int xfer_size,
     dwNbElements = quad2uint((unsigned char *)targetprefix + 270);
     printf("Image for alternate setting %i, ", bAlternateSetting);
     printf("(%i elements, ", dwNbElements);
-    printf("total size = %i)\n",
+    printf("total size = %u)\n",
            quad2uint((unsigned char *)targetprefix + 266));
 
-    adif = dif;
-    while (adif) {
-      if (bAlternateSetting == adif->altsetting) {
-        adif->dev_handle = dif->dev_handle;
-        printf("Setting Alternate Interface #%d ...\n", adif->altsetting);
-        ret = libusb_set_interface_alt_setting(
-            adif->dev_handle, adif->interface, adif->altsetting);
-        if (ret < 0) {
-          errx(EX_IOERR, "Cannot set alternate interface: %s",
-               libusb_error_name(ret));
-        }
+    for (adif = dif; adif; adif = adif->next)
+      if (bAlternateSetting == adif->altsetting)
         break;
-      }
-      adif = adif->next;
-    }
     if (!adif)
       warnx("No alternate setting %d (skipping elements)", bAlternateSetting);
 
@@ -699,56 +2115,104 @@ static int dfuse_do_dfuse_dnload(struct dfu_if *dif, int xfer_size,
       dwElementAddress = quad2uint((unsigned char *)elementheader);
       dwElementSize = quad2uint((unsigned char *)elementheader + 4);
       printf("address = 0x%08x, ", dwElementAddress);
-      printf("size = %i\n", dwElementSize);
+      printf("size = %u\n", dwElementSize);
 
       if (!bFirstAddressSaved) {
         bFirstAddressSaved = 1;
         dfuse_address = dwElementAddress;
       }
       /* sanity check */
-      if ((int)dwElementSize > rem)
+      if (dwElementSize > rem)
         errx(EX_DATAERR, "File too small for element size");
 
-      if (adif)
-        ret = dfuse_dnload_element(adif, dwElementAddress, dwElementSize, data,
-                                   xfer_size);
-      else
-        ret = 0;
+      *elements = realloc(*elements, (num_elements + 1) * sizeof(**elements));
+      if (!*elements)
+        errx(EX_SOFTWARE, "Out of memory");
+      (*elements)[num_elements].dif = adif;
+      (*elements)[num_elements].address = dwElementAddress;
+      (*elements)[num_elements].size = dwElementSize;
+      (*elements)[num_elements].data = data;
+      num_elements++;
 
       /* advance read pointer */
       dfuse_memcpy(NULL, &data, &rem, dwElementSize);
-
-      if (ret != 0)
-        return ret;
     }
   }
 
   if (rem != 0)
-    warnx("%d bytes leftover", rem);
+    warnx("%llu bytes leftover", rem);
 
   printf("Done parsing DfuSe file\n");
 
-  return 0;
+  return num_elements;
 }
 
-int dfuse_do_dnload(struct dfu_if *dif, int xfer_size, struct dfu_file *file,
-                    const char *dfuse_options) {
-  int ret;
-  struct dfu_if *adif;
+/* Lists the elements to download from an image with load addresses, */
+/* a raw binary for the DfuSe address or a DfuSe file */
+static int dfuse_file_elements(struct dfu_if *dif, struct dfu_file *file,
+                               struct dfuse_element **elements) {
+  int i;
+
+  /* without an address, a file named like a raw binary may still be
+   * an image with load addresses, unless it is to be written raw */
+  if (!dfuse_address_present && dfu_file_parse_images != DETECT_NEVER)
+    dfu_file_parse_image(file);
+
+  if (file->segments) {
+    if (dfuse_address_present)
+      errx(EX_USAGE, "The image carries its own load addresses, "
+                     "do not give a DfuSe address");
+    *elements = dfu_malloc(file->num_segments * sizeof(**elements));
+    for (i = 0; i < file->num_segments; i++) {
+      (*elements)[i].dif = dif;
+      (*elements)[i].address = file->segments[i].address;
+      (*elements)[i].size = file->segments[i].size;
+      (*elements)[i].data = file->segments[i].data;
+    }
+    dfuse_address = (*elements)[0].address;
 
-  if (dfuse_options)
-    dfuse_parse_options(dfuse_options);
+    printf("Downloading %i segments\n", file->num_segments);
+    return file->num_segments;
+  }
 
-  adif = dif;
-  while (adif) {
-    adif->mem_layout = parse_memory_layout((char *)adif->alt_name);
-    if (!adif->mem_layout)
-      errx(EX_IOERR, "Failed to parse memory layout for alternate interface %i",
-           adif->altsetting);
-    if (adif->quirks & QUIRK_DFUSE_LAYOUT)
-      fixup_dfuse_layout(adif, &(adif->mem_layout));
-    adif = adif->next;
+  if (dfuse_address_present) {
+    unsigned long long size;
+
+    if (file->bcdDFU == 0x11a) {
+      errx(EX_USAGE, "This is a DfuSe file, not "
+                     "meant for raw download");
+    }
+    /* DfuSe addresses are 32 bits wide, image sizes need not be */
+    size = file->size.total - file->size.suffix - file->size.prefix;
+    if (size > 0xffffffff || size > 0x100000000ULL - dfuse_address)
+      errx(EX_USAGE, "Image of %llu bytes does not fit above 0x%08x", size,
+           dfuse_address);
+    *elements = dfu_malloc(sizeof(**elements));
+    (*elements)->dif = dif;
+    (*elements)->address = dfuse_address;
+    (*elements)->size = size;
+    (*elements)->data = file->firmware + file->size.prefix;
+
+    printf("Downloading element to address = 0x%08x, size = %u\n",
+           (*elements)->address, (*elements)->size);
+    return 1;
+  }
+
+  if (file->bcdDFU != 0x11a) {
+    warnx("Only DfuSe file version 1.1a is supported");
+    errx(EX_USAGE, "(for raw binary download, use the "
+                   "--dfuse-address option)");
   }
+  return dfuse_parse_dfuse_file(dif, file, elements);
+}
+
+int dfuse_do_dnload(struct dfu_if *dif, int xfer_size, int upload_xfer_size,
+                    struct dfu_file *file) {
+  struct dfuse_element *elements = NULL;
+  int num_elements = 0;
+  int ret;
+
+  dfuse_parse_layouts(dif);
 
   if (dfuse_unprotect) {
     if (!dfuse_force) {
@@ -760,46 +2224,72 @@ int dfuse_do_dnload(struct dfu_if *dif, int xfer_size, struct dfu_file *file,
     printf("Device disconnects, erases flash and resets now\n");
     return ret;
   }
-  if (dfuse_mass_erase) {
+  if (file->name) {
+    num_elements = dfuse_file_elements(dif, file, &elements);
+    if (num_elements < 0) {
+      ret = num_elements;
+      goto out;
+    }
+  }
+  if (dfu_file_resume && file->name)
+    dfuse_resuming = dfu_journal_open(file, xfer_size, &dfuse_journal);
+  /* compare before anything is erased, a resumed download is incomplete */
+  if (dfu_skip_if_same && file->name && !dfuse_resuming) {
+    ret = dfuse_image_on_device(dif, upload_xfer_size, elements,
+                                num_elements);
+    if (ret < 0) {
+      warnx("Cannot read back the device, downloading unconditionally");
+    } else if (ret > 0) {
+      printf("Device already holds this image, skipping download\n");
+      ret = DFU_IMAGE_ON_DEVICE;
+      goto out;
+    }
+  }
+  if (dfuse_mass_erase && dfuse_resuming) {
+    /* erase page by page from the resume point instead */
+    printf("Skipping mass erase when resuming download\n");
+    dfuse_mass_erase = 0;
+  } else if (dfuse_mass_erase) {
+    struct dfuse_range *keep;
+
     if (!dfuse_force) {
       errx(EX_USAGE, "The mass erase command "
                      "can only be used with force");
     }
+    keep = dfuse_plan_lost_keep(dif, NULL);
+    if (keep)
+      errx(EX_USAGE, "Mass erase would erase kept range 0x%08x-0x%08x",
+           keep->address, keep->address + (keep->length - 1));
     printf("Performing mass erase, this can take a moment\n");
     ret = dfuse_special_command(dif, 0, MASS_ERASE);
   }
   if (!file->name) {
     printf("DfuSe command mode\n");
     ret = 0;
-  } else if (dfuse_address_present) {
-    if (file->bcdDFU == 0x11a) {
-      errx(EX_USAGE, "This is a DfuSe file, not "
-                     "meant for raw download");
-    }
-    ret = dfuse_do_bin_dnload(dif, xfer_size, file, dfuse_address);
   } else {
-    if (file->bcdDFU != 0x11a) {
-      warnx("Only DfuSe file version 1.1a is supported");
-      errx(EX_USAGE, "(for raw binary download, use the "
-                     "--dfuse-address option)");
-    }
-    ret = dfuse_do_dfuse_dnload(dif, xfer_size, file);
+    ret = dfuse_dnload_elements(dif, xfer_size, upload_xfer_size, elements,
+                                num_elements);
+    if (ret == 0 && (file->segments || dfuse_address_present))
+      printf("File downloaded successfully\n");
   }
 
-  adif = dif;
-  while (adif) {
-    free_segment_list(adif->mem_layout);
-    adif = adif->next;
-  }
+out:
+  free(elements);
+  dfu_journal_close(ret == 0 || ret == DFU_IMAGE_ON_DEVICE);
+
+  dfuse_free_layouts(dif);
 
   if (!dfuse_will_reset) {
     dfu_abort_to_idle(dif);
   }
 
+  return ret;
+}
+
+/* Ends a DfuSe session, leaving DFU mode if requested */
+void dfuse_finish(struct dfu_if *dif) {
   if (dfuse_leave)
     dfuse_do_leave(dif);
-
-  return ret;
 }
 
 /* Check if we have one interface, possibly multiple alternate interfaces */
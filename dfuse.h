@@ -23,12 +23,33 @@
 
 #include "dfu.h"
 
-enum dfuse_command { SET_ADDRESS, ERASE_PAGE, MASS_ERASE, READ_UNPROTECT };
+enum dfuse_command {
+	SET_ADDRESS,
+	ERASE_PAGE,
+	MASS_ERASE,
+	READ_UNPROTECT,
+	CRC32
+};
 
-int dfuse_do_upload(struct dfu_if *dif, int xfer_size, int fd,
-		    const char *dfuse_options);
-int dfuse_do_dnload(struct dfu_if *dif, int xfer_size, struct dfu_file *file,
-		    const char *dfuse_options);
+/* Address range, in the selected alternate setting if alt is -1 */
+struct dfuse_range {
+	int alt;
+	unsigned int address;
+	unsigned int length;
+};
+
+extern int dfuse_verify;
+
+void dfuse_parse_options(const char *options);
+void dfuse_add_upload_range(const char *spec);
+int dfuse_num_upload_ranges(void);
+int dfuse_do_upload(struct dfu_if *dif, int xfer_size, int fd);
+int dfuse_do_upload_ranges(struct dfu_if *dif, int xfer_size, int fd,
+			   const char *file_name);
+int dfuse_do_dump_all(struct dfu_if *dif, int xfer_size, int fd);
+int dfuse_do_dnload(struct dfu_if *dif, int xfer_size, int upload_xfer_size,
+		    struct dfu_file *file);
+void dfuse_finish(struct dfu_if *dif);
 int dfuse_multiple_alt(struct dfu_if *dfu_root);
 
 #endif /* DFUSE_H */
@@ -67,12 +67,11 @@ struct memsegment *find_segment(struct memsegment *segment_list,
 void free_segment_list(struct memsegment *segment_list) {
   struct memsegment *next_element;
 
-  while (segment_list->next != NULL) {
+  while (segment_list != NULL) {
     next_element = segment_list->next;
     free(segment_list);
     segment_list = next_element;
   }
-  free(segment_list);
 }
 
 /* Parse memory map from interface descriptor string
@@ -39,12 +39,17 @@
 #include <string.h>
 
 #include "dfu.h"
+#include "dfu_cache.h"
+#include "dfu_engine.h"
 #include "dfu_file.h"
 #include "dfu_load.h"
 #include "dfu_util.h"
 #include "dfuse.h"
 #include "portable.h"
 
+/* Exit status of --skip-if-same when nothing had to be written */
+#define EX_SAME_IMAGE 2
+
 int verbose = 0;
 
 struct dfu_if *dfu_root = NULL;
@@ -187,11 +192,43 @@ static void help(void) {
       stderr,
       "  -t --transfer-size <size>\tSpecify the number of bytes per USB "
       "Transfer\n"
+      "  -u --upload-transfer-size <size>\tBytes per USB Transfer on upload\n"
+      "  -b --download-transfer-size <size>\tBytes per USB Transfer on "
+      "download\n"
       "  -U --upload <file>\t\tRead firmware from device into <file>\n"
+      "\t\t\t\t(before any download in the same session)\n"
       "  -Z --upload-size <bytes>\tSpecify the expected upload size in bytes\n"
+      "  -r --upload-range [<alt>:]<address>+<length>\n"
+      "\t\t\t\tAdd a DfuSe range to upload (repeatable)\n"
+      "  -A --dump-all <file>\t\tRead all readable DfuSe memory into <file>\n"
+      "  -y --verify\t\t\tRead back and compare after DfuSe download\n"
+      "  -Q --resume\t\t\tResume an interrupted download, keeping a\n"
+      "\t\t\t\tjournal in <file>.resume\n"
+      "  -H --sparse\t\t\tStore erased (0xff) blocks of an upload as\n"
+      "\t\t\t\tholes, listed in <file>.holes so that a\n"
+      "\t\t\t\tdownload reads them back as 0xff\n"
       "  -D --download <file>\t\tWrite firmware from <file> into device\n"
+      "\t\t\t\t(ELF, Intel HEX and S-record files are written\n"
+      "\t\t\t\tsegment by segment to DfuSe devices,\n"
+      "\t\t\t\t.gz, .zst and .xz files are unpacked,\n"
+      "\t\t\t\tthe whole image is held in memory)\n"
+      "  -I --image\t\t\tParse the download file as ELF, Intel HEX or\n"
+      "\t\t\t\tS-record image whatever its name\n"
+      "  -z --unpack\t\t\tUnpack a gzip, zstd or xz compressed download\n"
+      "\t\t\t\tfile whatever its name\n"
+      "  -x --raw\t\t\tWrite the download file as it is, without\n"
+      "\t\t\t\tparsing or unpacking it\n"
+      "  -k --skip-if-same\t\tDo not download if the device already holds\n"
+      "\t\t\t\tthe image, exit with status 2 instead\n"
       "  -R --reset\t\t\tIssue USB Reset signalling once we're finished\n"
       "  -w --wait\t\t\tWait for device to appear\n"
+      "  -T --retries <count>\t\tRetries of a block after a USB error "
+      "(default 3)\n"
+      "  -M --multi\t\t\tDownload to all matching DFU mode devices\n"
+      "\t\t\t\tat once (plain DFU only, without resume,\n"
+      "\t\t\t\tskip or verify)\n"
+      "  -C --cache\t\t\tCache descriptor strings, DfuSe layouts and\n"
+      "\t\t\t\terase timings in $XDG_CACHE_HOME/dfu-util\n"
       "  -s --dfuse-address address<:...>\tST DfuSe mode string, specifying "
       "target\n"
       "\t\t\t\taddress for raw file download or upload (not\n"
@@ -199,6 +236,17 @@ static void help(void) {
       "\t\t\t\tAdd more DfuSe options separated with ':'\n"
       "\t\tleave\t\tLeave DFU mode (jump to application)\n"
       "\t\tmass-erase\tErase the whole device (requires \"force\")\n"
+      "\t\tauto-erase\tUse mass erase when faster than page erases\n"
+      "\t\t\t\t(erasing outside the image requires \"force\")\n"
+      "\t\tkeep=<address>+<length>[@<alt>]\tNever mass erase this range\n"
+      "\t\tblank-check\tSkip erasing pages that are already blank\n"
+      "\t\t\t\t(trusts the device CRC32 command if present,\n"
+      "\t\t\t\tadd --verify to catch a CRC32 collision)\n"
+      "\t\terase-time=<ms>\tTime per page erase for auto-erase\n"
+      "\t\tmass-erase-time=<ms>\tTime of mass erase for auto-erase\n"
+      "\t\tflash-transfer-size=<size>\tDownload transfer size into flash\n"
+      "\t\tram-transfer-size=<size>\tDownload transfer size into other "
+      "memory\n"
       "\t\tunprotect\tErase read protected device (requires \"force\")\n"
       "\t\twill-reset\tExpect device to reset (e.g. option bytes write)\n"
       "\t\tforce\t\tYou really know what you are doing!\n"
@@ -213,6 +261,37 @@ static void print_version(void) {
          "Please report bugs to " PACKAGE_BUGREPORT "\n\n");
 }
 
+/* Reads firmware from the device into a newly created file */
+static int upload_to_file(const char *name, int use_dfuse, int dump_all,
+                          int transfer_size, int expected_size) {
+  int fd;
+  int ret;
+
+  /* open for "exclusive" writing */
+  fd = open(name, O_WRONLY | O_BINARY | O_CREAT | O_EXCL | O_TRUNC, 0666);
+  if (fd < 0) {
+    warn("Cannot open file %s for writing", name);
+    return EX_CANTCREAT;
+  }
+
+  if (dfuse_num_upload_ranges() || dump_all) {
+    if (!use_dfuse)
+      errx(EX_USAGE, "Upload ranges require a DfuSe device");
+    if (dump_all)
+      ret = dfuse_do_dump_all(dfu_root, transfer_size, fd);
+    else
+      ret = dfuse_do_upload_ranges(dfu_root, transfer_size, fd, name);
+  } else if (use_dfuse) {
+    ret = dfuse_do_upload(dfu_root, transfer_size, fd);
+  } else {
+    ret = dfuload_do_upload(dfu_root, transfer_size, expected_size, fd);
+  }
+  dfu_file_sparse_finish(fd, name);
+  close(fd);
+
+  return ret < 0 ? EX_IOERR : EX_OK;
+}
+
 static const struct option opts[] = {
     {"help", 0, 0, 'h'},          {"version", 0, 0, 'V'},
     {"verbose", 0, 0, 'v'},       {"list", 0, 0, 'l'},
@@ -222,14 +301,24 @@ static const struct option opts[] = {
     {"interface", 1, 0, 'i'},     {"intf", 1, 0, 'i'},
     {"altsetting", 1, 0, 'a'},    {"alt", 1, 0, 'a'},
     {"serial", 1, 0, 'S'},        {"transfer-size", 1, 0, 't'},
+    {"upload-transfer-size", 1, 0, 'u'},
+    {"download-transfer-size", 1, 0, 'b'},
     {"upload", 1, 0, 'U'},        {"upload-size", 1, 0, 'Z'},
-    {"download", 1, 0, 'D'},      {"reset", 0, 0, 'R'},
-    {"dfuse-address", 1, 0, 's'}, {"devnum", 1, 0, 'n'},
-    {"wait", 1, 0, 'w'},          {0, 0, 0, 0}};
+    {"upload-range", 1, 0, 'r'},  {"dump-all", 1, 0, 'A'},
+    {"sparse", 0, 0, 'H'},        {"resume", 0, 0, 'Q'},
+    {"verify", 0, 0, 'y'},        {"download", 1, 0, 'D'},
+    {"reset", 0, 0, 'R'},         {"dfuse-address", 1, 0, 's'},
+    {"devnum", 1, 0, 'n'},        {"wait", 1, 0, 'w'},
+    {"cache", 0, 0, 'C'},         {"multi", 0, 0, 'M'},
+    {"retries", 1, 0, 'T'},       {"skip-if-same", 0, 0, 'k'},
+    {"image", 0, 0, 'I'},         {"unpack", 0, 0, 'z'},
+    {"raw", 0, 0, 'x'},           {0, 0, 0, 0}};
 
 int main(int argc, char **argv) {
   int expected_size = 0;
   unsigned int transfer_size = 0;
+  unsigned int upload_transfer_size = 0;
+  unsigned int download_transfer_size = 0;
   enum mode mode = MODE_NONE;
   struct dfu_status status;
   libusb_context *ctx;
@@ -239,20 +328,26 @@ int main(int argc, char **argv) {
   int wait_device = 0;
   int ret;
   int dfuse_device = 0;
-  int fd;
+  int dump_all = 0;
+  int multi_device = 0;
+  int same_image;
+  const char *upload_name = NULL;
   const char *dfuse_options = NULL;
   int detach_delay = 5;
   uint16_t runtime_vendor;
   uint16_t runtime_product;
 
   memset(&file, 0, sizeof(file));
+  /* compressed files and images are told from raw binaries by name */
+  dfu_file_uncompress = DETECT_BY_NAME;
+  /* or by contents, for images on DfuSe devices */
+  dfu_file_parse_images = DETECT_BY_NAME;
 
-  /* make sure all prints are flushed */
-  setvbuf(stdout, NULL, _IONBF, 0);
+  dfu_setup_output();
 
   while (1) {
     int c, option_index = 0;
-    c = getopt_long(argc, argv, "hVvleE:d:p:c:i:a:S:t:U:D:Rs:Z:wn:", opts,
+    c = getopt_long(argc, argv, "hVvleE:d:p:c:i:a:S:t:u:b:U:A:HQyD:IRzxs:Z:r:wCMT:n:k", opts,
                     &option_index);
     if (c == -1)
       break;
@@ -313,17 +408,48 @@ int main(int argc, char **argv) {
     case 't':
       transfer_size = parse_number("transfer-size", optarg);
       break;
+    case 'u':
+      upload_transfer_size = parse_number("upload-transfer-size", optarg);
+      break;
+    case 'b':
+      download_transfer_size = parse_number("download-transfer-size", optarg);
+      break;
     case 'U':
-      mode = MODE_UPLOAD;
-      file.name = optarg;
+      upload_name = optarg;
+      break;
+    case 'A':
+      upload_name = optarg;
+      dump_all = 1;
+      break;
+    case 'H':
+      dfu_file_sparse = 1;
+      break;
+    case 'Q':
+      dfu_file_resume = 1;
+      break;
+    case 'y':
+      dfuse_verify = 1;
       break;
     case 'Z':
       expected_size = parse_number("upload-size", optarg);
       break;
+    case 'r':
+      dfuse_add_upload_range(optarg);
+      break;
     case 'D':
       mode = MODE_DOWNLOAD;
       file.name = optarg;
       break;
+    case 'I':
+      dfu_file_parse_images = DETECT_ALWAYS;
+      break;
+    case 'z':
+      dfu_file_uncompress = DETECT_ALWAYS;
+      break;
+    case 'x':
+      dfu_file_parse_images = DETECT_NEVER;
+      dfu_file_uncompress = DETECT_NEVER;
+      break;
     case 'R':
       final_reset = 1;
       break;
@@ -333,12 +459,33 @@ int main(int argc, char **argv) {
     case 'w':
       wait_device = 1;
       break;
+    case 'C':
+      dfu_cache_enabled = 1;
+      break;
+    case 'M':
+      multi_device = 1;
+      break;
+    case 'T':
+      dfu_retry_limit = parse_number("retries", optarg);
+      break;
+    case 'k':
+      dfu_skip_if_same = 1;
+      break;
     default:
       help();
       exit(EX_USAGE);
       break;
     }
   }
+  /* with -D as well, the upload runs first in the same session */
+  if (upload_name && mode == MODE_NONE)
+    mode = MODE_UPLOAD;
+
+  if (multi_device && (mode != MODE_DOWNLOAD || upload_name ||
+                       dfu_file_resume || dfuse_options || final_reset ||
+                       dfu_skip_if_same))
+    errx(EX_USAGE, "--multi only supports a plain DFU download");
+
   if (optind != argc) {
     fprintf(stderr, "Error: Unexpected argument: %s\n\n", argv[optind]);
     help();
@@ -425,8 +572,36 @@ probe:
       libusb_exit(ctx);
       return EX_IOERR;
     }
+  } else if (multi_device) {
+    struct dfu_if *pdfu;
+
+    if (file.segments)
+      errx(EX_USAGE, "Images with load addresses need a DfuSe device, "
+                     "use --raw to write the file as it is");
+    for (pdfu = dfu_root; pdfu; pdfu = pdfu->next) {
+      if ((file.idVendor != 0xffff && file.idVendor != pdfu->vendor) ||
+          (file.idProduct != 0xffff && file.idProduct != pdfu->product))
+        errx(EX_USAGE,
+             "Error: File ID %04x:%04x does not match device "
+             "%03i:%03i (%04x:%04x)",
+             file.idVendor, file.idProduct, pdfu->busnum, pdfu->devnum,
+             pdfu->vendor, pdfu->product);
+    }
+    ret = dfu_engine_dnload(ctx, dfu_root,
+                            download_transfer_size ? download_transfer_size
+                                                   : transfer_size,
+                            &file);
+    if (dfu_retry_count)
+      printf("Recovered from transient USB errors with %u retries\n",
+             dfu_retry_count);
+    disconnect_devices();
+    libusb_exit(ctx);
+    return ret < 0 ? EX_IOERR : EX_OK;
   } else if (file.bcdDFU == 0x11a && dfuse_multiple_alt(dfu_root)) {
     printf("Multiple alternate interfaces for DfuSe file\n");
+  } else if (upload_name && (dfuse_num_upload_ranges() || dump_all) &&
+             dfuse_multiple_alt(dfu_root)) {
+    printf("Multiple alternate interfaces for upload ranges\n");
   } else if (dfu_root->next != NULL) {
     /* We cannot safely support more than one DFU capable device
      * with same vendor/product ID, since during DFU we need to do
@@ -645,6 +820,14 @@ status_again:
     goto status_again;
     break;
   case DFU_STATE_dfuDNLOAD_IDLE:
+    /* a plain DFU download can only be resumed in this state */
+    if (dfu_file_resume && mode == MODE_DOWNLOAD &&
+        dfu_root->func_dfu.bcdDFUVersion != libusb_cpu_to_le16(0x11a) &&
+        status.bStatus == DFU_STATUS_OK) {
+      printf("Keeping previous incomplete transfer for resume\n");
+      break;
+    }
+    /* fall through */
   case DFU_STATE_dfuUPLOAD_IDLE:
     printf("Aborting previous incomplete transfer\n");
     if (dfu_abort(dfu_root->dev_handle, dfu_root->interface) < 0) {
@@ -683,49 +866,42 @@ status_again:
       libusb_le16_to_cpu(dfu_root->func_dfu.wTransferSize);
   if (func_dfu_transfer_size) {
     printf("Device returned transfer size %i\n", func_dfu_transfer_size);
+    if (transfer_size || upload_transfer_size || download_transfer_size)
+      printf("Warning: Overriding device-reported transfer size\n");
     if (!transfer_size)
       transfer_size = func_dfu_transfer_size;
-    else
-      printf("Warning: Overriding device-reported transfer size\n");
   } else {
-    if (!transfer_size)
+    if (!transfer_size && !(upload_transfer_size && download_transfer_size))
       errx(EX_USAGE, "Transfer size must be specified");
   }
 
-#ifdef __linux__
-  /* limited to 4k in libusb Linux backend */
-  if ((int)transfer_size > 4096) {
-    transfer_size = 4096;
-    printf("Limited transfer size to %i\n", transfer_size);
+  /* bootloaders often read faster with larger transfers than they write */
+  if (!upload_transfer_size)
+    upload_transfer_size = transfer_size;
+  if (!download_transfer_size)
+    download_transfer_size = transfer_size;
+  if (upload_transfer_size == download_transfer_size) {
+    upload_transfer_size =
+        dfu_limit_transfer_size(dfu_root, "", upload_transfer_size);
+    download_transfer_size = upload_transfer_size;
+  } else {
+    upload_transfer_size =
+        dfu_limit_transfer_size(dfu_root, "upload ", upload_transfer_size);
+    download_transfer_size =
+        dfu_limit_transfer_size(dfu_root, "download ", download_transfer_size);
   }
-#endif /* __linux__ */
 
-  if (transfer_size < dfu_root->bMaxPacketSize0) {
-    transfer_size = dfu_root->bMaxPacketSize0;
-    printf("Adjusted transfer size to %i\n", transfer_size);
-  }
+  /* parsed once for all operations of the session */
+  if (dfuse_options)
+    dfuse_parse_options(dfuse_options);
+
 
   switch (mode) {
   case MODE_UPLOAD:
-    /* open for "exclusive" writing */
-    fd =
-        open(file.name, O_WRONLY | O_BINARY | O_CREAT | O_EXCL | O_TRUNC, 0666);
-    if (fd < 0) {
-      warn("Cannot open file %s for writing", file.name);
-      ret = EX_CANTCREAT;
-      break;
-    }
-
-    if (dfuse_device || dfuse_options) {
-      ret = dfuse_do_upload(dfu_root, transfer_size, fd, dfuse_options);
-    } else {
-      ret = dfuload_do_upload(dfu_root, transfer_size, expected_size, fd);
-    }
-    close(fd);
-    if (ret < 0)
-      ret = EX_IOERR;
-    else
-      ret = EX_OK;
+    ret = upload_to_file(upload_name, dfuse_device || dfuse_options, dump_all,
+                         upload_transfer_size, expected_size);
+    if (ret == EX_OK && (dfuse_device || dfuse_options))
+      dfuse_finish(dfu_root);
     break;
 
   case MODE_DOWNLOAD:
@@ -739,13 +915,33 @@ status_again:
            file.idVendor, file.idProduct, runtime_vendor, runtime_product,
            dfu_root->vendor, dfu_root->product);
     }
+    if (upload_name) {
+      printf("Backing up device before download\n");
+      ret = upload_to_file(upload_name, dfuse_device || dfuse_options,
+                           dump_all, upload_transfer_size, expected_size);
+      if (ret != EX_OK)
+        break;
+    }
     if (dfuse_device || dfuse_options || file.bcdDFU == 0x11a) {
-      ret = dfuse_do_dnload(dfu_root, transfer_size, &file, dfuse_options);
+      ret = dfuse_do_dnload(dfu_root, download_transfer_size,
+                            upload_transfer_size, &file);
+      dfuse_finish(dfu_root);
     } else {
-      ret = dfuload_do_dnload(dfu_root, transfer_size, &file);
+      if (file.segments)
+        errx(EX_USAGE, "Images with load addresses need a DfuSe device, "
+                       "use --raw to write the file as it is");
+      if (dfuse_verify)
+        warnx("Verify is only supported on DfuSe devices");
+      ret = dfuload_do_dnload(dfu_root, download_transfer_size,
+                              upload_transfer_size, &file);
     }
+    if (dfu_retry_count)
+      printf("Recovered from transient USB errors with %u retries\n",
+             dfu_retry_count);
     if (ret < 0)
       ret = EX_IOERR;
+    else if (ret == DFU_IMAGE_ON_DEVICE)
+      ret = EX_SAME_IMAGE;
     else
       ret = EX_OK;
     break;
@@ -763,7 +959,9 @@ status_again:
     break;
   }
 
-  if (!ret && final_reset) {
+  /* a device that was left as it is still gets its reset */
+  same_image = ret == EX_SAME_IMAGE;
+  if ((!ret || same_image) && final_reset) {
     ret = dfu_detach(dfu_root->dev_handle, dfu_root->interface, 1000);
     if (ret < 0) {
       /* Even if detach failed, just carry on to leave the
@@ -776,6 +974,8 @@ status_again:
       warnx("error resetting after download: %s", libusb_error_name(ret));
       ret = EX_IOERR;
     }
+    if (same_image && ret != EX_IOERR)
+      ret = EX_SAME_IMAGE;
   }
 
   libusb_close(dfu_root->dev_handle);
@@ -38,6 +38,12 @@ enum mode { MODE_NONE, MODE_ADD, MODE_DEL, MODE_CHECK };
 
 int verbose;
 
+/* What to do with each file, from the command line */
+static enum mode mode = MODE_NONE;
+static enum prefix_type type = ZERO_PREFIX;
+static uint32_t lmdfu_flash_address = 0;
+static int batch = 0;
+
 static void help(void) {
   fprintf(stderr, "Usage: dfu-prefix [options] ...\n"
                   "  -h --help\t\t\tPrint this help message\n"
@@ -52,7 +58,9 @@ static void help(void) {
           "In combination with -D or -c:\n"
           "  -T --stellaris\t\tAct on TI Stellaris address prefix of <file>\n"
           "In combination with -a or -D or -c:\n"
-          "  -L --lpc-prefix\t\tUse NXP LPC DFU prefix format\n");
+          "  -L --lpc-prefix\t\tUse NXP LPC DFU prefix format\n"
+          "  -B --batch\t\t\t<file> is a directory or a list of files,\n"
+          "\t\t\t\thandled in parallel, one line printed per file\n");
 }
 
 static void print_version(void) {
@@ -72,16 +80,60 @@ static struct option opts[] = {{"help", 0, 0, 'h'},
                                {"stellaris-address", 1, 0, 's'},
                                {"stellaris", 0, 0, 'T'},
                                {"LPC", 0, 0, 'L'},
+                               {"batch", 0, 0, 'B'},
                                {0, 0, 0, 0}};
+
+static void process_file(struct dfu_file *file) {
+  switch (mode) {
+  case MODE_ADD:
+    if (type == ZERO_PREFIX)
+      errx(EX_USAGE, "Prefix type must be specified");
+    dfu_load_file(file, MAYBE_SUFFIX, NO_PREFIX);
+    file->lmdfu_address = lmdfu_flash_address;
+    file->prefix_type = type;
+    if (!batch)
+      printf("Adding prefix to file\n");
+    dfu_store_file(file, file->size.suffix != 0, 1);
+    if (batch)
+      printf("%s: %s prefix added\n", file->name,
+             type == LMDFU_PREFIX ? "stellaris" : "lpc");
+    break;
+
+  case MODE_CHECK:
+    /* the prefix is all there is to check, no need to load the file */
+    dfu_scan_file(file, MAYBE_SUFFIX, MAYBE_PREFIX);
+    if (batch)
+      dfu_file_summary(file);
+    else
+      show_suffix_and_prefix(file);
+    if (type > ZERO_PREFIX && file->prefix_type != type)
+      errx(EX_DATAERR, "No prefix of requested type");
+    break;
+
+  case MODE_DEL:
+    dfu_load_file(file, MAYBE_SUFFIX, NEEDS_PREFIX);
+    if (type > ZERO_PREFIX && file->prefix_type != type)
+      errx(EX_DATAERR, "No prefix of requested type");
+    if (!batch)
+      printf("Removing prefix from file\n");
+    /* if there was a suffix, rewrite it */
+    dfu_store_file(file, file->size.suffix != 0, 0);
+    if (batch)
+      printf("%s: prefix removed\n", file->name);
+    break;
+
+  default:
+    help();
+    exit(EX_USAGE);
+    break;
+  }
+}
+
 int main(int argc, char **argv) {
   struct dfu_file file;
-  enum mode mode = MODE_NONE;
-  enum prefix_type type = ZERO_PREFIX;
-  uint32_t lmdfu_flash_address = 0;
   char *end;
 
-  /* make sure all prints are flushed */
-  setvbuf(stdout, NULL, _IONBF, 0);
+  dfu_setup_output();
 
   print_version();
 
@@ -89,7 +141,7 @@ int main(int argc, char **argv) {
 
   while (1) {
     int c, option_index = 0;
-    c = getopt_long(argc, argv, "hVc:a:D:p:v:d:s:TL", opts, &option_index);
+    c = getopt_long(argc, argv, "hVc:a:D:p:v:d:s:TLB", opts, &option_index);
     if (c == -1)
       break;
 
@@ -128,6 +180,9 @@ int main(int argc, char **argv) {
     case 'L':
       type = LPCDFU_UNENCRYPTED_PREFIX;
       break;
+    case 'B':
+      batch = 1;
+      break;
     default:
       help();
       exit(EX_USAGE);
@@ -141,37 +196,15 @@ int main(int argc, char **argv) {
     exit(EX_USAGE);
   }
 
-  switch (mode) {
-  case MODE_ADD:
-    if (type == ZERO_PREFIX)
-      errx(EX_USAGE, "Prefix type must be specified");
-    dfu_load_file(&file, MAYBE_SUFFIX, NO_PREFIX);
-    file.lmdfu_address = lmdfu_flash_address;
-    file.prefix_type = type;
-    printf("Adding prefix to file\n");
-    dfu_store_file(&file, file.size.suffix != 0, 1);
-    break;
-
-  case MODE_CHECK:
-    dfu_load_file(&file, MAYBE_SUFFIX, MAYBE_PREFIX);
-    show_suffix_and_prefix(&file);
-    if (type > ZERO_PREFIX && file.prefix_type != type)
-      errx(EX_DATAERR, "No prefix of requested type");
-    break;
-
-  case MODE_DEL:
-    dfu_load_file(&file, MAYBE_SUFFIX, NEEDS_PREFIX);
-    if (type > ZERO_PREFIX && file.prefix_type != type)
-      errx(EX_DATAERR, "No prefix of requested type");
-    printf("Removing prefix from file\n");
-    /* if there was a suffix, rewrite it */
-    dfu_store_file(&file, file.size.suffix != 0, 0);
-    break;
-
-  default:
-    help();
-    exit(EX_USAGE);
-    break;
+  if (batch) {
+    if (mode == MODE_NONE) {
+      help();
+      exit(EX_USAGE);
+    }
+    if (dfu_file_batch(file.name, process_file))
+      exit(EX_DATAERR);
+  } else {
+    process_file(&file);
   }
   return EX_OK;
 }
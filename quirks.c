@@ -66,6 +66,12 @@ uint16_t get_quirks(uint16_t vendor, uint16_t product, uint16_t bcdDevice) {
     quirks |= QUIRK_DFUSE_LEAVE;
   }
 
+  /* The TAS1020b needs some time after the last download request before
+   * we can obtain the status. Its product ID is set by the firmware, so
+   * any TI device gets the delay, but only once per download */
+  if (vendor == VENDOR_TI)
+    quirks |= QUIRK_MANIFEST_DELAY;
+
   return (quirks);
 }
 
@@ -11,6 +11,7 @@
 #define VENDOR_SIEMENS          0x0908 /* Siemens AG */
 #define VENDOR_MIDIMAN          0x0763 /* Midiman */
 #define VENDOR_GIGADEVICE       0x28e9 /* GigaDevice */
+#define VENDOR_TI               0x0451 /* Texas Instruments */
 
 #define PRODUCT_FREERUNNER_FIRST 0x5117
 #define PRODUCT_FREERUNNER_LAST  0x5126
@@ -28,10 +29,14 @@
 #define QUIRK_UTF8_SERIAL  (1<<2)
 #define QUIRK_DFUSE_LAYOUT (1<<3)
 #define QUIRK_DFUSE_LEAVE  (1<<4)
+#define QUIRK_MANIFEST_DELAY (1<<5)
 
 /* Fallback value, works for OpenMoko */
 #define DEFAULT_POLLTIMEOUT  5
 
+/* Delay before the first status request of manifestation */
+#define MANIFEST_DELAY  1000
+
 uint16_t get_quirks(uint16_t vendor, uint16_t product, uint16_t bcdDevice);
 void fixup_dfuse_layout(struct dfu_if *dif, struct memsegment **segment_list);
 
@@ -37,6 +37,11 @@ enum mode { MODE_NONE, MODE_ADD, MODE_DEL, MODE_CHECK };
 
 int verbose;
 
+/* What to do with each file, from the command line */
+static enum mode mode = MODE_NONE;
+static int pid, vid, did, spec;
+static int batch = 0;
+
 static void help(void) {
   fprintf(stderr,
           "Usage: dfu-suffix [options] ...\n"
@@ -49,7 +54,9 @@ static void help(void) {
           "  -v --vid <vendorID>\t\tAdd vendor ID into DFU suffix in <file>\n"
           "  -d --did <deviceID>\t\tAdd device ID into DFU suffix in <file>\n"
           "  -S --spec <specID>\t\tAdd DFU specification ID into DFU suffix in "
-          "<file>\n");
+          "<file>\n"
+          "  -B --batch\t\t\t<file> is a directory or a list of files,\n"
+          "\t\t\t\thandled in parallel, one line printed per file\n");
 }
 
 static void print_version(void) {
@@ -64,15 +71,58 @@ static struct option opts[] = {{"help", 0, 0, 'h'},   {"version", 0, 0, 'V'},
                                {"check", 1, 0, 'c'},  {"add", 1, 0, 'a'},
                                {"delete", 1, 0, 'D'}, {"pid", 1, 0, 'p'},
                                {"vid", 1, 0, 'v'},    {"did", 1, 0, 'd'},
-                               {"spec", 1, 0, 'S'},   {0, 0, 0, 0}};
+                               {"spec", 1, 0, 'S'},   {"batch", 0, 0, 'B'},
+                               {0, 0, 0, 0}};
+
+static void process_file(struct dfu_file *file) {
+  int had_suffix;
+
+  switch (mode) {
+  case MODE_ADD:
+    dfu_scan_file(file, NO_SUFFIX, MAYBE_PREFIX);
+    file->idVendor = vid;
+    file->idProduct = pid;
+    file->bcdDevice = did;
+    file->bcdDFU = spec;
+    /* always write suffix, rewrite prefix if there was one */
+    dfu_update_suffix(file, 1);
+    if (batch)
+      dfu_file_summary(file);
+    else
+      printf("Suffix successfully added to file\n");
+    break;
+
+  case MODE_CHECK:
+    dfu_scan_file(file, NEEDS_SUFFIX, MAYBE_PREFIX);
+    if (batch)
+      dfu_file_summary(file);
+    else
+      show_suffix_and_prefix(file);
+    break;
+
+  case MODE_DEL:
+    dfu_scan_file(file, NEEDS_SUFFIX, MAYBE_PREFIX);
+    had_suffix = file->size.suffix != 0;
+    /* report the removed suffix like the add and check modes do */
+    if (batch)
+      printf("%s: suffix removed, CRC 0x%08X VID 0x%04X PID 0x%04X\n",
+             file->name, file->dwCRC, file->idVendor, file->idProduct);
+    dfu_update_suffix(file, 0);
+    if (!batch && had_suffix)
+      printf("Suffix successfully removed from file\n");
+    break;
+
+  default:
+    help();
+    exit(EX_USAGE);
+    break;
+  }
+}
 
 int main(int argc, char **argv) {
   struct dfu_file file;
-  int pid, vid, did, spec;
-  enum mode mode = MODE_NONE;
 
-  /* make sure all prints are flushed */
-  setvbuf(stdout, NULL, _IONBF, 0);
+  dfu_setup_output();
 
   print_version();
 
@@ -82,7 +132,7 @@ int main(int argc, char **argv) {
 
   while (1) {
     int c, option_index = 0;
-    c = getopt_long(argc, argv, "hVc:a:D:p:v:d:S:s:T", opts, &option_index);
+    c = getopt_long(argc, argv, "hVc:a:D:p:v:d:S:s:TB", opts, &option_index);
     if (c == -1)
       break;
 
@@ -118,6 +168,9 @@ int main(int argc, char **argv) {
       file.name = optarg;
       mode = MODE_ADD;
       break;
+    case 'B':
+      batch = 1;
+      break;
     default:
       help();
       exit(EX_USAGE);
@@ -137,34 +190,15 @@ int main(int argc, char **argv) {
     exit(EX_USAGE);
   }
 
-  switch (mode) {
-  case MODE_ADD:
-    dfu_load_file(&file, NO_SUFFIX, MAYBE_PREFIX);
-    file.idVendor = vid;
-    file.idProduct = pid;
-    file.bcdDevice = did;
-    file.bcdDFU = spec;
-    /* always write suffix, rewrite prefix if there was one */
-    dfu_store_file(&file, 1, file.size.prefix != 0);
-    printf("Suffix successfully added to file\n");
-    break;
-
-  case MODE_CHECK:
-    dfu_load_file(&file, NEEDS_SUFFIX, MAYBE_PREFIX);
-    show_suffix_and_prefix(&file);
-    break;
-
-  case MODE_DEL:
-    dfu_load_file(&file, NEEDS_SUFFIX, MAYBE_PREFIX);
-    dfu_store_file(&file, 0, file.size.prefix != 0);
-    if (file.size.suffix) /* had a suffix */
-      printf("Suffix successfully removed from file\n");
-    break;
-
-  default:
-    help();
-    exit(EX_USAGE);
-    break;
+  if (batch) {
+    if (mode == MODE_NONE) {
+      help();
+      exit(EX_USAGE);
+    }
+    if (dfu_file_batch(file.name, process_file))
+      exit(EX_DATAERR);
+  } else {
+    process_file(&file);
   }
   return EX_OK;
 }
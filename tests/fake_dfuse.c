@@ -0,0 +1,826 @@
+/*
+ * Simulated DfuSe device for the tests
+ *
+ * Implements the libusb calls dfu-util makes on top of STM32 style DfuSe
+ * devices with 512 KiB of flash, so the download, upload and verify paths
+ * can be exercised without hardware.
+ *
+ * Behaviour is selected with environment variables:
+ *   FAKE_DFUSE_FLASH    file keeping the flash contents between runs, with
+ *                       ".2", ".3" ... appended for the further devices
+ *   FAKE_DFUSE_CRC      advertise and implement the 0xb1 CRC32 command
+ *   FAKE_DFUSE_CORRUPT  address of a flash byte that is flipped when written
+ *   FAKE_DFUSE_LOG      file the DfuSe commands, uploads and string
+ *                       descriptor reads are logged to
+ *   FAKE_DFUSE_DEVICES  number of devices, serials SIM00001, SIM00002 ...
+ *   FAKE_DFUSE_PLAIN    plain DFU 1.1 devices writing from offset 0
+ *   FAKE_DFUSE_FLAKY    every n-th status request after a data block
+ *                       times out
+ *   FAKE_DFUSE_NO_UPLOAD  uploads of memory stall
+ *   FAKE_DFUSE_UNPLUG   number of blocks written before the device is
+ *                       unplugged
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libusb.h"
+
+#define XFER_SIZE 2048
+#define FLASH_BASE 0x08000000
+#define FLASH_SIZE 0x80000
+#define MAX_DEVICES 4
+
+#define DFUSE_CMD_GET_COMMAND 0x00
+#define DFUSE_CMD_SET_ADDRESS 0x21
+#define DFUSE_CMD_ERASE 0x41
+#define DFUSE_CMD_READ_UNPROTECT 0x92
+#define DFUSE_CMD_CRC32 0xb1
+
+/* DFU states and status codes used here */
+#define STATE_DFU_IDLE 2
+#define STATE_DFU_DNLOAD_SYNC 3
+#define STATE_DFU_DNBUSY 4
+#define STATE_DFU_DNLOAD_IDLE 5
+#define STATE_DFU_MANIFEST_SYNC 6
+#define STATE_DFU_MANIFEST 7
+#define STATE_DFU_MANIFEST_WAIT_RST 8
+#define STATE_DFU_UPLOAD_IDLE 9
+#define STATE_DFU_ERROR 10
+#define STATUS_OK 0x00
+#define STATUS_ERR_WRITE 0x03
+#define STATUS_ERR_VERIFY 0x07
+#define STATUS_ERR_ADDRESS 0x08
+#define STATUS_ERR_STALLEDPKT 0x0f
+
+struct libusb_device {
+  int index;
+  char serial_name[9];
+  unsigned char flash[FLASH_SIZE];
+  int state;
+  int status;
+  int detached;
+  uint32_t address_pointer;
+  uint32_t crc_result;
+  uint32_t plain_offset;
+
+  /* last DNLOAD, executed on the GETSTATUS that follows it */
+  unsigned char pending[4096];
+  int pending_len;
+  int pending_block;
+  int pending_valid;
+};
+
+struct libusb_device_handle {
+  struct libusb_device *dev;
+};
+
+struct page_range {
+  uint32_t start;
+  uint32_t end;
+  uint32_t page_size;
+};
+
+static struct libusb_device devices[MAX_DEVICES];
+static struct libusb_device_handle handles[MAX_DEVICES];
+static int num_devices = 1;
+static const struct libusb_version version = {1, 0, 26, 0, "", ""};
+
+static const char dfuse_alt_name[] =
+    "@Internal Flash  /0x08000000/04*016Kg,01*064Kg,03*128Kg";
+static const char plain_alt_name[] = "Flash";
+static const struct page_range pages[] = {
+    {0x08000000, 0x0800ffff, 16384},
+    {0x08010000, 0x0801ffff, 65536},
+    {0x08020000, 0x0807ffff, 131072},
+};
+
+/* DFU functional descriptor: DfuSe 1.1a or DFU 1.1, 2048 byte transfers */
+static unsigned char func_desc[9] = {
+    9, 0x21, 0x0b, 0xff, 0x00, XFER_SIZE & 0xff, XFER_SIZE >> 8, 0x1a, 0x01};
+static struct libusb_interface_descriptor alt_desc;
+static struct libusb_interface interface_desc;
+static struct libusb_config_descriptor config_desc;
+
+static const char *flash_file;
+static FILE *log_file;
+static int plain_dfu;
+static int crc_command;
+static int corrupt_set;
+static uint32_t corrupt_address;
+static int flaky_every;
+static int status_requests;
+static int no_upload;
+static int unplug_after;
+
+static struct libusb_transfer *queue[64];
+static int queued;
+
+static void sim_log(const char *format, uint32_t a, uint32_t b) {
+  if (!log_file)
+    return;
+  fprintf(log_file, format, a, b);
+  fputc('\n', log_file);
+  fflush(log_file);
+}
+
+static uint32_t get_quad(const unsigned char *p) {
+  return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void put_quad(unsigned char *p, uint32_t x) {
+  p[0] = x;
+  p[1] = x >> 8;
+  p[2] = x >> 16;
+  p[3] = x >> 24;
+}
+
+static uint32_t crc32(const unsigned char *p, uint32_t size) {
+  uint32_t crc = 0xffffffff;
+  int bit;
+
+  while (size--) {
+    crc ^= *p++;
+    for (bit = 0; bit < 8; bit++)
+      crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+  }
+  return crc;
+}
+
+static unsigned char *flash_at(struct libusb_device *d, uint32_t address,
+                               uint32_t size) {
+  if (address < FLASH_BASE || size > FLASH_SIZE ||
+      address - FLASH_BASE > FLASH_SIZE - size)
+    return NULL;
+  return d->flash + (address - FLASH_BASE);
+}
+
+/* The first device uses FAKE_DFUSE_FLASH itself */
+static void flash_name(struct libusb_device *d, char *name, size_t size) {
+  if (d->index == 0)
+    snprintf(name, size, "%s", flash_file);
+  else
+    snprintf(name, size, "%s.%i", flash_file, d->index + 1);
+}
+
+static void save_flash(void) {
+  char name[4096];
+  FILE *f;
+  int i;
+
+  for (i = 0; flash_file && i < num_devices; i++) {
+    flash_name(&devices[i], name, sizeof(name));
+    if ((f = fopen(name, "wb"))) {
+      fwrite(devices[i].flash, 1, FLASH_SIZE, f);
+      fclose(f);
+    }
+  }
+  if (log_file)
+    fclose(log_file);
+}
+
+static void load_flash(void) {
+  char name[4096];
+  const char *s;
+  FILE *f;
+  int i;
+
+  flash_file = getenv("FAKE_DFUSE_FLASH");
+  if ((s = getenv("FAKE_DFUSE_DEVICES")))
+    num_devices = atoi(s);
+  if (num_devices < 1 || num_devices > MAX_DEVICES)
+    num_devices = 1;
+  for (i = 0; i < num_devices; i++) {
+    struct libusb_device *d = &devices[i];
+
+    d->index = i;
+    snprintf(d->serial_name, sizeof(d->serial_name), "SIM%05i", i + 1);
+    d->state = STATE_DFU_IDLE;
+    d->status = STATUS_OK;
+    handles[i].dev = d;
+    memset(d->flash, 0xff, FLASH_SIZE);
+    if (!flash_file)
+      continue;
+    flash_name(d, name, sizeof(name));
+    if ((f = fopen(name, "rb"))) {
+      if (fread(d->flash, 1, FLASH_SIZE, f) != FLASH_SIZE)
+        fprintf(stderr, "fake_dfuse: short flash file %s\n", name);
+      fclose(f);
+    }
+  }
+  plain_dfu = getenv("FAKE_DFUSE_PLAIN") != NULL;
+  if (plain_dfu) {
+    func_desc[7] = 0x10;
+    func_desc[8] = 0x01;
+  }
+  crc_command = getenv("FAKE_DFUSE_CRC") != NULL;
+  if ((s = getenv("FAKE_DFUSE_CORRUPT"))) {
+    corrupt_set = 1;
+    corrupt_address = strtoul(s, NULL, 0);
+  }
+  if ((s = getenv("FAKE_DFUSE_FLAKY")))
+    flaky_every = atoi(s);
+  no_upload = getenv("FAKE_DFUSE_NO_UPLOAD") != NULL;
+  if ((s = getenv("FAKE_DFUSE_UNPLUG")))
+    unplug_after = atoi(s);
+  if ((s = getenv("FAKE_DFUSE_LOG")))
+    log_file = fopen(s, "a");
+  atexit(save_flash);
+}
+
+static void set_error(struct libusb_device *d, int error_status) {
+  d->status = error_status;
+  d->state = STATE_DFU_ERROR;
+}
+
+static void execute_command(struct libusb_device *d) {
+  uint32_t address = get_quad(d->pending + 1);
+  unsigned char *mem;
+  int i;
+
+  if (d->pending[0] == DFUSE_CMD_SET_ADDRESS && d->pending_len == 5) {
+    d->address_pointer = address;
+    sim_log("set-address 0x%08x", address, 0);
+  } else if (d->pending[0] == DFUSE_CMD_ERASE && d->pending_len == 1) {
+    memset(d->flash, 0xff, FLASH_SIZE);
+    sim_log("mass-erase", 0, 0);
+  } else if (d->pending[0] == DFUSE_CMD_ERASE && d->pending_len == 5) {
+    for (i = 0; i < (int)(sizeof(pages) / sizeof(pages[0])); i++)
+      if (address >= pages[i].start && address <= pages[i].end)
+        break;
+    if (i == (int)(sizeof(pages) / sizeof(pages[0]))) {
+      set_error(d, STATUS_ERR_ADDRESS);
+      return;
+    }
+    address -= (address - pages[i].start) % pages[i].page_size;
+    memset(flash_at(d, address, pages[i].page_size), 0xff,
+           pages[i].page_size);
+    sim_log("erase 0x%08x", address, 0);
+  } else if (d->pending[0] == DFUSE_CMD_CRC32 && d->pending_len == 9 &&
+             crc_command) {
+    uint32_t size = get_quad(d->pending + 5);
+
+    mem = flash_at(d, address, size);
+    if (!mem) {
+      set_error(d, STATUS_ERR_ADDRESS);
+      return;
+    }
+    d->crc_result = crc32(mem, size);
+    sim_log("crc32 0x%08x %u", address, size);
+  } else {
+    set_error(d, STATUS_ERR_STALLEDPKT);
+  }
+}
+
+static void execute_write(struct libusb_device *d) {
+  uint32_t address;
+  unsigned char *mem;
+  int i;
+
+  /* a plain DFU device erases on its own and writes the blocks in order */
+  if (plain_dfu)
+    address = FLASH_BASE + d->plain_offset;
+  else
+    address = d->address_pointer + (d->pending_block - 2) * XFER_SIZE;
+  mem = flash_at(d, address, d->pending_len);
+  if (!mem) {
+    set_error(d, STATUS_ERR_ADDRESS);
+    return;
+  }
+  for (i = 0; i < d->pending_len; i++) {
+    /* flash bits can only be cleared */
+    if (!plain_dfu && (mem[i] & d->pending[i]) != d->pending[i]) {
+      set_error(d, STATUS_ERR_WRITE);
+      return;
+    }
+    mem[i] = d->pending[i];
+    if (corrupt_set && address + i == corrupt_address)
+      mem[i] ^= 0x5a;
+  }
+  d->plain_offset += d->pending_len;
+  sim_log("write 0x%08x %u", address, d->pending_len);
+  if (unplug_after && !--unplug_after) {
+    sim_log("unplug", 0, 0);
+    d->detached = 1;
+  }
+}
+
+static int dfu_dnload(struct libusb_device *d, uint16_t block,
+                      unsigned char *data, uint16_t length) {
+  if (d->state != STATE_DFU_IDLE && d->state != STATE_DFU_DNLOAD_IDLE) {
+    set_error(d, STATUS_ERR_STALLEDPKT);
+    return LIBUSB_ERROR_PIPE;
+  }
+  if (length == 0) {
+    d->state = STATE_DFU_MANIFEST_SYNC;
+    return 0;
+  }
+  if (length > sizeof(d->pending)) {
+    set_error(d, STATUS_ERR_STALLEDPKT);
+    return LIBUSB_ERROR_PIPE;
+  }
+  if (plain_dfu && d->state == STATE_DFU_IDLE) {
+    memset(d->flash, 0xff, FLASH_SIZE);
+    d->plain_offset = 0;
+  }
+  memcpy(d->pending, data, length);
+  d->pending_len = length;
+  d->pending_block = block;
+  d->pending_valid = 1;
+  d->state = STATE_DFU_DNLOAD_SYNC;
+  return length;
+}
+
+static int plain_upload(struct libusb_device *d, uint16_t block,
+                        unsigned char *data, uint16_t length) {
+  uint32_t offset = (uint32_t)block * length;
+
+  if (offset >= FLASH_SIZE) {
+    d->state = STATE_DFU_IDLE;
+    return 0;
+  }
+  /* a short frame ends the upload */
+  if (length > FLASH_SIZE - offset) {
+    length = FLASH_SIZE - offset;
+    d->state = STATE_DFU_IDLE;
+  }
+  memcpy(data, d->flash + offset, length);
+  sim_log("upload 0x%08x %u", FLASH_BASE + offset, length);
+  return length;
+}
+
+static int dfu_upload(struct libusb_device *d, uint16_t block,
+                      unsigned char *data, uint16_t length) {
+  unsigned char *mem;
+  int n = 0;
+
+  if (d->state != STATE_DFU_IDLE && d->state != STATE_DFU_UPLOAD_IDLE) {
+    set_error(d, STATUS_ERR_STALLEDPKT);
+    return LIBUSB_ERROR_PIPE;
+  }
+  /* memory that refuses to be read, commands still work */
+  if (no_upload && (plain_dfu || block >= 2)) {
+    sim_log("upload-stall", 0, 0);
+    set_error(d, STATUS_ERR_STALLEDPKT);
+    return LIBUSB_ERROR_PIPE;
+  }
+  d->state = STATE_DFU_UPLOAD_IDLE;
+  if (plain_dfu)
+    return plain_upload(d, block, data, length);
+  if (block == 0) {
+    unsigned char commands[5];
+
+    commands[n++] = DFUSE_CMD_GET_COMMAND;
+    commands[n++] = DFUSE_CMD_SET_ADDRESS;
+    commands[n++] = DFUSE_CMD_ERASE;
+    commands[n++] = DFUSE_CMD_READ_UNPROTECT;
+    if (crc_command)
+      commands[n++] = DFUSE_CMD_CRC32;
+    if (n > length)
+      n = length;
+    memcpy(data, commands, n);
+    sim_log("get-command", 0, 0);
+    return n;
+  }
+  if (block == 1) {
+    if (!crc_command || length < 4) {
+      set_error(d, STATUS_ERR_STALLEDPKT);
+      return LIBUSB_ERROR_PIPE;
+    }
+    put_quad(data, d->crc_result);
+    sim_log("crc32-result 0x%08x", d->crc_result, 0);
+    return 4;
+  }
+  mem = flash_at(d, d->address_pointer + (block - 2) * XFER_SIZE, length);
+  if (!mem) {
+    set_error(d, STATUS_ERR_ADDRESS);
+    return LIBUSB_ERROR_PIPE;
+  }
+  memcpy(data, mem, length);
+  sim_log("upload 0x%08x %u", d->address_pointer + (block - 2) * XFER_SIZE,
+          length);
+  return length;
+}
+
+static int dfu_getstatus(struct libusb_device *d, unsigned char *data) {
+  int poll_timeout = 0;
+
+  if (flaky_every && d->pending_valid && (plain_dfu || d->pending_block >= 2) &&
+      ++status_requests % flaky_every == 0) {
+    sim_log("status-timeout", 0, 0);
+    return LIBUSB_ERROR_TIMEOUT;
+  }
+
+  switch (d->state) {
+  case STATE_DFU_DNLOAD_SYNC:
+    d->state = STATE_DFU_DNBUSY;
+    poll_timeout = 1;
+    break;
+  case STATE_DFU_DNBUSY:
+    d->state = STATE_DFU_DNLOAD_IDLE;
+    if (d->pending_valid && d->pending_block == 0 && !plain_dfu)
+      execute_command(d);
+    else if (d->pending_valid)
+      execute_write(d);
+    d->pending_valid = 0;
+    break;
+  case STATE_DFU_MANIFEST_SYNC:
+    d->state = STATE_DFU_MANIFEST;
+    /* leaving DFU mode, the DfuSe device is gone after this answer */
+    if (!plain_dfu)
+      d->detached = 1;
+    break;
+  case STATE_DFU_MANIFEST:
+    /* the plain device is not manifestation tolerant */
+    d->state = STATE_DFU_MANIFEST_WAIT_RST;
+    break;
+  default:
+    break;
+  }
+  data[0] = d->status;
+  data[1] = poll_timeout;
+  data[2] = 0;
+  data[3] = 0;
+  data[4] = d->state;
+  data[5] = 0;
+  return 6;
+}
+
+static int string_descriptor(struct libusb_device *d, uint8_t index,
+                             unsigned char *data, uint16_t length) {
+  const char *s;
+  int n;
+  int i;
+
+  if (index == 0) {
+    if (length < 4)
+      return LIBUSB_ERROR_OVERFLOW;
+    data[0] = 4;
+    data[1] = LIBUSB_DT_STRING;
+    data[2] = 0x09;
+    data[3] = 0x04;
+    return 4;
+  }
+  sim_log("string %u", index, 0);
+  if (index == 1)
+    s = d->serial_name;
+  else if (index == 2)
+    s = plain_dfu ? plain_alt_name : dfuse_alt_name;
+  else
+    return LIBUSB_ERROR_PIPE;
+
+  n = strlen(s);
+  if (2 + 2 * n > length)
+    n = (length - 2) / 2;
+  data[0] = 2 + 2 * n;
+  data[1] = LIBUSB_DT_STRING;
+  for (i = 0; i < n; i++) {
+    data[2 + 2 * i] = s[i];
+    data[3 + 2 * i] = 0;
+  }
+  return 2 + 2 * n;
+}
+
+static int control(struct libusb_device *d, uint8_t request_type,
+                   uint8_t request, uint16_t value, unsigned char *data,
+                   uint16_t length) {
+  if (d->detached)
+    return LIBUSB_ERROR_NO_DEVICE;
+
+  if ((request_type & 0x60) == LIBUSB_REQUEST_TYPE_STANDARD) {
+    if (request == LIBUSB_REQUEST_GET_DESCRIPTOR &&
+        value >> 8 == LIBUSB_DT_STRING)
+      return string_descriptor(d, value & 0xff, data, length);
+    return LIBUSB_ERROR_PIPE;
+  }
+
+  switch (request) {
+  case 0: /* DETACH */
+    return 0;
+  case 1: /* DNLOAD */
+    return dfu_dnload(d, value, data, length);
+  case 2: /* UPLOAD */
+    return dfu_upload(d, value, data, length);
+  case 3: /* GETSTATUS */
+    return dfu_getstatus(d, data);
+  case 4: /* CLRSTATUS */
+    d->state = STATE_DFU_IDLE;
+    d->status = STATUS_OK;
+    return 0;
+  case 5: /* GETSTATE */
+    data[0] = d->state;
+    return 1;
+  case 6: /* ABORT */
+    if (d->state == STATE_DFU_ERROR)
+      return LIBUSB_ERROR_PIPE;
+    d->state = STATE_DFU_IDLE;
+    d->pending_valid = 0;
+    return 0;
+  }
+  return LIBUSB_ERROR_PIPE;
+}
+
+int libusb_init(libusb_context **ctx) {
+  *ctx = (libusb_context *)&devices[0];
+  load_flash();
+  return 0;
+}
+
+void libusb_exit(libusb_context *ctx) { (void)ctx; }
+
+int libusb_set_option(libusb_context *ctx, int option, ...) {
+  (void)ctx;
+  (void)option;
+  return 0;
+}
+
+void libusb_set_debug(libusb_context *ctx, int level) {
+  (void)ctx;
+  (void)level;
+}
+
+const struct libusb_version *libusb_get_version(void) { return &version; }
+
+const char *libusb_error_name(int errcode) {
+  switch (errcode) {
+  case LIBUSB_ERROR_NO_DEVICE:
+    return "LIBUSB_ERROR_NO_DEVICE";
+  case LIBUSB_ERROR_NOT_FOUND:
+    return "LIBUSB_ERROR_NOT_FOUND";
+  case LIBUSB_ERROR_TIMEOUT:
+    return "LIBUSB_ERROR_TIMEOUT";
+  case LIBUSB_ERROR_PIPE:
+    return "LIBUSB_ERROR_PIPE";
+  default:
+    return "LIBUSB_ERROR_OTHER";
+  }
+}
+
+ssize_t libusb_get_device_list(libusb_context *ctx, libusb_device ***list) {
+  int n = 0;
+  int i;
+
+  (void)ctx;
+  *list = calloc(MAX_DEVICES + 1, sizeof(**list));
+  if (!*list)
+    return LIBUSB_ERROR_NO_MEM;
+  for (i = 0; i < num_devices; i++) {
+    if (!devices[i].detached)
+      (*list)[n++] = &devices[i];
+  }
+  return n;
+}
+
+void libusb_free_device_list(libusb_device **list, int unref_devices) {
+  (void)unref_devices;
+  free(list);
+}
+
+libusb_device *libusb_ref_device(libusb_device *dev) { return dev; }
+
+void libusb_unref_device(libusb_device *dev) { (void)dev; }
+
+int libusb_get_device_descriptor(libusb_device *dev,
+                                 struct libusb_device_descriptor *desc) {
+  memset(desc, 0, sizeof(*desc));
+  desc->bLength = 18;
+  desc->bDescriptorType = LIBUSB_DT_DEVICE;
+  desc->bcdUSB = 0x0200;
+  desc->bMaxPacketSize0 = 64;
+  desc->idVendor = 0x0483;
+  desc->idProduct = 0xdf11;
+  desc->bcdDevice = 0x2200;
+  desc->iSerialNumber = 1;
+  desc->bNumConfigurations = 1;
+  return 0;
+}
+
+int libusb_get_config_descriptor(libusb_device *dev, uint8_t config_index,
+                                 struct libusb_config_descriptor **config) {
+  (void)dev;
+  if (config_index != 0)
+    return LIBUSB_ERROR_NOT_FOUND;
+  alt_desc.bLength = 9;
+  alt_desc.bDescriptorType = 4;
+  alt_desc.bInterfaceClass = 0xfe;
+  alt_desc.bInterfaceSubClass = 1;
+  alt_desc.bInterfaceProtocol = 2;
+  alt_desc.iInterface = 2;
+  alt_desc.extra = func_desc;
+  alt_desc.extra_length = sizeof(func_desc);
+  interface_desc.altsetting = &alt_desc;
+  interface_desc.num_altsetting = 1;
+  config_desc.bNumInterfaces = 1;
+  config_desc.bConfigurationValue = 1;
+  config_desc.interface = &interface_desc;
+  *config = &config_desc;
+  return 0;
+}
+
+void libusb_free_config_descriptor(struct libusb_config_descriptor *config) {
+  (void)config;
+}
+
+uint8_t libusb_get_bus_number(libusb_device *dev) {
+  (void)dev;
+  return 1;
+}
+
+uint8_t libusb_get_device_address(libusb_device *dev) {
+  return 5 + dev->index;
+}
+
+int libusb_get_port_numbers(libusb_device *dev, uint8_t *port_numbers,
+                            int port_numbers_len) {
+  if (port_numbers_len < 1)
+    return LIBUSB_ERROR_OVERFLOW;
+  port_numbers[0] = 1 + dev->index;
+  return 1;
+}
+
+int libusb_open(libusb_device *dev, libusb_device_handle **dev_handle) {
+  *dev_handle = &handles[dev->index];
+  return 0;
+}
+
+void libusb_close(libusb_device_handle *dev_handle) { (void)dev_handle; }
+
+libusb_device *libusb_get_device(libusb_device_handle *dev_handle) {
+  return dev_handle->dev;
+}
+
+int libusb_claim_interface(libusb_device_handle *dev_handle,
+                           int interface_number) {
+  (void)dev_handle;
+  (void)interface_number;
+  return 0;
+}
+
+int libusb_release_interface(libusb_device_handle *dev_handle,
+                             int interface_number) {
+  (void)dev_handle;
+  (void)interface_number;
+  return 0;
+}
+
+int libusb_set_interface_alt_setting(libusb_device_handle *dev_handle,
+                                     int interface_number,
+                                     int alternate_setting) {
+  (void)dev_handle;
+  (void)interface_number;
+  return alternate_setting == 0 ? 0 : LIBUSB_ERROR_NOT_FOUND;
+}
+
+int libusb_reset_device(libusb_device_handle *dev_handle) {
+  dev_handle->dev->detached = 1;
+  return LIBUSB_ERROR_NOT_FOUND;
+}
+
+int libusb_control_transfer(libusb_device_handle *dev_handle,
+                            uint8_t request_type, uint8_t bRequest,
+                            uint16_t wValue, uint16_t wIndex,
+                            unsigned char *data, uint16_t wLength,
+                            unsigned int timeout) {
+  (void)wIndex;
+  (void)timeout;
+  return control(dev_handle->dev, request_type, bRequest, wValue, data,
+                 wLength);
+}
+
+int libusb_get_descriptor(libusb_device_handle *dev, uint8_t desc_type,
+                          uint8_t desc_index, unsigned char *data,
+                          int length) {
+  (void)dev;
+  (void)desc_type;
+  (void)desc_index;
+  (void)data;
+  (void)length;
+  return LIBUSB_ERROR_PIPE;
+}
+
+int libusb_get_string_descriptor(libusb_device_handle *dev,
+                                 uint8_t desc_index, uint16_t langid,
+                                 unsigned char *data, int length) {
+  (void)langid;
+  return string_descriptor(dev->dev, desc_index, data, length);
+}
+
+/* Asynchronous transfers complete on the next event handling call */
+struct libusb_transfer *libusb_alloc_transfer(int iso_packets) {
+  (void)iso_packets;
+  return calloc(1, sizeof(struct libusb_transfer));
+}
+
+void libusb_free_transfer(struct libusb_transfer *transfer) {
+  if (transfer && (transfer->flags & LIBUSB_TRANSFER_FREE_BUFFER))
+    free(transfer->buffer);
+  free(transfer);
+}
+
+int libusb_submit_transfer(struct libusb_transfer *transfer) {
+  if (transfer->dev_handle->dev->detached)
+    return LIBUSB_ERROR_NO_DEVICE;
+  if (queued == (int)(sizeof(queue) / sizeof(queue[0])))
+    return LIBUSB_ERROR_BUSY;
+  queue[queued++] = transfer;
+  return 0;
+}
+
+int libusb_cancel_transfer(struct libusb_transfer *transfer) {
+  (void)transfer;
+  return LIBUSB_ERROR_NOT_FOUND;
+}
+
+void libusb_fill_control_setup(unsigned char *buffer, uint8_t bmRequestType,
+                               uint8_t bRequest, uint16_t wValue,
+                               uint16_t wIndex, uint16_t wLength) {
+  buffer[0] = bmRequestType;
+  buffer[1] = bRequest;
+  buffer[2] = wValue & 0xff;
+  buffer[3] = wValue >> 8;
+  buffer[4] = wIndex & 0xff;
+  buffer[5] = wIndex >> 8;
+  buffer[6] = wLength & 0xff;
+  buffer[7] = wLength >> 8;
+}
+
+void libusb_fill_control_transfer(struct libusb_transfer *transfer,
+                                  libusb_device_handle *dev_handle,
+                                  unsigned char *buffer,
+                                  libusb_transfer_cb_fn callback,
+                                  void *user_data, unsigned int timeout) {
+  transfer->dev_handle = dev_handle;
+  transfer->buffer = buffer;
+  transfer->callback = callback;
+  transfer->user_data = user_data;
+  transfer->timeout = timeout;
+  if (buffer)
+    transfer->length = LIBUSB_CONTROL_SETUP_SIZE + (buffer[6] | buffer[7] << 8);
+}
+
+unsigned char *libusb_control_transfer_get_data(struct libusb_transfer *transfer) {
+  return transfer->buffer + LIBUSB_CONTROL_SETUP_SIZE;
+}
+
+static int run_queue(void) {
+  struct libusb_transfer *batch[sizeof(queue) / sizeof(queue[0])];
+  int n = queued;
+  int i;
+
+  /* callbacks may submit new transfers */
+  memcpy(batch, queue, n * sizeof(batch[0]));
+  queued = 0;
+  for (i = 0; i < n; i++) {
+    struct libusb_transfer *transfer = batch[i];
+    unsigned char *setup = transfer->buffer;
+    int ret;
+
+    ret = control(transfer->dev_handle->dev, setup[0], setup[1],
+                  setup[2] | setup[3] << 8,
+                  setup + LIBUSB_CONTROL_SETUP_SIZE, setup[6] | setup[7] << 8);
+    transfer->actual_length = ret < 0 ? 0 : ret;
+    if (ret >= 0)
+      transfer->status = LIBUSB_TRANSFER_COMPLETED;
+    else if (ret == LIBUSB_ERROR_PIPE)
+      transfer->status = LIBUSB_TRANSFER_STALL;
+    else if (ret == LIBUSB_ERROR_NO_DEVICE)
+      transfer->status = LIBUSB_TRANSFER_NO_DEVICE;
+    else if (ret == LIBUSB_ERROR_TIMEOUT)
+      transfer->status = LIBUSB_TRANSFER_TIMED_OUT;
+    else
+      transfer->status = LIBUSB_TRANSFER_ERROR;
+    transfer->callback(transfer);
+  }
+  return 0;
+}
+
+int libusb_handle_events_timeout(libusb_context *ctx, struct timeval *tv) {
+  (void)ctx;
+  (void)tv;
+  return run_queue();
+}
+
+int libusb_handle_events_timeout_completed(libusb_context *ctx,
+                                           struct timeval *tv, int *completed) {
+  (void)ctx;
+  (void)tv;
+  (void)completed;
+  return run_queue();
+}
+
+int libusb_handle_events_completed(libusb_context *ctx, int *completed) {
+  (void)ctx;
+  (void)completed;
+  return run_queue();
+}
+
+int libusb_handle_events(libusb_context *ctx) {
+  (void)ctx;
+  return run_queue();
+}
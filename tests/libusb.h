@@ -0,0 +1,189 @@
+/*
+ * Minimal stand-in for <libusb.h>, declaring only what dfu-util uses.
+ * It lets the test build link against the simulated device in
+ * fake_dfuse.c instead of a real libusb and real hardware.
+ */
+
+#ifndef TESTS_LIBUSB_H
+#define TESTS_LIBUSB_H
+
+#include <stdint.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+#define LIBUSB_API_VERSION 0x01000109
+#define LIBUSB_CALL
+#define LIBUSB_CONTROL_SETUP_SIZE 8
+
+typedef struct libusb_context libusb_context;
+typedef struct libusb_device libusb_device;
+typedef struct libusb_device_handle libusb_device_handle;
+
+struct libusb_version {
+	uint16_t major, minor, micro, nano;
+	const char *rc;
+	const char *describe;
+};
+
+struct libusb_device_descriptor {
+	uint8_t bLength, bDescriptorType;
+	uint16_t bcdUSB;
+	uint8_t bDeviceClass, bDeviceSubClass, bDeviceProtocol;
+	uint8_t bMaxPacketSize0;
+	uint16_t idVendor, idProduct, bcdDevice;
+	uint8_t iManufacturer, iProduct, iSerialNumber;
+	uint8_t bNumConfigurations;
+};
+
+struct libusb_interface_descriptor {
+	uint8_t bLength, bDescriptorType;
+	uint8_t bInterfaceNumber, bAlternateSetting, bNumEndpoints;
+	uint8_t bInterfaceClass, bInterfaceSubClass, bInterfaceProtocol;
+	uint8_t iInterface;
+	const void *endpoint;
+	const unsigned char *extra;
+	int extra_length;
+};
+
+struct libusb_interface {
+	const struct libusb_interface_descriptor *altsetting;
+	int num_altsetting;
+};
+
+struct libusb_config_descriptor {
+	uint8_t bLength, bDescriptorType;
+	uint16_t wTotalLength;
+	uint8_t bNumInterfaces, bConfigurationValue, iConfiguration;
+	uint8_t bmAttributes, MaxPower;
+	const struct libusb_interface *interface;
+	const unsigned char *extra;
+	int extra_length;
+};
+
+enum libusb_error {
+	LIBUSB_SUCCESS = 0,
+	LIBUSB_ERROR_IO = -1,
+	LIBUSB_ERROR_INVALID_PARAM = -2,
+	LIBUSB_ERROR_ACCESS = -3,
+	LIBUSB_ERROR_NO_DEVICE = -4,
+	LIBUSB_ERROR_NOT_FOUND = -5,
+	LIBUSB_ERROR_BUSY = -6,
+	LIBUSB_ERROR_TIMEOUT = -7,
+	LIBUSB_ERROR_OVERFLOW = -8,
+	LIBUSB_ERROR_PIPE = -9,
+	LIBUSB_ERROR_INTERRUPTED = -10,
+	LIBUSB_ERROR_NO_MEM = -11,
+	LIBUSB_ERROR_NOT_SUPPORTED = -12,
+	LIBUSB_ERROR_OTHER = -99
+};
+
+enum { LIBUSB_ENDPOINT_OUT = 0x00, LIBUSB_ENDPOINT_IN = 0x80 };
+enum {
+	LIBUSB_REQUEST_TYPE_STANDARD = 0x00,
+	LIBUSB_REQUEST_TYPE_CLASS = 0x20,
+	LIBUSB_REQUEST_TYPE_VENDOR = 0x40
+};
+enum { LIBUSB_RECIPIENT_DEVICE = 0, LIBUSB_RECIPIENT_INTERFACE = 1 };
+enum { LIBUSB_DT_DEVICE = 1, LIBUSB_DT_CONFIG = 2, LIBUSB_DT_STRING = 3 };
+enum { LIBUSB_REQUEST_GET_DESCRIPTOR = 6 };
+enum { LIBUSB_OPTION_LOG_LEVEL = 0 };
+enum { LIBUSB_LOG_LEVEL_DEBUG = 4 };
+
+enum libusb_transfer_status {
+	LIBUSB_TRANSFER_COMPLETED,
+	LIBUSB_TRANSFER_ERROR,
+	LIBUSB_TRANSFER_TIMED_OUT,
+	LIBUSB_TRANSFER_CANCELLED,
+	LIBUSB_TRANSFER_STALL,
+	LIBUSB_TRANSFER_NO_DEVICE,
+	LIBUSB_TRANSFER_OVERFLOW
+};
+enum { LIBUSB_TRANSFER_FREE_BUFFER = 2, LIBUSB_TRANSFER_FREE_TRANSFER = 4 };
+
+struct libusb_transfer;
+typedef void (*libusb_transfer_cb_fn)(struct libusb_transfer *transfer);
+
+struct libusb_transfer {
+	libusb_device_handle *dev_handle;
+	uint8_t flags;
+	unsigned char endpoint;
+	unsigned char type;
+	unsigned int timeout;
+	enum libusb_transfer_status status;
+	int length;
+	int actual_length;
+	libusb_transfer_cb_fn callback;
+	void *user_data;
+	unsigned char *buffer;
+	int num_iso_packets;
+};
+
+struct libusb_control_setup {
+	uint8_t bmRequestType, bRequest;
+	uint16_t wValue, wIndex, wLength;
+};
+
+/* the simulated device runs on the host, so no byte swapping is needed */
+#define libusb_cpu_to_le16(x) ((uint16_t)(x))
+#define libusb_le16_to_cpu(x) ((uint16_t)(x))
+
+int libusb_init(libusb_context **ctx);
+void libusb_exit(libusb_context *ctx);
+int libusb_set_option(libusb_context *ctx, int option, ...);
+void libusb_set_debug(libusb_context *ctx, int level);
+const struct libusb_version *libusb_get_version(void);
+const char *libusb_error_name(int errcode);
+
+ssize_t libusb_get_device_list(libusb_context *ctx, libusb_device ***list);
+void libusb_free_device_list(libusb_device **list, int unref_devices);
+libusb_device *libusb_ref_device(libusb_device *dev);
+void libusb_unref_device(libusb_device *dev);
+int libusb_get_device_descriptor(libusb_device *dev,
+				 struct libusb_device_descriptor *desc);
+int libusb_get_config_descriptor(libusb_device *dev, uint8_t config_index,
+				 struct libusb_config_descriptor **config);
+void libusb_free_config_descriptor(struct libusb_config_descriptor *config);
+uint8_t libusb_get_bus_number(libusb_device *dev);
+uint8_t libusb_get_device_address(libusb_device *dev);
+int libusb_get_port_numbers(libusb_device *dev, uint8_t *port_numbers,
+			    int port_numbers_len);
+
+int libusb_open(libusb_device *dev, libusb_device_handle **dev_handle);
+void libusb_close(libusb_device_handle *dev_handle);
+libusb_device *libusb_get_device(libusb_device_handle *dev_handle);
+int libusb_claim_interface(libusb_device_handle *dev_handle, int interface_number);
+int libusb_release_interface(libusb_device_handle *dev_handle, int interface_number);
+int libusb_set_interface_alt_setting(libusb_device_handle *dev_handle,
+				     int interface_number, int alternate_setting);
+int libusb_reset_device(libusb_device_handle *dev_handle);
+
+int libusb_control_transfer(libusb_device_handle *dev_handle,
+			    uint8_t request_type, uint8_t bRequest,
+			    uint16_t wValue, uint16_t wIndex,
+			    unsigned char *data, uint16_t wLength,
+			    unsigned int timeout);
+int libusb_get_descriptor(libusb_device_handle *dev, uint8_t desc_type,
+			  uint8_t desc_index, unsigned char *data, int length);
+int libusb_get_string_descriptor(libusb_device_handle *dev, uint8_t desc_index,
+				 uint16_t langid, unsigned char *data, int length);
+
+struct libusb_transfer *libusb_alloc_transfer(int iso_packets);
+void libusb_free_transfer(struct libusb_transfer *transfer);
+int libusb_submit_transfer(struct libusb_transfer *transfer);
+int libusb_cancel_transfer(struct libusb_transfer *transfer);
+void libusb_fill_control_setup(unsigned char *buffer, uint8_t bmRequestType,
+			       uint8_t bRequest, uint16_t wValue,
+			       uint16_t wIndex, uint16_t wLength);
+void libusb_fill_control_transfer(struct libusb_transfer *transfer,
+				  libusb_device_handle *dev_handle,
+				  unsigned char *buffer,
+				  libusb_transfer_cb_fn callback,
+				  void *user_data, unsigned int timeout);
+unsigned char *libusb_control_transfer_get_data(struct libusb_transfer *transfer);
+int libusb_handle_events_timeout(libusb_context *ctx, struct timeval *tv);
+int libusb_handle_events_timeout_completed(libusb_context *ctx,
+					   struct timeval *tv, int *completed);
+int libusb_handle_events_completed(libusb_context *ctx, int *completed);
+int libusb_handle_events(libusb_context *ctx);
+
+#endif /* TESTS_LIBUSB_H */
@@ -0,0 +1,445 @@
+#!/bin/sh
+#
+# Runs dfu-util against the simulated DfuSe device in fake_dfuse.c
+#
+# Usage: [CC=...] [CFLAGS=...] [LIBS=...] tests/run-tests.sh
+#
+# Builds with -DHAVE_ZLIB, -DHAVE_ZSTD or -DHAVE_LZMA in CFLAGS are
+# expected to unpack the matching compressed images.
+#
+
+set -u
+
+top=$(cd "$(dirname "$0")/.." && pwd)
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT INT TERM
+
+CC=${CC:-cc}
+CFLAGS=${CFLAGS:-}
+LIBS=${LIBS:-}
+DFU_UTIL=$work/dfu-util
+SOURCES="main.c dfu_load.c dfu_util.c dfuse.c dfuse_mem.c dfu.c dfu_file.c \
+quirks.c dfu_cache.c dfu_engine.c"
+
+failures=0
+
+fail() {
+	echo "FAIL: $1"
+	failures=$((failures + 1))
+}
+
+pass() {
+	echo "PASS: $1"
+}
+
+# run_dfu <name> <expected exit status> [dfu-util arguments...]
+run_dfu() {
+	name=$1
+	expected=$2
+	shift 2
+	: >"$work/log"
+	FAKE_DFUSE_FLASH=$work/flash FAKE_DFUSE_LOG=$work/log \
+		"$DFU_UTIL" "$@" >"$work/out" 2>&1
+	status=$?
+	if [ "$status" -ne "$expected" ]; then
+		fail "$name: exit status $status, expected $expected"
+		sed 's/^/    /' "$work/out"
+		return 1
+	fi
+	return 0
+}
+
+expect_output() {
+	grep -q -- "$2" "$work/out" || { fail "$1: no '$2' in output"; return 1; }
+}
+
+expect_log() {
+	grep -q -- "$2" "$work/log" || { fail "$1: device did not see '$2'"; return 1; }
+}
+
+expect_no_log() {
+	! grep -q -- "$2" "$work/log" || { fail "$1: device saw '$2'"; return 1; }
+}
+
+(cd "$top" && $CC -DHAVE_CONFIG_H -I"$top/tests" $CFLAGS -o "$DFU_UTIL" \
+	$SOURCES tests/fake_dfuse.c $LIBS) || { echo "FAIL: build"; exit 1; }
+
+# 40000 bytes: several transfers, ending in the middle of one
+head -c 40000 /dev/urandom >"$work/image.bin"
+size=40000
+
+t="CRC32 command detected with Get Command and used for verify"
+rm -f "$work/flash"
+if FAKE_DFUSE_CRC=1 run_dfu "$t" 0 -v -a 0 -s 0x08000000 -y \
+	-D "$work/image.bin"; then
+	expect_output "$t" "Device supports CRC32 command" &&
+	expect_output "$t" "Verified $size bytes" &&
+	expect_log "$t" "get-command" &&
+	expect_log "$t" "crc32 0x08000000 $size" &&
+	expect_log "$t" "crc32-result" &&
+	expect_no_log "$t" "upload" && pass "$t"
+fi
+
+t="CRC32 command compares an image already on the device"
+if FAKE_DFUSE_CRC=1 run_dfu "$t" 2 -a 0 -s 0x08000000 -k \
+	-D "$work/image.bin"; then
+	expect_log "$t" "crc32 0x08000000 $size" &&
+	expect_no_log "$t" "upload" &&
+	expect_no_log "$t" "write" && pass "$t"
+fi
+
+t="skip-if-same downloads when the device cannot be read back"
+rm -f "$work/flash"
+if FAKE_DFUSE_NO_UPLOAD=1 run_dfu "$t" 0 -a 0 -s 0x08000000 -k \
+	-D "$work/image.bin"; then
+	expect_output "$t" "Cannot read back the device, downloading" &&
+	expect_log "$t" "upload-stall" &&
+	expect_log "$t" "write 0x08000000" && pass "$t"
+fi
+
+t="plain DFU skip-if-same downloads when the device cannot be read back"
+rm -f "$work/flash"
+if FAKE_DFUSE_PLAIN=1 FAKE_DFUSE_NO_UPLOAD=1 run_dfu "$t" 0 -k \
+	-D "$work/image.bin"; then
+	expect_output "$t" "Cannot read back the device, downloading" &&
+	expect_log "$t" "upload-stall" &&
+	{ head -c $size "$work/flash" | cmp -s - "$work/image.bin" &&
+		pass "$t" || fail "$t: flash differs from the image"; }
+fi
+
+t="device without CRC32 command is verified by reading back"
+rm -f "$work/flash"
+if run_dfu "$t" 0 -v -a 0 -s 0x08000000 -y -D "$work/image.bin"; then
+	expect_output "$t" "Device does not support CRC32 command" &&
+	expect_output "$t" "Verified $size bytes" &&
+	expect_log "$t" "get-command" &&
+	expect_no_log "$t" "crc32" &&
+	expect_log "$t" "upload 0x08000000" && pass "$t"
+fi
+
+t="upload returns the downloaded image"
+if run_dfu "$t" 0 -a 0 -s 0x08000000:$size -U "$work/upload.bin"; then
+	cmp -s "$work/image.bin" "$work/upload.bin" && pass "$t" ||
+		fail "$t: uploaded image differs"
+fi
+
+# expect_unpacked <format> <compressor> <build flag>
+expect_unpacked() {
+	format=$1
+	compressor=$2
+	flag=$3
+	t="$format compressed image"
+	$compressor -c "$work/image.bin" >"$work/image.$format"
+	rm -f "$work/flash"
+	run_dfu "$t" 0 -a 0 -s 0x08000000 -D "$work/image.$format" || return
+	case " $CFLAGS " in
+	*" $flag "*)
+		unpacked=$work/image.bin
+		t="$t is unpacked";;
+	*)
+		unpacked=$work/image.$format
+		t="$t is loaded as raw data"
+		expect_output "$t" "loading it as raw data" || return;;
+	esac
+	rm -f "$work/upload.bin"
+	run_dfu "$t" 0 -a 0 -s 0x08000000:$(wc -c <"$unpacked") \
+		-U "$work/upload.bin" || return
+	cmp -s "$unpacked" "$work/upload.bin" && pass "$t" ||
+		fail "$t: uploaded image differs"
+}
+
+expect_unpacked gz gzip -DHAVE_ZLIB
+command -v xz >/dev/null && expect_unpacked xz xz -DHAVE_LZMA
+command -v zstd >/dev/null && expect_unpacked zst zstd -DHAVE_ZSTD
+
+t="raw image starting with a gzip magic is written as it is"
+{ printf '\037\213\010'; cat "$work/image.bin"; } >"$work/magic.bin"
+rm -f "$work/flash" "$work/upload.bin"
+if run_dfu "$t" 0 -a 0 -s 0x08000000 -D "$work/magic.bin" &&
+	run_dfu "$t" 0 -a 0 -s 0x08000000:$((size + 3)) -U "$work/upload.bin"; then
+	cmp -s "$work/magic.bin" "$work/upload.bin" && pass "$t" ||
+		fail "$t: uploaded image differs"
+fi
+
+case " $CFLAGS " in
+*" -DHAVE_ZLIB "*)
+	t="--unpack unpacks a compressed file whatever its name"
+	gzip -c "$work/image.bin" >"$work/image.packed"
+	rm -f "$work/flash" "$work/upload.bin"
+	if run_dfu "$t" 0 -a 0 -s 0x08000000 -z -D "$work/image.packed" &&
+		run_dfu "$t" 0 -a 0 -s 0x08000000:$size -U "$work/upload.bin"; then
+		cmp -s "$work/image.bin" "$work/upload.bin" && pass "$t" ||
+			fail "$t: uploaded image differs"
+	fi;;
+esac
+
+# le <bytes> <value>: little endian integer
+le() {
+	i=0
+	while [ $i -lt "$1" ]; do
+		printf "\\$(printf %03o $((($2 >> (8 * i)) & 255)))"
+		i=$((i + 1))
+	done
+}
+
+# expect_image <name> <file>
+expect_image() {
+	t=$1
+	image=$2
+	rm -f "$work/flash" "$work/upload.bin"
+	run_dfu "$t" 0 -v -a 0 -D "$image" || return
+	expect_output "$t" "Segment at 0x08000000, size $size" || return
+	run_dfu "$t" 0 -a 0 -s 0x08000000:$size -U "$work/upload.bin" || return
+	cmp -s "$work/image.bin" "$work/upload.bin" && pass "$t" ||
+		fail "$t: uploaded image differs"
+}
+
+# ELF32 executable with one PT_LOAD program header at 0x08000000
+{
+	printf '\177ELF\001\001\001'; le 9 0
+	le 2 2; le 2 40; le 4 1; le 4 0x08000000; le 4 52; le 4 0; le 4 0
+	le 2 52; le 2 32; le 2 1; le 2 0; le 2 0; le 2 0
+	le 4 1; le 4 84; le 4 0x08000000; le 4 0x08000000
+	le 4 $size; le 4 $size; le 4 5; le 4 4
+	cat "$work/image.bin"
+} >"$work/image.elf"
+expect_image "ELF image is written at its load address" "$work/image.elf"
+cp "$work/image.elf" "$work/image.firmware"
+expect_image "ELF image named like a raw binary is parsed for DfuSe" \
+	"$work/image.firmware"
+
+if command -v objcopy >/dev/null; then
+	objcopy -I binary -O ihex --change-addresses 0x08000000 \
+		"$work/image.bin" "$work/image.hex"
+	objcopy -I binary -O srec --change-addresses 0x08000000 \
+		"$work/image.bin" "$work/image.srec"
+	expect_image "Intel HEX image is written at its load address" \
+		"$work/image.hex"
+	expect_image "S-record image is written at its load address" \
+		"$work/image.srec"
+
+	t="Intel HEX image without an end of file record is refused"
+	sed '$d' "$work/image.hex" >"$work/truncated.hex"
+	if run_dfu "$t" 65 -a 0 -D "$work/truncated.hex"; then
+		expect_output "$t" "ends without an end of file record" &&
+		expect_no_log "$t" "write" && pass "$t"
+	fi
+
+	t="Intel HEX address record with a wrong length is refused"
+	{ echo ":03000004080000F1"; cat "$work/image.hex"; } >"$work/bad.hex"
+	if run_dfu "$t" 65 -a 0 -D "$work/bad.hex"; then
+		expect_output "$t" "Bad Intel HEX address record in line 1" &&
+		expect_no_log "$t" "write" && pass "$t"
+	fi
+
+	t="--raw writes an image file as it is to a plain DFU device"
+	rm -f "$work/flash"
+	if FAKE_DFUSE_PLAIN=1 run_dfu "$t" 64 -D "$work/image.hex" &&
+		expect_output "$t" "use --raw" &&
+		FAKE_DFUSE_PLAIN=1 run_dfu "$t" 0 -x -D "$work/image.hex"; then
+		head -c $(wc -c <"$work/image.hex") "$work/flash" |
+			cmp -s - "$work/image.hex" && pass "$t" ||
+			fail "$t: flash differs from the file"
+	fi
+fi
+
+t="sparse upload stores erased blocks as holes and reads them back"
+rm -f "$work/flash" "$work/full.bin" "$work/sparse.bin" "$work/again.bin"
+if run_dfu "$t" 0 -a 0 -s 0x08000000 -D "$work/image.bin" &&
+	run_dfu "$t" 0 -a 0 -s 0x08000000:0x40000 -U "$work/full.bin" &&
+	run_dfu "$t" 0 -a 0 -s 0x08000000:0x40000 -H -U "$work/sparse.bin"; then
+	if [ ! -f "$work/sparse.bin.holes" ]; then
+		fail "$t: no hole list written"
+	else
+		rm -f "$work/flash"
+		run_dfu "$t" 0 -a 0 -s 0x08000000 -D "$work/sparse.bin" &&
+		run_dfu "$t" 0 -a 0 -s 0x08000000:0x40000 -U "$work/again.bin" &&
+		{ cmp -s "$work/full.bin" "$work/again.bin" && pass "$t" ||
+			fail "$t: downloaded sparse upload differs"; }
+	fi
+fi
+
+t="holes without a hole list stay zeros"
+rm -f "$work/flash" "$work/sparse.bin.holes" "$work/again.bin"
+if run_dfu "$t" 0 -a 0 -s 0x08000000 -D "$work/sparse.bin" &&
+	run_dfu "$t" 0 -a 0 -s 0x08000000:0x40000 -U "$work/again.bin"; then
+	cmp -s "$work/sparse.bin" "$work/again.bin" && pass "$t" ||
+		fail "$t: holes were filled in"
+fi
+
+t="plain DFU download retries status requests that time out"
+rm -f "$work/flash"*
+if FAKE_DFUSE_PLAIN=1 FAKE_DFUSE_FLAKY=5 run_dfu "$t" 0 -D "$work/image.bin"; then
+	expect_output "$t" "retrying" &&
+	expect_output "$t" "Resetting USB" &&
+	expect_log "$t" "status-timeout" &&
+	{ head -c $size "$work/flash" | cmp -s - "$work/image.bin" && pass "$t" ||
+		fail "$t: flash differs from the image"; }
+fi
+
+t="multi-device download writes every device"
+rm -f "$work/flash"*
+if FAKE_DFUSE_PLAIN=1 FAKE_DFUSE_DEVICES=3 FAKE_DFUSE_FLAKY=7 \
+	run_dfu "$t" 0 -M -D "$work/image.bin"; then
+	expect_output "$t" "3 of 3 devices done" &&
+	expect_output "$t" "Device 001:006: .*retrying" &&
+	for flash in flash flash.2 flash.3; do
+		head -c $size "$work/$flash" | cmp -s - "$work/image.bin" ||
+			{ fail "$t: $flash differs from the image"; break; }
+	done && pass "$t"
+fi
+
+t="multi-device download leaves DfuSe devices to the single device path"
+if FAKE_DFUSE_DEVICES=2 run_dfu "$t" 74 -M -D "$work/image.bin"; then
+	expect_output "$t" "Not supported (DfuSe device)" &&
+	expect_output "$t" "0 of 2 devices done" &&
+	expect_no_log "$t" "write" && pass "$t"
+fi
+
+t="probe reads interface names only of devices matching the serial"
+if FAKE_DFUSE_DEVICES=2 run_dfu "$t" 0 -S SIM00002 -l; then
+	names=$(grep -c "^string 2$" "$work/log")
+	expect_output "$t" 'serial="SIM00002"' &&
+	if [ "$names" -eq 1 ]; then pass "$t"; else
+		fail "$t: $names interface name reads"; fi
+fi
+
+t="descriptor cache is replaced through a temporary file"
+rm -rf "$work/cache"
+if XDG_CACHE_HOME=$work/cache run_dfu "$t" 0 -C -l &&
+	XDG_CACHE_HOME=$work/cache run_dfu "$t" 0 -C -l; then
+	cached=$(ls "$work/cache/dfu-util")
+	if [ "$cached" != "0483-df11-2200-SIM00001" ]; then
+		fail "$t: cache holds '$cached'"
+	else
+		grep -q "^alt 0 0 @Internal Flash" \
+			"$work/cache/dfu-util/$cached" && pass "$t" ||
+			fail "$t: alternate setting name not cached"
+	fi
+fi
+
+t="chunk retried after a USB error is read back before sending it again"
+rm -f "$work/flash"
+if FAKE_DFUSE_FLAKY=9 run_dfu "$t" 0 -a 0 -s 0x08000000 -y \
+	-D "$work/image.bin"; then
+	# the status of 0x08002000 fails before its write, the one of
+	# 0x08003800 after it: only the first needs sending again
+	expect_output "$t" "Retrying chunk at 0x08002000" &&
+	expect_output "$t" "Retrying chunk at 0x08003800" &&
+	expect_output "$t" "Verified $size bytes" &&
+	expect_output "$t" "Recovered from transient USB errors with" &&
+	expect_log "$t" "upload 0x08002000 2048" &&
+	expect_log "$t" "upload 0x08003800 2048" &&
+	if [ "$(grep -c "^write 0x08002000 " "$work/log")" -ne 1 ] ||
+		[ "$(grep -c "^write 0x08003800 " "$work/log")" -ne 1 ]; then
+		fail "$t: retried chunk written twice"
+	else
+		pass "$t"
+	fi
+fi
+
+t="CRC32 mismatch falls back to reading back the element"
+rm -f "$work/flash"
+if FAKE_DFUSE_CRC=1 FAKE_DFUSE_CORRUPT=0x08004321 run_dfu "$t" 74 \
+	-a 0 -s 0x08000000 -y -D "$work/image.bin"; then
+	expect_output "$t" "Reading back element" &&
+	expect_output "$t" "Verify mismatch in page at 0x08004000" &&
+	expect_log "$t" "crc32 0x08000000 $size" &&
+	expect_log "$t" "upload 0x08004000" && pass "$t"
+fi
+
+t="interrupted download is resumed from its journal"
+rm -f "$work/flash" "$work/image.bin.resume"
+# unplugged after 10 blocks, 0x08005000 is in the page at 0x08004000
+if FAKE_DFUSE_UNPLUG=10 run_dfu "$t" 74 -a 0 -s 0x08000000 -Q \
+	-D "$work/image.bin" && expect_log "$t" "unplug"; then
+	grep -q "^dfu-util-resume .* 20480 " "$work/image.bin.resume" ||
+		fail "$t: progress not in the journal"
+fi
+if [ -e "$work/image.bin.resume" ] &&
+	run_dfu "$t" 0 -a 0 -s 0x08000000 -Q -D "$work/image.bin"; then
+	expect_output "$t" "Resuming download at element 1, address 0x08004000" &&
+	expect_no_log "$t" "erase 0x08000000" &&
+	expect_no_log "$t" "write 0x08000000" &&
+	expect_log "$t" "write 0x08004000" &&
+	if [ -e "$work/image.bin.resume" ]; then
+		fail "$t: journal left behind"
+	else
+		head -c $size "$work/flash" | cmp -s - "$work/image.bin" &&
+			pass "$t" || fail "$t: flash differs from the image"
+	fi
+fi
+
+# block <file> <n>: the n-th block of 4096 bytes
+block() {
+	dd if="$1" bs=4096 skip="$2" count=1 2>/dev/null
+}
+
+block "$work/image.bin" 0 >"$work/want"
+block "$work/image.bin" 8 >>"$work/want"
+
+t="upload ranges are written to a sparse file at their offsets"
+rm -f "$work/ranges.bin"
+if run_dfu "$t" 0 -a 0 -r 0x08000000+4096 -r 0x08008000+4096 \
+	-U "$work/ranges.bin"; then
+	expect_output "$t" "Writing 2 ranges as sparse file from 0x08000000" &&
+	if [ "$(wc -c <"$work/ranges.bin")" -ne 36864 ]; then
+		fail "$t: file size $(wc -c <"$work/ranges.bin")"
+	else
+		{ block "$work/ranges.bin" 0; block "$work/ranges.bin" 8; } |
+			cmp -s - "$work/want" && pass "$t" ||
+			fail "$t: ranges differ from the image"
+	fi
+fi
+
+t="upload ranges in a DfuSe file download back to their addresses"
+rm -f "$work/ranges.dfu"
+if run_dfu "$t" 0 -a 0 -r 0x08000000+4096 -r 0x08008000+4096 \
+	-U "$work/ranges.dfu" &&
+	expect_output "$t" "Writing 2 ranges as DfuSe file with 1 images" &&
+	{ rm -f "$work/flash"; run_dfu "$t" 0 -a 0 -D "$work/ranges.dfu"; }; then
+	expect_log "$t" "write 0x08000000" &&
+	expect_log "$t" "write 0x08008800" &&
+	expect_no_log "$t" "write 0x08001000" &&
+	{ block "$work/flash" 0; block "$work/flash" 8; } |
+		cmp -s - "$work/want" && pass "$t" ||
+		fail "$t: flash differs from the ranges"
+fi
+
+t="dump-all reads the whole readable memory into a DfuSe file"
+rm -f "$work/all.dfu"
+if run_dfu "$t" 0 -a 0 -A "$work/all.dfu"; then
+	expect_output "$t" "Uploading range 0x08000000-0x0807ffff" &&
+	# 11 byte prefix, 274 byte target prefix and 8 byte element header
+	tail -c +294 "$work/all.dfu" | head -c $(wc -c <"$work/flash") |
+		cmp -s - "$work/flash" && pass "$t" ||
+		fail "$t: dump differs from the flash"
+fi
+
+t="blank-check skips erasing blank pages by reading them back"
+rm -f "$work/flash"
+if run_dfu "$t" 0 -a 0 -s 0x08000000:blank-check -D "$work/image.bin"; then
+	expect_output "$t" "Blank check skipped 3 of 3" &&
+	expect_log "$t" "upload 0x08000000" &&
+	expect_no_log "$t" "erase" && pass "$t"
+fi
+
+t="blank-check asks the CRC32 command before erasing a page"
+rm -f "$work/flash"
+if FAKE_DFUSE_CRC=1 run_dfu "$t" 0 -a 0 -s 0x08000000:blank-check \
+	-D "$work/image.bin" &&
+	expect_output "$t" "Blank check skipped 3 of 3" &&
+	expect_log "$t" "crc32 0x08004000 16384" &&
+	expect_no_log "$t" "erase" &&
+	FAKE_DFUSE_CRC=1 run_dfu "$t" 0 -a 0 -s 0x08000000:blank-check \
+		-D "$work/image.bin"; then
+	# programmed pages are erased again
+	expect_log "$t" "erase 0x08000000" &&
+	expect_log "$t" "erase 0x08008000" && pass "$t"
+fi
+
+if [ "$failures" -ne 0 ]; then
+	echo "$failures test(s) failed"
+	exit 1
+fi
+echo "All tests passed"